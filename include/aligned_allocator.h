@@ -0,0 +1,41 @@
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include "immintrin.h"
+
+/*
+ * Allocator returning memory aligned to Align bytes, used for buffers
+ * that are loaded or stored with aligned AVX instructions or that we
+ * want to start on a cache line
+ */
+template<typename T, size_t Align = 32>
+struct AlignedAllocator {
+	using value_type = T;
+	template<typename U>
+	struct rebind {
+		using other = AlignedAllocator<U, Align>;
+	};
+
+	AlignedAllocator(){}
+	template<typename U>
+	AlignedAllocator(const AlignedAllocator<U, Align>&){}
+	T* allocate(size_t n){
+		return static_cast<T*>(_mm_malloc(n * sizeof(T), Align));
+	}
+	void deallocate(T *p, size_t){
+		_mm_free(p);
+	}
+};
+template<typename T, typename U, size_t Align>
+bool operator==(const AlignedAllocator<T, Align>&, const AlignedAllocator<U, Align>&){
+	return true;
+}
+template<typename T, typename U, size_t Align>
+bool operator!=(const AlignedAllocator<T, Align>&, const AlignedAllocator<U, Align>&){
+	return false;
+}
+
+#endif
+
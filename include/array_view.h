@@ -0,0 +1,42 @@
+#ifndef ARRAY_VIEW_H
+#define ARRAY_VIEW_H
+
+#include <vector>
+#include <cstddef>
+
+/*
+ * Read only view of a contiguous array owned by someone else, either a
+ * vector or a memory mapped file. The owner must outlive the view
+ */
+template<typename T>
+class ArrayView {
+	const T *ptr;
+	size_t count;
+
+public:
+	ArrayView() : ptr(nullptr), count(0){}
+	ArrayView(const T *ptr, size_t count) : ptr(ptr), count(count){}
+	template<typename A>
+	ArrayView(const std::vector<T, A> &v) : ptr(v.data()), count(v.size()){}
+	inline const T& operator[](size_t i) const {
+		return ptr[i];
+	}
+	inline const T* data() const {
+		return ptr;
+	}
+	inline size_t size() const {
+		return count;
+	}
+	inline bool empty() const {
+		return count == 0;
+	}
+	inline const T* begin() const {
+		return ptr;
+	}
+	inline const T* end() const {
+		return ptr + count;
+	}
+};
+
+#endif
+
@@ -0,0 +1,76 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include "block_queue.h"
+
+struct Scene;
+
+/*
+ * The scheduling settings picked by the autotuner
+ */
+struct TuneSettings {
+	uint32_t block_dim;
+	BlockOrder order;
+	uint32_t n_threads;
+};
+
+/*
+ * 64 bit FNV-1a hash, used to key the tuned settings on the scene and
+ * render settings. Values are hashed by their bytes so they should not
+ * have any padding
+ */
+class Hasher {
+	uint64_t hash;
+
+public:
+	Hasher();
+	void add(const void *data, size_t size);
+	template<typename T>
+	void add(const T &x){
+		add(&x, sizeof(T));
+	}
+	uint64_t value() const;
+};
+
+/*
+ * Hash the scene's geometry, materials and lights. Geometry used through the
+ * Geometry interface is only hashed by its bounds, and the batches of a scene
+ * loaded from a file by the file's header, size and modification time
+ */
+uint64_t scene_hash(const Scene &scene);
+/*
+ * Get the block sizes worth trying, the sizes in [4, 64] that evenly divide the image
+ */
+std::vector<uint32_t> candidate_block_dims(uint32_t width, uint32_t height);
+/*
+ * Get the thread counts worth trying, max_threads down to a quarter of it
+ */
+std::vector<uint32_t> candidate_thread_counts(uint32_t max_threads);
+/*
+ * Pick the fastest settings, trial renders with the settings passed and returns
+ * its speed (e.g. samples per second). The block sizes and orders are searched
+ * with the most threads first, then the thread counts with the best of those,
+ * so the number of trials is the sum of the candidates rather than their product
+ */
+TuneSettings autotune(const std::vector<uint32_t> &block_dims, const std::vector<BlockOrder> &orders,
+		const std::vector<uint32_t> &thread_counts, const std::function<double(const TuneSettings&)> &trial);
+/*
+ * Look up the settings tuned on the machine for the key in the cache file,
+ * returns false if there aren't any or the file can't be read
+ */
+bool load_tuned_settings(const std::string &file, const std::string &machine, uint64_t key,
+		TuneSettings &settings);
+/*
+ * Store the settings for the machine and key in the cache file, replacing any
+ * previously tuned for them. Returns false if the file couldn't be written
+ */
+bool save_tuned_settings(const std::string &file, const std::string &machine, uint64_t key,
+		const TuneSettings &settings);
+
+#endif
+
@@ -0,0 +1,48 @@
+#ifndef BBOX_H
+#define BBOX_H
+
+#include <algorithm>
+#include <cmath>
+#include "vec.h"
+
+/*
+ * An axis aligned bounding box
+ */
+struct BBox {
+	Vec3f min, max;
+
+	// Construct an empty box that any point or box will extend
+	inline BBox() : min(INFINITY, INFINITY, INFINITY), max(-INFINITY, -INFINITY, -INFINITY){}
+	inline BBox(Vec3f min, Vec3f max) : min(min), max(max){}
+	inline void extend(const Vec3f &p){
+		min = Vec3f{std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z)};
+		max = Vec3f{std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z)};
+	}
+	inline void extend(const BBox &b){
+		min = Vec3f{std::min(min.x, b.min.x), std::min(min.y, b.min.y), std::min(min.z, b.min.z)};
+		max = Vec3f{std::max(max.x, b.max.x), std::max(max.y, b.max.y), std::max(max.z, b.max.z)};
+	}
+	inline Vec3f centroid() const {
+		return 0.5f * (min + max);
+	}
+	inline float surface_area() const {
+		const auto d = max - min;
+		return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
+	// Get the axis along which the box is largest
+	inline int max_extent() const {
+		const auto d = max - min;
+		if (d.x > d.y && d.x > d.z){
+			return 0;
+		}
+		return d.y > d.z ? 1 : 2;
+	}
+	// Check if the box is bounded, eg. isn't for some infinite object
+	inline bool is_finite() const {
+		return std::isfinite(min.x) && std::isfinite(min.y) && std::isfinite(min.z)
+			&& std::isfinite(max.x) && std::isfinite(max.y) && std::isfinite(max.z);
+	}
+};
+
+#endif
+
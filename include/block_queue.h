@@ -4,31 +4,129 @@
 #include <vector>
 #include <cstdint>
 #include <utility>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <functional>
 
 /*
- * Queue that hands out blocks of pixels to be rendered in Z-order
+ * Per-worker scheduling statistics tracked by the block queue
+ */
+struct WorkerStats {
+	// Number of blocks rendered and number of successful steals
+	uint64_t blocks, steals;
+	// Time spent looking for work to steal and waiting for the other
+	// workers to finish once there was none left, in seconds
+	double idle;
+
+	WorkerStats() : blocks(0), steals(0), idle(0){}
+};
+
+/*
+ * Order the block queue walks the image's blocks in
+ */
+enum class BlockOrder {
+	// Z-order, which keeps each worker's blocks close together in 2D
+	MORTON,
+	// Left to right along each row of blocks, top to bottom. Rows of blocks are
+	// finished in order so they can be written out while the rest of the image renders
+	SCANLINE
+};
+
+/*
+ * Queue that hands out blocks of pixels to be rendered in Z-order or scanline order
+ * The blocks are split into contiguous ordered ranges, one per
+ * worker, so each worker renders a spatially coherent region of the image
+ * and doesn't touch the others' cache lines. When a worker runs out of blocks
+ * it steals the back half of the largest remaining range from another worker.
+ * Taking and stealing blocks is lock-free, each range is a single atomic word
  */
 class BlockQueue {
+	using Clock = std::chrono::high_resolution_clock;
+
+	// The range of indices into blocks owned by a worker, packed as [begin, end)
+	// into a single word so it can be updated with one CAS. Padded out to keep
+	// each worker's range on its own cache line
+	struct WorkerRange {
+		std::atomic<uint64_t> range;
+		char padding[64 - sizeof(std::atomic<uint64_t>)];
+	};
+	struct WorkerState {
+		WorkerStats stats;
+		// When this worker started looking for work to steal, and when
+		// it found the queue was empty
+		Clock::time_point search_start, finished;
+		bool searching;
+		char padding[64];
+	};
+
 	// Dimensions of a single block
 	uint32_t block_dim;
-	// TODO: should be atomic when multithreading is added
-	int next_block;
-	// Block starting positions
+	BlockOrder order;
+	uint32_t blocks_per_row, n_blocks;
+	// Block starting positions, in units of blocks. Scanline ordered blocks are
+	// computed from their index unless some have been retired, so huge images
+	// don't need a list of every block
 	std::vector<std::pair<uint32_t, uint32_t>> blocks;
+	std::vector<WorkerRange> ranges;
+	std::vector<WorkerState> workers;
 
 public:
 	/*
 	 * Construct a new block queue to  the image of [imgw, imgh]
-	 * pixels with blocks of size [block_dim, block_dim]
+	 * pixels with blocks of size [block_dim, block_dim], which will
+	 * be split between n_workers render threads
 	 */
-	BlockQueue(uint32_t block_dim, uint32_t imgw, uint32_t imgh);
+	BlockQueue(uint32_t block_dim, uint32_t imgw, uint32_t imgh, uint32_t n_workers = 1,
+			BlockOrder order = BlockOrder::MORTON);
+	BlockQueue(const BlockQueue&) = delete;
+	BlockQueue& operator=(const BlockQueue&) = delete;
 	/*
-	 * Get the next block in the queue, returns (-1, -1) if all blocks
-	 * have been taken
+	 * Get the next block for the worker, taking it from the worker's own range
+	 * or stealing from another worker if it's out of blocks.
+	 * Returns (-1, -1) if all blocks have been taken
 	 */
-	std::pair<uint32_t, uint32_t> next();
+	std::pair<uint32_t, uint32_t> next(uint32_t worker = 0);
 	std::pair<uint32_t, uint32_t> end();
+	/*
+	 * Refill the queue with all the blocks for another pass over the image, should
+	 * only be called once all workers have finished taking blocks. The scheduling
+	 * statistics keep accumulating over the passes
+	 */
+	void reset();
+	/*
+	 * Drop the blocks that don't need any more samples from the queue so later passes
+	 * skip them, converged is called with the top left pixel of each block. Should only
+	 * be called between passes, before reset. Returns the number of blocks left
+	 */
+	uint32_t retire(const std::function<bool(const std::pair<uint32_t, uint32_t>&)> &converged);
 	uint32_t get_block_dim() const;
+	BlockOrder get_order() const;
+	/*
+	 * Get the scheduling statistics for each worker, should only be called
+	 * once all workers have finished taking blocks
+	 */
+	std::vector<WorkerStats> get_stats() const;
+	/*
+	 * Print a summary of the scheduling statistics
+	 */
+	void report(std::ostream &os) const;
+
+private:
+	/*
+	 * Get the position of the i'th block in the order, in units of blocks
+	 */
+	std::pair<uint32_t, uint32_t> block_position(uint32_t i) const;
+	/*
+	 * Split the ordered blocks into contiguous ranges for each worker
+	 */
+	void partition();
+	/*
+	 * Try to steal a range of blocks from another worker, on success the
+	 * stolen range is stored as the worker's own range and the first block
+	 * in it is returned in block. Returns false if there are no blocks left
+	 */
+	bool steal(uint32_t worker, uint32_t &block);
 };
 
 #endif
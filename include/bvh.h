@@ -0,0 +1,246 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <cstdint>
+#include "immintrin.h"
+#include "vec.h"
+#include "bbox.h"
+#include "array_view.h"
+#include "counters.h"
+
+/*
+ * A node in the flattened BVH, interior nodes store their first child
+ * immediately after them in the node array and the second child at offset.
+ * Leaf nodes store the range [offset, offset + count) of primitive indices
+ */
+struct BVHNode {
+	float min[3];
+	uint32_t offset;
+	float max[3];
+	// Number of primitives in the leaf, 0 for interior nodes
+	uint16_t count;
+	// Axis the interior node was split on
+	uint8_t axis;
+	uint8_t pad;
+
+	inline bool is_leaf() const {
+		return count != 0;
+	}
+};
+static_assert(sizeof(BVHNode) == 32, "BVHNode should be 32 bytes");
+// Size of the traversal stack, which holds at most one node per level of the BVH
+const uint32_t BVH_STACK_SIZE = 128;
+
+/*
+ * Per-packet values needed to test the packet against BVH nodes, we
+ * compute these once before traversal instead of at each node
+ */
+template<typename B>
+struct BVHRayN {
+	using Float = typename B::Float;
+	Vec3fN<B> inv_d, neg_o_inv_d;
+	// Whether the most of the active rays are travelling along the negative
+	// direction for each axis, used to visit the nearer child first
+	bool dir_neg[3];
+
+	inline BVHRayN(const RayN<B> &ray){
+		const auto one = B::set1(1.f);
+		inv_d = Vec3fN<B>{B::div(one, ray.d.x), B::div(one, ray.d.y), B::div(one, ray.d.z)};
+		neg_o_inv_d = -Vec3fN<B>{B::mul(ray.o.x, inv_d.x), B::mul(ray.o.y, inv_d.y), B::mul(ray.o.z, inv_d.z)};
+		const int active = B::bits(ray.active);
+		const int n_active = _mm_popcnt_u32(active);
+		for (int i = 0; i < 3; ++i){
+			dir_neg[i] = 2 * _mm_popcnt_u32(B::sign_bits(ray.d[i]) & active) > n_active;
+		}
+	}
+	/*
+	 * Test the rays against the node's box, returns the mask of active rays
+	 * that hit the box closer than their current t_max
+	 */
+	inline typename B::Mask intersect(const BVHNode &node, const RayN<B> &ray) const {
+		const auto t0x = B::fmadd(B::set1(node.min[0]), inv_d.x, neg_o_inv_d.x);
+		const auto t0y = B::fmadd(B::set1(node.min[1]), inv_d.y, neg_o_inv_d.y);
+		const auto t0z = B::fmadd(B::set1(node.min[2]), inv_d.z, neg_o_inv_d.z);
+		const auto t1x = B::fmadd(B::set1(node.max[0]), inv_d.x, neg_o_inv_d.x);
+		const auto t1y = B::fmadd(B::set1(node.max[1]), inv_d.y, neg_o_inv_d.y);
+		const auto t1z = B::fmadd(B::set1(node.max[2]), inv_d.z, neg_o_inv_d.z);
+		auto t_near = B::max(B::min(t0x, t1x), B::min(t0y, t1y));
+		t_near = B::max(B::max(t_near, B::min(t0z, t1z)), ray.t_min);
+		auto t_far = B::min(B::max(t0x, t1x), B::max(t0y, t1y));
+		t_far = B::min(B::min(t_far, B::max(t0z, t1z)), ray.t_max);
+		return B::mask_and(B::cmp_le(t_near, t_far), ray.active);
+	}
+};
+using BVHRay8 = BVHRayN<AVX2>;
+
+/*
+ * The BVH's nodes and primitive indices as plain pointers, which is all traversal
+ * needs. This is what the dispatched kernels get since they can't use the BVH
+ * itself. nodes is null if the BVH is empty
+ */
+struct BVHArrays {
+	const BVHNode *nodes;
+	const uint32_t *indices;
+};
+
+/*
+ * Traverse the BVH with the ray packet, calling leaf(prim, ray) for each
+ * primitive in leaves hit by some active rays. During the call ray.active
+ * is narrowed to the rays that hit the leaf's box. leaf should return
+ * the mask of rays that hit the primitive and update ray.t_max
+ * Returns the mask of rays that hit something
+ */
+template<typename B, typename F>
+typename B::Mask bvh_intersect(const BVHArrays &bvh, RayN<B> &ray, const F &leaf){
+	auto hits = B::mask_none();
+	if (!bvh.nodes || B::bits(ray.active) == 0){
+		return hits;
+	}
+	const BVHRayN<B> bvh_ray{ray};
+	const auto active = ray.active;
+	uint32_t stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0){
+		const uint32_t current = stack[--stack_size];
+		const BVHNode &node = bvh.nodes[current];
+		// We test the box when popping the node instead of when pushing it
+		// so t_max is as tight as possible, letting us skip nodes that
+		// are entirely behind hits found since the node was pushed
+		const auto node_hit = bvh_ray.intersect(node, ray);
+		PERF_COUNT(BVH_NODE_TESTS, 1);
+		if (B::bits(node_hit) == 0){
+			continue;
+		}
+		if (node.count != 0){
+			ray.active = node_hit;
+			for (uint32_t i = node.offset; i < node.offset + node.count; ++i){
+				hits = B::mask_or(hits, leaf(bvh.indices[i], ray));
+			}
+			ray.active = active;
+		}
+		// Push the farther child first so we visit the nearer one first
+		else if (bvh_ray.dir_neg[node.axis]){
+			stack[stack_size++] = current + 1;
+			stack[stack_size++] = node.offset;
+		}
+		else {
+			stack[stack_size++] = node.offset;
+			stack[stack_size++] = current + 1;
+		}
+	}
+	return hits;
+}
+/*
+ * Traverse the BVH with the ray packet to find if the rays are blocked by
+ * anything, calling leaf(prim, ray) for each primitive in leaves hit by some
+ * active rays. Rays are removed from ray.active once they're found to be blocked
+ * and traversal stops as soon as all the active rays are blocked.
+ * Returns the mask of rays that are blocked
+ */
+template<typename B, typename F>
+typename B::Mask bvh_occluded(const BVHArrays &bvh, RayN<B> &ray, const F &leaf){
+	auto blocked = B::mask_none();
+	if (!bvh.nodes || B::bits(ray.active) == 0){
+		return blocked;
+	}
+	const BVHRayN<B> bvh_ray{ray};
+	const auto active = ray.active;
+	uint32_t stack[BVH_STACK_SIZE];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+	while (stack_size > 0){
+		const uint32_t current = stack[--stack_size];
+		const BVHNode &node = bvh.nodes[current];
+		ray.active = B::mask_andnot(blocked, active);
+		const auto node_hit = bvh_ray.intersect(node, ray);
+		PERF_COUNT(BVH_NODE_TESTS, 1);
+		if (B::bits(node_hit) == 0){
+			continue;
+		}
+		if (node.count != 0){
+			ray.active = node_hit;
+			for (uint32_t i = node.offset; i < node.offset + node.count; ++i){
+				blocked = B::mask_or(blocked, leaf(bvh.indices[i], ray));
+				ray.active = B::mask_andnot(blocked, ray.active);
+				if (B::bits(ray.active) == 0){
+					break;
+				}
+			}
+			if (B::bits(B::mask_andnot(blocked, active)) == 0){
+				break;
+			}
+		}
+		else {
+			stack[stack_size++] = node.offset;
+			stack[stack_size++] = current + 1;
+		}
+	}
+	ray.active = B::mask_andnot(blocked, active);
+	return blocked;
+}
+
+/*
+ * A bounding volume hierarchy built with the surface area heuristic
+ * over a list of primitive bounding boxes. The BVH doesn't know anything
+ * about the primitives themselves, traversal calls back into a leaf
+ * function to intersect the primitives referenced by leaves. The nodes and
+ * indices are either built and owned by the BVH or viewed in place from a
+ * mapped scene file
+ */
+class BVH {
+	std::vector<BVHNode> node_store;
+	std::vector<uint32_t> index_store;
+	ArrayView<BVHNode> nodes;
+	// Primitive indices referenced by the leaves
+	ArrayView<uint32_t> indices;
+
+public:
+	BVH();
+	/*
+	 * Use nodes and indices stored elsewhere, which must outlive the BVH
+	 */
+	BVH(ArrayView<BVHNode> nodes, ArrayView<uint32_t> indices);
+	// The views would point into the other BVH's vectors if we copied them
+	BVH(const BVH&) = delete;
+	BVH& operator=(const BVH&) = delete;
+	BVH(BVH&&) = default;
+	BVH& operator=(BVH&&) = default;
+	/*
+	 * Build the BVH over the primitives with the bounding boxes passed.
+	 * Leaves will hold at most max_leaf primitives. Large subtrees are
+	 * built in parallel
+	 */
+	BVH(const std::vector<BBox> &bounds, uint32_t max_leaf = 4);
+	/*
+	 * Traverse the BVH with the 8 wide ray packet, see bvh_intersect
+	 */
+	template<typename F>
+	__m256 intersect(Ray8 &ray, const F &leaf) const {
+		return bvh_intersect(arrays(), ray, leaf);
+	}
+	/*
+	 * Find which rays in the 8 wide packet are blocked, see bvh_occluded
+	 */
+	template<typename F>
+	__m256 occluded(Ray8 &ray, const F &leaf) const {
+		return bvh_occluded(arrays(), ray, leaf);
+	}
+	inline BVHArrays arrays() const {
+		return BVHArrays{nodes.empty() ? nullptr : nodes.data(), indices.data()};
+	}
+	/*
+	 * Replace the leaves' primitive indices with their position in the index
+	 * array, for primitives that have been sorted into the order given by
+	 * get_indices so each leaf references a contiguous range of them
+	 */
+	void renumber_primitives();
+	ArrayView<uint32_t> get_indices() const;
+	ArrayView<BVHNode> get_nodes() const;
+	// Get the bounds of the entire BVH
+	BBox bounds() const;
+};
+
+#endif
+
@@ -4,6 +4,15 @@
 #include "immintrin.h"
 #include "vec.h"
 
+/*
+ * Placement of a perspective camera independent of the image it renders
+ * to, as set up by the scene. fovy is the vertical field of view in degrees
+ */
+struct SceneCamera {
+	Vec3f pos, center, up;
+	float fovy;
+};
+
 /*
  * Simple perspective camera. Perhaps later switch to have transformation matrices?
  * would make it easier to have interactive rendering and could add in my glt arball camera
@@ -13,13 +22,27 @@ struct PerspectiveCamera {
 	Vec3f pos, dir, up, dir_top_left, screen_du, screen_dv;
 
 	PerspectiveCamera(Vec3f pos, Vec3f center, Vec3f up, float fovy, float aspect);
+	PerspectiveCamera(const SceneCamera &camera, float aspect);
 	/*
-	 * Generate a ray packet sampling the 8 screen positions passed,
+	 * Generate a ray packet sampling the screen positions passed,
 	 * screen positions should be normalized to be between [0, 1] in
 	 * each dimension
 	 */
-	void generate_rays(Ray8 &rays, const Vec2f_8 &samples) const;
+	template<typename B>
+	void generate_rays(RayN<B> &rays, const Vec2fN<B> &samples) const;
 };
 
+template<typename B>
+inline void PerspectiveCamera::generate_rays(RayN<B> &rays, const Vec2fN<B> &samples) const {
+	rays.o = Vec3fN<B>{pos};
+	rays.d = Vec3fN<B>{dir_top_left};
+	const auto u_step = samples.x * Vec3fN<B>{screen_du};
+	const auto v_step = samples.y * Vec3fN<B>{screen_dv};
+	rays.d = rays.d + u_step + v_step;
+	rays.d.normalize();
+	rays.t_min = B::set1(0);
+	rays.t_max = B::set1(INFINITY);
+}
+
 #endif
 
@@ -6,10 +6,11 @@
 #include <cassert>
 #include <ostream>
 #include "immintrin.h"
+#include "simd.h"
 
 //Since we fwrite this struct directly and PPM only takes RGB (24 bits)
 //we can't allow any padding to be added onto the end
-#pragma pack(1)
+#pragma pack(push, 1)
 struct Color24 {
 	uint8_t r, g, b;
 
@@ -25,6 +26,7 @@ struct Color24 {
 		}
 	}
 };
+#pragma pack(pop)
 
 /*
  * Struct storing a single RGB floating point color
@@ -87,97 +89,87 @@ bool operator==(const Colorf &a, const Colorf &b);
 bool operator!=(const Colorf &a, const Colorf &b);
 std::ostream& operator<<(std::ostream &os, const Colorf &c);
 
-// Compute x^y, this just calls pow a bunch, it doesn't look like there's an AVX pow instruction
-inline __m256 vpow(__m256 vx, __m256 vy){
-	float *x = (float*)&vx;
-	float *y = (float*)&vy;
-	float z[8] = {0};
-	for (int i = 0; i < 8; ++i){
-		z[i] = std::pow(x[i], y[i]);
-	}
-	return _mm256_loadu_ps(z);
-}
-// Compute sRGB values for some color channel
-inline __m256 convert_srgb(__m256 x){
-	const static auto a = _mm256_set1_ps(0.055f);
-	const static auto b = _mm256_rcp_ps(_mm256_set1_ps(2.4f));		
-	const auto mask = _mm256_cmp_ps(x, _mm256_set1_ps(0.0031308f), _CMP_LE_OQ);
-	// We need to compute both branches for the sRGB conversion then pick
-	// the right one based on the mask
-	const auto y = _mm256_mul_ps(x, _mm256_set1_ps(12.92f));
-	const auto z = _mm256_fmsub_ps(_mm256_set1_ps(1.055f), vpow(x, b), a);
-	return _mm256_blendv_ps(y, z, mask);
-}
-
 /*
- * Floating point color struct storing 8 RGB colors
+ * Floating point color struct storing a packet of RGB colors
  */
-struct Colorf_8 {
-	__m256 r, g, b;
+template<typename B>
+struct ColorfN {
+	using Float = typename B::Float;
+	Float r, g, b;
 
 	/*
 	 * Initialize the RGB values to the same value
 	 */
-	inline Colorf_8(float c = 0) : r(_mm256_set1_ps(c)), g(r), b(r){}
+	inline ColorfN(float c = 0) : r(B::set1(c)), g(r), b(r){}
 	/*
 	 * Create an RGB color
 	 */
-	inline Colorf_8(float r, float g, float b) : r(_mm256_set1_ps(r)), g(_mm256_set1_ps(g)), b(_mm256_set1_ps(b)){}
-	inline Colorf_8(Colorf c) : r(_mm256_set1_ps(c.r)), g(_mm256_set1_ps(c.g)), b(_mm256_set1_ps(c.b)){}
-	inline Colorf_8(__m256 r, __m256 g, __m256 b) : r(r), g(g), b(b){}
+	inline ColorfN(float r, float g, float b) : r(B::set1(r)), g(B::set1(g)), b(B::set1(b)){}
+	inline ColorfN(Colorf c) : r(B::set1(c.r)), g(B::set1(c.g)), b(B::set1(c.b)){}
+	inline ColorfN(Float r, Float g, Float b) : r(r), g(g), b(b){}
 	/*
 	 * Normalize the floating point color values to be clamped between 0-1
 	 */
 	inline void normalize(){
-		const auto zero = _mm256_set1_ps(0);
-		const auto one = _mm256_set1_ps(1);
-		r = _mm256_max_ps(zero, _mm256_min_ps(one, r));
-		g = _mm256_max_ps(zero, _mm256_min_ps(one, g));
-		b = _mm256_max_ps(zero, _mm256_min_ps(one, b));
+		const auto zero = B::set1(0);
+		const auto one = B::set1(1);
+		r = B::max(zero, B::min(one, r));
+		g = B::max(zero, B::min(one, g));
+		b = B::max(zero, B::min(one, b));
 	}
-	inline Colorf_8 normalized() const {
-		const auto zero = _mm256_set1_ps(0);
-		const auto one = _mm256_set1_ps(1);
-		return Colorf_8{_mm256_max_ps(zero, _mm256_min_ps(one, r)),
-			_mm256_max_ps(zero, _mm256_min_ps(one, g)),
-			_mm256_max_ps(zero, _mm256_min_ps(one, b))};
+	inline ColorfN normalized() const {
+		const auto zero = B::set1(0);
+		const auto one = B::set1(1);
+		return ColorfN{B::max(zero, B::min(one, r)), B::max(zero, B::min(one, g)),
+			B::max(zero, B::min(one, b))};
+	}
+	/*
+	 * Compute the luminance of the colors
+	 */
+	inline Float luminance() const {
+		return B::fmadd(B::set1(0.2126f), r, B::fmadd(B::set1(0.7152f), g, B::mul(B::set1(0.0722f), b)));
 	}
 };
-inline Colorf_8 operator+(const Colorf_8 &a, const Colorf_8 &b){
-	return Colorf_8{_mm256_add_ps(a.r, b.r), _mm256_add_ps(a.g, b.g),
-		_mm256_add_ps(a.b, b.b)};
+template<typename B>
+inline ColorfN<B> operator+(const ColorfN<B> &a, const ColorfN<B> &b){
+	return ColorfN<B>{B::add(a.r, b.r), B::add(a.g, b.g), B::add(a.b, b.b)};
 }
-inline Colorf_8 operator-(const Colorf_8 &a, const Colorf_8 &b){
-	return Colorf_8{_mm256_sub_ps(a.r, b.r), _mm256_sub_ps(a.g, b.g),
-		_mm256_sub_ps(a.b, b.b)};
+template<typename B>
+inline ColorfN<B> operator-(const ColorfN<B> &a, const ColorfN<B> &b){
+	return ColorfN<B>{B::sub(a.r, b.r), B::sub(a.g, b.g), B::sub(a.b, b.b)};
 }
-inline Colorf_8 operator*(const Colorf_8 &a, const Colorf_8 &b){
-	return Colorf_8{_mm256_mul_ps(a.r, b.r), _mm256_mul_ps(a.g, b.g),
-		_mm256_mul_ps(a.b, b.b)};
+template<typename B>
+inline ColorfN<B> operator*(const ColorfN<B> &a, const ColorfN<B> &b){
+	return ColorfN<B>{B::mul(a.r, b.r), B::mul(a.g, b.g), B::mul(a.b, b.b)};
 }
-inline Colorf_8 operator*(const Colorf_8 &a, __m256 s){
-	return Colorf_8{_mm256_mul_ps(a.r, s), _mm256_mul_ps(a.g, s),
-		_mm256_mul_ps(a.b, s)};
+template<typename B>
+inline ColorfN<B> operator*(const ColorfN<B> &a, typename B::Float s){
+	return ColorfN<B>{B::mul(a.r, s), B::mul(a.g, s), B::mul(a.b, s)};
 }
-inline Colorf_8 operator*(__m256 s, const Colorf_8 &a){
-	return Colorf_8{_mm256_mul_ps(a.r, s), _mm256_mul_ps(a.g, s),
-		_mm256_mul_ps(a.b, s)};
+template<typename B>
+inline ColorfN<B> operator*(typename B::Float s, const ColorfN<B> &a){
+	return ColorfN<B>{B::mul(a.r, s), B::mul(a.g, s), B::mul(a.b, s)};
 }
-inline Colorf_8 operator/(const Colorf_8 &a, const Colorf_8 &b){
-	return Colorf_8{_mm256_div_ps(a.r, b.r), _mm256_div_ps(a.g, b.g),
-		_mm256_div_ps(a.b, b.b)};
+template<typename B>
+inline ColorfN<B> operator/(const ColorfN<B> &a, const ColorfN<B> &b){
+	return ColorfN<B>{B::div(a.r, b.r), B::div(a.g, b.g), B::div(a.b, b.b)};
 }
-inline Colorf_8 operator/(const Colorf_8 &c, __m256 s){
-	const auto vs = _mm256_rcp_ps(s);
-	return Colorf_8{_mm256_mul_ps(c.r, vs), _mm256_mul_ps(c.g, vs),
-		_mm256_mul_ps(c.b, vs)};
+template<typename B>
+inline ColorfN<B> operator/(const ColorfN<B> &c, typename B::Float s){
+	const auto vs = B::rcp(s);
+	return ColorfN<B>{B::mul(c.r, vs), B::mul(c.g, vs), B::mul(c.b, vs)};
 }
-inline std::ostream& operator<<(std::ostream &os, const Colorf_8 &c){
-	os << "Colorf_8:\nr = " << c.r
+template<typename B>
+inline std::ostream& operator<<(std::ostream &os, const ColorfN<B> &c){
+	os << "Colorf_" << B::WIDTH << ":\nr = " << c.r
 		<< "\ng = " << c.g
 		<< "\nb = " << c.b;
 	return os;
 }
 
+using Colorf_8 = ColorfN<AVX2>;
+#ifdef __AVX512F__
+using Colorf_16 = ColorfN<AVX512>;
 #endif
 
+#endif
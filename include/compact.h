@@ -0,0 +1,34 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <cstdint>
+#include "immintrin.h"
+
+/*
+ * Table of permutations for _mm256_permutevar8x32 that move the lanes
+ * set in each 8 bit mask to the front of the vector, keeping their order
+ */
+struct CompactTable {
+	int32_t perm[256][8];
+};
+extern const CompactTable COMPACT_TABLE;
+
+inline __m256i compact_permutation(int mask){
+	return _mm256_loadu_si256((const __m256i*)COMPACT_TABLE.perm[mask & 0xff]);
+}
+/*
+ * Store the lanes of v set in mask contiguously to out, returns the number
+ * of lanes stored. Note: all 8 lanes are written so out must have room
+ * for 8 values even if fewer are set
+ */
+inline int compress_store(float *out, __m256 v, int mask){
+	_mm256_storeu_ps(out, _mm256_permutevar8x32_ps(v, compact_permutation(mask)));
+	return _mm_popcnt_u32(mask);
+}
+inline int compress_store(int32_t *out, __m256i v, int mask){
+	_mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(v, compact_permutation(mask)));
+	return _mm_popcnt_u32(mask);
+}
+
+#endif
+
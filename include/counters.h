@@ -0,0 +1,95 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <string>
+#include <cstdint>
+
+/*
+ * Counters of the work done in the hot paths: packets traced and how many of
+ * their lanes are active, shadow rays, BVH node and primitive tests and packets
+ * shaded. They're only compiled in when building with the MICRO_PACKET_COUNTERS
+ * option, otherwise PERF_COUNT expands to nothing and its count isn't evaluated.
+ * Each thread counts into its own copy which it merges into the totals once
+ * it's done rendering a pass, so counting is a single add to a thread local
+ */
+enum class Counter {
+	// Packets traced by Scene::intersect or the intersect_batches kernel, the lanes in
+	// them, the lanes active on entry and the lanes that hit
+	RAY_PACKETS,
+	RAY_SLOTS,
+	RAY_LANES,
+	RAY_HITS,
+	// The same for Scene::occluded and the occluded_batches kernel, with the lanes blocked
+	SHADOW_PACKETS,
+	SHADOW_SLOTS,
+	SHADOW_RAYS,
+	SHADOW_BLOCKED,
+	// Light samples dropped before tracing a shadow ray since they're behind the surface
+	SHADOW_CULLED,
+	BVH_NODE_TESTS,
+	// Tests of a packet against a single primitive
+	PRIMITIVE_TESTS,
+	// Packets of hits shaded and the number of lanes in them
+	SHADE_PACKETS,
+	SHADE_LANES,
+	COUNT
+};
+
+struct PerfCounters {
+	uint64_t values[static_cast<int>(Counter::COUNT)];
+
+	inline uint64_t operator[](Counter c) const {
+		return values[static_cast<int>(c)];
+	}
+};
+
+#ifdef MICRO_PACKET_COUNTERS
+const bool COUNTERS_ENABLED = true;
+#define PERF_COUNT(counter, n) (thread_counters.values[static_cast<int>(Counter::counter)] += (n))
+#else
+const bool COUNTERS_ENABLED = false;
+#define PERF_COUNT(counter, n) ((void)0)
+#endif
+
+// The calling thread's counts since it last merged them
+extern thread_local PerfCounters thread_counters;
+
+/*
+ * Add the calling thread's counts to the totals and reset them
+ */
+void merge_thread_counters();
+/*
+ * Get the counts merged by all threads so far
+ */
+PerfCounters total_counters();
+/*
+ * Clear the totals, e.g. to drop the counts of trial renders. Should only
+ * be called while no threads are rendering
+ */
+void reset_total_counters();
+const char* counter_name(Counter c);
+/*
+ * Write the counts to a JSON file along with the rates derived from them,
+ * e.g. the average lane occupancy and primitive tests per packet
+ */
+bool save_counters_json(const std::string &file, const PerfCounters &counters);
+
+/*
+ * What the per-pixel cost AOV measures: TSC cycles or the BVH node and
+ * primitive tests done, which need the counters to be compiled in
+ */
+enum class CostMetric { CYCLES, TESTS };
+
+/*
+ * Pick the cost metric, must be called before any threads start rendering.
+ * Returns false if the metric isn't available in this build
+ */
+bool set_cost_metric(CostMetric metric);
+/*
+ * Read the cost metric's running count for the calling thread, the cost of
+ * some work is the difference between the counts before and after it
+ */
+uint64_t cost_timestamp();
+
+#endif
+
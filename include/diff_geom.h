@@ -4,14 +4,20 @@
 #include "vec.h"
 
 /*
- * Structure storing 8 differential geomtry entries
+ * Structure storing a packet of differential geomtry entries
  */
-struct DiffGeom8 {
-	Vec3f_8 point, normal;
-	__m256i material_id;
+template<typename B>
+struct DiffGeomN {
+	Vec3fN<B> point, normal;
+	typename B::Int material_id;
 
-	DiffGeom8() : point(0), normal(0), material_id(_mm256_set1_epi32(-1)){}
+	DiffGeomN() : point(0), normal(0), material_id(B::set1i(-1)){}
 };
 
+using DiffGeom8 = DiffGeomN<AVX2>;
+#ifdef __AVX512F__
+using DiffGeom16 = DiffGeomN<AVX512>;
+#endif
+
 #endif
 
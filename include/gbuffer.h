@@ -0,0 +1,196 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include "vec.h"
+#include "color.h"
+#include "diff_geom.h"
+#include "soa_geometry.h"
+#include "ray_stream.h"
+
+class RenderTile;
+struct Scene;
+class RNG;
+
+/*
+ * The hits with a single material recorded while rendering a block, stored
+ * as a structure of arrays so we can shade them in full 8 wide batches
+ */
+struct HitRecords {
+	// Hit point, surface normal, incident ray direction and the throughput of the path
+	// that reached the hit
+	AlignedVector<float> px, py, pz, nx, ny, nz, dx, dy, dz, tr, tg, tb;
+	// The block sample each hit contributes to
+	AlignedVector<int32_t> sample;
+	uint32_t count;
+
+	HitRecords();
+	/*
+	 * Append the lanes set in mask to the records, compacting them together
+	 */
+	void append(const Vec3f_8 &p, const Vec3f_8 &n, const Vec3f_8 &d, const Colorf_8 &t,
+			__m256i sample_id, int mask);
+	void clear();
+	/*
+	 * Load the 8 records starting at i, returns the mask of lanes
+	 * that hold valid records
+	 */
+	__m256 load(uint32_t i, Vec3f_8 &p, Vec3f_8 &n, Vec3f_8 &d, Colorf_8 &t, __m256i &sample_id) const;
+
+private:
+	void reserve(uint32_t n);
+};
+
+/*
+ * Geometry buffer for deferred shading, the hits for a whole block are written
+ * here bucketed by material and shaded after all the block's samples have been
+ * traced. This way each material is shaded for full packets of hits instead of
+ * for whichever few lanes of a packet happened to hit it.
+ * Specular hits spawn reflected and refracted rays, instead of recursing for each
+ * packet all the bounces spawned by a generation of hits are queued in a ray stream
+ * and traced together as the next generation. The stream is compacted so the packets
+ * stay full no matter how many lanes terminated. When the scene allows it the streams,
+ * and the primary rays, are traced by the dispatched kernels at the selected tier's width
+ */
+class GBuffer {
+	/*
+	 * The image samples taken in the block and the light they've gathered so far.
+	 * Samples are stored in whole packets, lanes that weren't active are kept but
+	 * flagged so they aren't written to the image
+	 */
+	struct BlockSamples {
+		AlignedVector<float> sx, sy, r, g, b, active;
+		uint32_t count;
+
+		BlockSamples();
+		/*
+		 * Add the packet of samples, returns the ids assigned to each lane
+		 */
+		__m256i add(const Vec2f_8 &s, __m256 mask);
+		/*
+		 * Add the light carried by the lanes set in mask to the samples
+		 */
+		void add_light(__m256i id, const Colorf_8 &c, int mask);
+		/*
+		 * Write all the samples out to the tile
+		 */
+		void write(RenderTile &tile) const;
+		void clear();
+	};
+	/*
+	 * The per ray data for rays queued in a stream, indexed by the ray ids. This is
+	 * the light carried by shadow rays or the throughput of bounce rays, along with
+	 * the block sample they contribute to
+	 */
+	struct RayPayload {
+		AlignedVector<float> r, g, b;
+		AlignedVector<int32_t> sample;
+		uint32_t count;
+
+		RayPayload();
+		/*
+		 * Append the lanes set in mask, returns the index of the first one appended
+		 */
+		int32_t append(const Colorf_8 &c, __m256i sample_id, int mask);
+		/*
+		 * Gather the payload for the rays with the ids passed
+		 */
+		void load(__m256i id, __m256 mask, Colorf_8 &c, __m256i &sample_id) const;
+		void clear();
+	};
+	/*
+	 * The hits found by the intersect_batches kernel for the rays in a stream
+	 */
+	struct BatchHits {
+		KernelVector<float> px, py, pz, nx, ny, nz;
+		KernelVector<int32_t> material_id, hit;
+
+		/*
+		 * Make room for the hits of n rays
+		 */
+		void reserve(uint32_t n);
+		/*
+		 * Get the arrays for the kernel to write the hits to, starting at hit first
+		 */
+		HitArrays arrays(uint32_t first);
+		/*
+		 * Load the 8 hits starting at i, returns the mask of rays that hit
+		 */
+		__m256 load(uint32_t i, DiffGeom8 &dg) const;
+	};
+
+	std::vector<HitRecords> materials;
+	RayMode ray_mode;
+	// Maximum number of specular bounces to follow
+	uint32_t max_depth;
+	BlockSamples samples;
+	RayStream shadow_rays, bounce_rays;
+	RayPayload shadow_payload, bounce_payload;
+	// The primary rays queued to be traced with the kernels, in the order of their samples
+	// starting from sample first_primary
+	RayStream primary_rays;
+	uint32_t first_primary;
+	BatchHits batch_hits;
+	KernelVector<int32_t> blocked;
+
+public:
+	GBuffer(size_t n_materials, RayMode ray_mode = RayMode::STREAM, uint32_t max_depth = 5);
+	/*
+	 * Record the block's primary rays for the active lanes of the packet and their
+	 * hits for the lanes set in hits, the hits are bucketed by their material id.
+	 * Hits with an invalid material id are dropped
+	 */
+	void add(const Ray8 &packet, const DiffGeom8 &dg, const Vec2f_8 &samples, __m256 hits);
+	/*
+	 * Check if the rays are traced with the dispatched kernels' intersect_batches and
+	 * occluded_batches, which is done in the stream modes if the scene allows it and
+	 * the kernels aren't 8 wide
+	 */
+	bool traces_batches(const Scene &scene) const;
+	/*
+	 * Record the block's primary rays for the active lanes of the packet to be traced
+	 * with the kernels. The rays are traced in chunks once enough are queued, which
+	 * records their hits as add would and writes the samples' AOVs and cost to the tile
+	 */
+	void queue_primary(const Scene &scene, const Ray8 &packet, const Vec2f_8 &samples, RenderTile &tile);
+	/*
+	 * Trace the primary rays still queued, must be called once the block's samples have been taken
+	 */
+	void trace_primary(const Scene &scene, RenderTile &tile);
+	/*
+	 * Shade all the recorded hits and write the block's samples to the tile. Diffuse hits
+	 * get direct lighting from one of the scene's lights picked with rng, light samples on the back side of the
+	 * surface are culled before tracing shadow rays. In the stream modes the shadow rays
+	 * for all the hits are queued up and traced in full packets once every material has
+	 * been shaded. Specular hits spawn the next generation of rays, which are traced
+	 * and shaded in turn until none are left or max_depth bounces have been made
+	 */
+	void shade(const Scene &scene, RNG &rng, RenderTile &tile);
+	void clear();
+	const HitRecords& records(size_t material) const;
+
+private:
+	/*
+	 * Record the hits for the lanes set in hits, bucketed by their material id
+	 */
+	void add_hits(const Ray8 &packet, const DiffGeom8 &dg, const Colorf_8 &throughput,
+			__m256i sample_id, __m256 hits);
+	/*
+	 * Shade the hits recorded for one generation of rays, spawning bounce rays for
+	 * specular hits if bounce is set
+	 */
+	void shade_hits(const Scene &scene, RNG &rng, bool bounce);
+	/*
+	 * Trace the queued shadow rays and add the light they carry for the
+	 * unoccluded ones to their samples
+	 */
+	void trace_shadow_rays(const Scene &scene);
+	/*
+	 * Trace the queued bounce rays and record their hits as the next generation
+	 */
+	void trace_bounce_rays(const Scene &scene);
+};
+
+#endif
+
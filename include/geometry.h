@@ -3,12 +3,24 @@
 
 #include "immintrin.h"
 #include "diff_geom.h"
+#include "bbox.h"
 
 struct Geometry {
 	/*
 	 * Test a ray packet for intersection against the object
 	 */
 	virtual __m256 intersect(Ray8 &ray, DiffGeom8 &dg) const = 0;
+	/*
+	 * Test if the active rays hit the object anywhere in [t_min, t_max], returns
+	 * the mask of rays that are blocked. Unlike intersect this doesn't find
+	 * the closest hit or compute any differential geometry
+	 */
+	virtual __m256 occluded(Ray8 &ray) const = 0;
+	/*
+	 * Get the object's bounding box, infinite objects should return
+	 * a box with infinite bounds
+	 */
+	virtual BBox bounds() const = 0;
 };
 
 #endif
@@ -0,0 +1,29 @@
+#ifndef ISA_H
+#define ISA_H
+
+#include <string>
+
+/*
+ * The instruction set tiers we build kernels for, in increasing order.
+ * NONE is for CPUs without AVX2, which the renderer can't run on
+ */
+enum class ISA { NONE, AVX2, AVX512 };
+
+/*
+ * Find the highest ISA tier supported by the CPU and OS we're running on
+ * using CPUID, returns NONE if the CPU doesn't even support AVX2
+ */
+ISA detect_isa();
+const char* isa_name(ISA isa);
+/*
+ * Parse an ISA tier name as accepted on the command line (avx2 or avx512),
+ * returns false if the name isn't recognized
+ */
+bool parse_isa(const char *name, ISA &isa);
+/*
+ * Get the CPU's brand string from CPUID, e.g. to tell machines apart
+ */
+std::string cpu_name();
+
+#endif
+
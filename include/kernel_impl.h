@@ -0,0 +1,148 @@
+#ifndef KERNEL_IMPL_H
+#define KERNEL_IMPL_H
+
+#include <cmath>
+#include "simd.h"
+#include "vec.h"
+#include "diff_geom.h"
+#include "soa_geometry.h"
+#include "counters.h"
+#include "render_target.h"
+#include "kernels.h"
+
+/*
+ * Implementations of the dispatched kernels, written once against the SIMD backend.
+ * This should only be included by the per-ISA kernel translation units, each of
+ * which builds the table for its own backend with make_kernels. Everything here is
+ * kept in an anonymous namespace so the tiers' copies can't be mixed up at link time.
+ * The shared code the kernels call into is templated on the backend, so its symbols
+ * name the tier they were built for. Kernels mustn't call non-template inline
+ * functions outside this file, e.g. Vec3f members or the 8 wide Sphere::intersect
+ * override: the linker keeps one copy of those for the whole program, which could
+ * be a tier's
+ */
+namespace {
+
+template<typename B>
+RayN<B> load_rays(const RayArrays &rays, uint32_t i){
+	RayN<B> r{Vec3fN<B>{B::load(rays.ox + i), B::load(rays.oy + i), B::load(rays.oz + i)},
+		Vec3fN<B>{B::load(rays.dx + i), B::load(rays.dy + i), B::load(rays.dz + i)}};
+	r.t_min = B::load(rays.t_min + i);
+	r.t_max = B::load(rays.t_max + i);
+	return r;
+}
+// Get the rays starting at i that are among the first n and have a non-empty t range
+template<typename B>
+typename B::Mask active_rays(const RayN<B> &r, uint32_t i, uint32_t n){
+	const auto in_range = B::cmp_lt(B::add(B::iota(), B::set1i(i)), B::set1i(n));
+	return B::mask_and(in_range, B::cmp_lt(r.t_min, r.t_max));
+}
+
+template<typename B>
+uint32_t intersect_batches_kernel(const BatchArrays &batches, const RayArrays &rays, const HitArrays &out,
+		uint32_t n)
+{
+	uint32_t n_hits = 0;
+	for (uint32_t i = 0; i < n; i += B::WIDTH){
+		auto r = load_rays<B>(rays, i);
+		r.active = active_rays(r, i, n);
+		PERF_COUNT(RAY_PACKETS, 1);
+		PERF_COUNT(RAY_SLOTS, B::WIDTH);
+		PERF_COUNT(RAY_LANES, _mm_popcnt_u32(B::bits(r.active)));
+		DiffGeomN<B> dg;
+		const auto hits = B::mask_and(intersect_batches(batches, r, dg), r.active);
+		const uint32_t count = _mm_popcnt_u32(B::bits(hits));
+		PERF_COUNT(RAY_HITS, count);
+		n_hits += count;
+		B::store(rays.t_max + i, r.t_max);
+		B::store(out.px + i, dg.point.x);
+		B::store(out.py + i, dg.point.y);
+		B::store(out.pz + i, dg.point.z);
+		B::store(out.nx + i, dg.normal.x);
+		B::store(out.ny + i, dg.normal.y);
+		B::store(out.nz + i, dg.normal.z);
+		B::store(out.material_id + i, dg.material_id);
+		B::store(out.hit + i, B::select(B::set1i(0), B::set1i(-1), hits));
+	}
+	return n_hits;
+}
+template<typename B>
+uint32_t occluded_batches_kernel(const BatchArrays &batches, const RayArrays &rays, int32_t *blocked, uint32_t n){
+	uint32_t n_blocked = 0;
+	for (uint32_t i = 0; i < n; i += B::WIDTH){
+		auto r = load_rays<B>(rays, i);
+		r.active = active_rays(r, i, n);
+		PERF_COUNT(SHADOW_PACKETS, 1);
+		PERF_COUNT(SHADOW_SLOTS, B::WIDTH);
+		PERF_COUNT(SHADOW_RAYS, _mm_popcnt_u32(B::bits(r.active)));
+		const auto b = occluded_batches(batches, r);
+		const uint32_t count = _mm_popcnt_u32(B::bits(b));
+		PERF_COUNT(SHADOW_BLOCKED, count);
+		n_blocked += count;
+		B::store(blocked + i, B::select(B::set1i(0), B::set1i(-1), b));
+	}
+	return n_blocked;
+}
+template<typename B>
+void resolve_kernel(const Pixel *pixels, uint8_t *out, uint32_t n, const ResolveParams &params){
+	alignas(64) int32_t r[B::WIDTH], g[B::WIDTH], b[B::WIDTH];
+	const float *channels = &pixels[0].r;
+	const int32_t *srgb = srgb_table();
+	const auto zero = B::set1(0);
+	const auto one = B::set1(1);
+	const auto exposure = B::set1(exp2f(params.exposure));
+	const auto table_scale = B::set1(SRGB_TABLE_SIZE - 1);
+	const auto last = B::set1i(static_cast<int32_t>(n) - 1);
+	// Convert a channel from linear to 8 bit sRGB through the lookup table
+	auto to_srgb = [&](typename B::Float x){
+		switch (params.tonemap){
+			case Tonemap::REINHARD:
+				x = B::div(x, B::add(one, x));
+				break;
+			case Tonemap::ACES:
+				x = B::div(B::mul(x, B::fmadd(B::set1(2.51f), x, B::set1(0.03f))),
+					B::fmadd(x, B::fmadd(B::set1(2.43f), x, B::set1(0.59f)), B::set1(0.14f)));
+				break;
+			default:
+				break;
+		}
+		x = B::max(zero, B::min(one, x));
+		return B::gather(srgb, B::cvt_int(B::mul(x, table_scale)));
+	};
+	for (uint32_t i = 0; i < n; i += B::WIDTH){
+		const uint32_t count = n - i < B::WIDTH ? n - i : B::WIDTH;
+		// Gather the channels straight out of the pixel structs, lanes past the end
+		// repeat the last pixel and are dropped when writing out
+		const auto pixel = B::slli(B::min(B::add(B::iota(), B::set1i(i)), last), 2);
+		const auto weight = B::gather(channels, B::add(pixel, B::set1i(3)));
+		// Pixels that didn't get any samples are left black
+		const auto has_samples = B::cmp_gt(weight, zero);
+		const auto scale = B::select(zero, B::div(exposure, B::select(one, weight, has_samples)), has_samples);
+		B::store(r, to_srgb(B::mul(B::gather(channels, pixel), scale)));
+		B::store(g, to_srgb(B::mul(B::gather(channels, B::add(pixel, B::set1i(1))), scale)));
+		B::store(b, to_srgb(B::mul(B::gather(channels, B::add(pixel, B::set1i(2))), scale)));
+		const int32_t *first = params.bgr ? b : r;
+		const int32_t *third = params.bgr ? r : b;
+		for (uint32_t j = 0; j < count; ++j, out += 3){
+			out[0] = static_cast<uint8_t>(first[j]);
+			out[1] = static_cast<uint8_t>(g[j]);
+			out[2] = static_cast<uint8_t>(third[j]);
+		}
+	}
+}
+
+template<typename B>
+Kernels make_kernels(ISA isa){
+	Kernels k;
+	k.isa = isa;
+	k.width = B::WIDTH;
+	k.intersect_batches = intersect_batches_kernel<B>;
+	k.occluded_batches = occluded_batches_kernel<B>;
+	k.resolve = resolve_kernel<B>;
+	return k;
+}
+
+}
+
+#endif
+
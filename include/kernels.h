@@ -0,0 +1,96 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cstdint>
+#include "isa.h"
+#include "color.h"
+
+struct Pixel;
+struct ResolveParams;
+struct BatchArrays;
+
+// The arrays passed to the kernels must be padded out to a multiple of this many elements
+const uint32_t KERNEL_PAD = 16;
+// Number of entries in the linear to sRGB lookup table used by resolve
+const uint32_t SRGB_TABLE_SIZE = 4096;
+
+/*
+ * Rays stored as a structure of arrays for the dispatched kernels, each array
+ * must be 64 byte aligned and padded out to a multiple of KERNEL_PAD
+ */
+struct RayArrays {
+	float *ox, *oy, *oz, *dx, *dy, *dz, *t_min, *t_max;
+};
+/*
+ * The hits found by intersect_batches, with the same alignment and padding as the rays
+ */
+struct HitArrays {
+	float *px, *py, *pz, *nx, *ny, *nz;
+	int32_t *material_id;
+	// -1 for the rays that hit something and 0 for the others
+	int32_t *hit;
+};
+
+/*
+ * Table of the hot kernels built for one ISA tier. Each tier is compiled in its
+ * own translation unit with only that tier's instruction set enabled, so the
+ * kernels take plain arrays instead of vector types which would differ between
+ * tiers. Unless noted otherwise arrays must be 64 byte aligned and padded to
+ * a multiple of KERNEL_PAD.
+ * Note: the Whitted integrator traces its rays with intersect_batches and occluded_batches
+ * when the scene is made of only spheres and planes, see Scene::batches_only. Everything
+ * else (sampling, the camera, shading, the path tracer, other geometry) is 8 wide AVX2
+ * code, so the renderer needs an AVX2 CPU and there's no tier below it
+ */
+struct Kernels {
+	ISA isa;
+	// Number of lanes the kernels process at once
+	uint32_t width;
+	/*
+	 * Find the closest hits of the n rays with the scene's sphere and plane batches. Rays with
+	 * t_max <= t_min are skipped, so callers can drop rays by setting their t_max to -inf.
+	 * Rays that hit have t_max moved up to the hit, the hits are written to hits for every
+	 * ray. Returns the number of rays that hit
+	 */
+	uint32_t (*intersect_batches)(const BatchArrays &batches, const RayArrays &rays, const HitArrays &hits,
+			uint32_t n);
+	/*
+	 * Find which of the n rays are blocked by something in the batches, blocked is set
+	 * to -1 for them and 0 for the others. Returns the number of blocked rays
+	 */
+	uint32_t (*occluded_batches)(const BatchArrays &batches, const RayArrays &rays, int32_t *blocked, uint32_t n);
+	/*
+	 * Resolve n accumulated pixels to 8 bit sRGB colors with the exposure and tonemapping
+	 * in params, writing them as packed RGB or BGR triples. The pixels and output don't
+	 * need to be aligned or padded
+	 */
+	void (*resolve)(const Pixel *pixels, uint8_t *out, uint32_t n, const ResolveParams &params);
+};
+
+/*
+ * Get the kernels for the ISA tier, returns nullptr if the tier wasn't
+ * built or isn't supported by the CPU we're running on
+ */
+const Kernels* get_kernels(ISA isa);
+/*
+ * Get the kernels selected to be used, by default the highest tier the CPU supports
+ */
+const Kernels& kernels();
+/*
+ * Use the kernels for a lower ISA tier than the best one supported, returns false if
+ * they aren't available. Must be called before any threads start using the kernels
+ */
+bool select_kernels(ISA isa);
+
+/*
+ * Get the table mapping linear values in [0, 1] quantized to SRGB_TABLE_SIZE steps to
+ * their 8 bit sRGB values
+ */
+const int32_t* srgb_table();
+
+// The table for each tier, these are defined in the tier's own translation unit
+const Kernels* avx2_kernels();
+const Kernels* avx512_kernels();
+
+#endif
+
@@ -1,21 +1,37 @@
 #ifndef LD_SAMPLER_H
 #define LD_SAMPLER_H
 
-#include <random>
+#include <utility>
 #include <cstdint>
 #include "vec.h"
+#include "rng.h"
 
 /*
- * A low discrepancy sampler based on (0, 2) sequences, as described in PBRT
+ * A low discrepancy sampler based on (0, 2) sequences, as described in PBRT.
+ * A packet of samples is generated at once: the sample values are linear in
+ * the sample index over GF(2), so for a packet starting at index k the value
+ * at lane j is the value at k xor'd with the precomputed value at j. The
+ * packets are visited in Gray code order so moving to the next one only flips
+ * a single generator matrix column into the packet's base value
  */
 class LDSampler {
 	uint32_t spp, block_dim;
-	// Number of samples we've taken so far in the current pixel, since
-	// we may be taking more than 8 samples per pixel and will need to resume
+	// The range of sample indices taken in each pixel, by default all spp samples
+	// but for progressive rendering each pass takes a slice of them
+	uint32_t pass_begin, pass_end;
+	// Index of the next sample to take in the current pixel, since we may be taking
+	// more than a packet of samples per pixel and will need to resume
 	uint32_t samples_taken;
+	// The (0, 2) sequence values for the first packet of indices and the
+	// scrambled values at the start of the current packet
+	alignas(64) int32_t lane_x[16];
+	alignas(64) int32_t lane_y[16];
+	uint32_t base_x, base_y;
 	// The current block being sampled
 	std::pair<uint32_t, uint32_t> start, current;
-	std::uniform_int_distribution<uint32_t> distrib;
+	// Flags for which pixels in the image to sample, if null all pixels are sampled
+	const uint8_t *active;
+	uint32_t img_width;
 
 public:
 	/*
@@ -27,19 +43,75 @@ public:
 	 * Select a new block to start sampling
 	 */
 	void select_block(const std::pair<uint32_t, uint32_t> &b);
+	/*
+	 * Only take the samples [first, first + n) of each pixel in the blocks selected
+	 * after this, so passes over the image can each add a slice of the samples.
+	 * n must be a power of 2 and first a multiple of n. Each pixel's scrambling only
+	 * depends on its position so the passes' samples combine into the full sequence
+	 */
+	void set_pass(uint32_t first, uint32_t n);
+	/*
+	 * Only sample the pixels flagged in active, which holds a flag for each pixel
+	 * in an image img_width pixels wide. Passing null will sample every pixel.
+	 * The flags must stay valid while the sampler is used
+	 */
+	void set_active_pixels(const uint8_t *active, uint32_t img_width);
 	/*
 	 * Check if the sampler has more samples left to take
 	 */
 	bool has_samples() const;
 	/*
-	 * Compute up to 8 pixel samples in the block being sampled and return them
-	 * Note: fewer than 8 samples may be generated if the sampler runs out of
-	 * samples to take over the block, in which case some lanes will be masked
+	 * Compute up to a packet width of pixel samples in the block being sampled and
+	 * return them. All the samples in a packet are for the same pixel.
+	 * Note: fewer samples than the packet width may be generated if the sampler runs
+	 * out of samples to take in the pixel, in which case some lanes will be masked
 	 * off in the active mask returned and the masked off components will
 	 * have (-1, -1) as the pixel sample position
 	 */
-	__m256 sample(std::mt19937 &rng, Vec2f_8 &samples);
+	template<typename B>
+	typename B::Mask sample(RNG &rng, Vec2fN<B> &samples);
+
+private:
+	/*
+	 * Move on to the next packet of samples. Returns the number of samples in the packet and sets the packet's base
+	 * values and the pixel it's for
+	 */
+	uint32_t next_packet(uint32_t width, uint32_t &x, uint32_t &y,
+			std::pair<uint32_t, uint32_t> &pixel);
+	/*
+	 * Move current forward to the next pixel in the block to be sampled,
+	 * starting at current itself
+	 */
+	void skip_inactive();
 };
 
+template<typename B>
+inline typename B::Mask LDSampler::sample(RNG &rng, Vec2fN<B> &samples){
+	uint32_t x, y;
+	std::pair<uint32_t, uint32_t> pixel;
+	const uint32_t n = next_packet(B::WIDTH, x, y, pixel);
+	if (n == 0){
+		return B::mask_none();
+	}
+	const auto to_float = B::set1(1.f / 16777216.f);
+	auto sx = B::bit_xor(B::load(lane_x), B::set1i(x));
+	auto sy = B::bit_xor(B::load(lane_y), B::set1i(y));
+	samples.x = B::mul(B::cvt_float(B::srli(sx, 8)), to_float);
+	samples.y = B::mul(B::cvt_float(B::srli(sy, 8)), to_float);
+	// Decorrelate the pairing of the x and y values by permuting the y values
+	// with a random rotation and xor of the lane indices, n is a power of 2 so
+	// masking by n - 1 keeps the permutation within the valid lanes
+	const uint32_t r = rng.next_u32();
+	const auto perm = B::bit_and(B::bit_xor(B::add(B::iota(), B::set1i(r & 0xffff)), B::set1i(r >> 16)),
+			B::set1i(n - 1));
+	samples.y = B::permute(samples.y, perm);
+	// We use -1 to signal that there is no sample to be taken for the lane
+	const auto active = B::cmp_lt(B::cvt_float(B::iota()), B::set1(static_cast<float>(n)));
+	samples.x = B::select(B::set1(-1.f), samples.x, active);
+	samples.y = B::select(B::set1(-1.f), samples.y, active);
+	samples += Vec2fN<B>{static_cast<float>(pixel.first), static_cast<float>(pixel.second)};
+	return active;
+}
+
 #endif
 
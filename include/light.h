@@ -1,22 +1,93 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
+#include <vector>
+#include <cstdint>
 #include "vec.h"
 #include "color.h"
+#include "bbox.h"
 
 struct OcclusionTester;
+class RNG;
 
-struct PointLight {
+enum class LightType : int32_t {
+	POINT,
+	SPHERE,
+	QUAD
+};
+
+/*
+ * Description of a light in the scene. Point lights emit their intensity
+ * in all directions, area lights emit radiance from their surface: spheres
+ * emit outwards and quads emit from the side of u x v
+ */
+struct Light {
+	LightType type;
+	// Position of point lights, center of spheres and corner of quads
 	Vec3f pos;
-	Colorf intensity;
+	// Edges of the quad from its corner
+	Vec3f u, v;
+	float radius;
+	// Intensity of point lights and radiance of area lights
+	Colorf emission;
+
+	static Light point(const Vec3f &pos, const Colorf &intensity);
+	static Light sphere(const Vec3f &center, float radius, const Colorf &radiance);
+	static Light quad(const Vec3f &corner, const Vec3f &u, const Vec3f &v, const Colorf &radiance);
+	/*
+	 * Get the luminance of the total power emitted by the light
+	 */
+	float power() const;
+	BBox bounds() const;
+};
+
+/*
+ * All the lights in the scene stored as a structure of arrays along with a BVH
+ * over them used to pick which light to sample. Each node stores a bounding
+ * sphere and the power of the lights under it, at a shading point we descend
+ * the tree picking each child with probability proportional to its estimated
+ * contribution, its power over the squared distance to it. This is the light
+ * BVH of Conty Estevez and Kulla without the orientation bounds, with it the
+ * cost of sampling grows with the log of the number of lights instead of linearly
+ * and lights close to the shading point are picked far more often than distant ones
+ */
+class LightTree {
+	// The lights, in the order they were added
+	std::vector<float> x, y, z, ux, uy, uz, vx, vy, vz, radius, r, g, b;
+	std::vector<int32_t> type;
+	// The tree nodes, the children of an interior node are stored next to each
+	// other starting at child. Leaves have child = -1 and the index of their light
+	std::vector<float> node_x, node_y, node_z, node_radius, node_power;
+	std::vector<int32_t> child, light;
+	bool has_area;
 
-	PointLight(Vec3f pos, Colorf intensity);
+public:
+	LightTree(const std::vector<Light> &lights);
+	/*
+	 * Sample incident illumination at p from one of the lights, picked through the tree
+	 * for each lane. Returns the light arriving divided by the probability of the sample,
+	 * its incident direction and an occlusion tester that can be used to check if
+	 * the light is visible. Random numbers are only drawn from rng if the choice
+	 * isn't fixed, so scenes with a single point light are sampled deterministically
+	 */
+	Colorf_8 sample(const Vec3f_8 &p, RNG &rng, Vec3f_8 &w_i, OcclusionTester &occlusion) const;
+	/*
+	 * Get the i'th light added to the tree
+	 */
+	Light get(size_t i) const;
+	size_t size() const;
+
+private:
+	/*
+	 * Build the subtree over lights [begin, end) of the indices into node n, which must
+	 * already be allocated. Child nodes are allocated starting from next_free
+	 */
+	void build(std::vector<uint32_t> &indices, uint32_t begin, uint32_t end, uint32_t n,
+			uint32_t &next_free, const std::vector<Light> &lights);
 	/*
-	 * Sample incident illumination from the light source at p
-	 * returns the incident direction of the light and an occlusion tester
-	 * that can be used to check if the light is visble
+	 * Compute the estimated contribution of the nodes to the points
 	 */
-	Colorf_8 sample(const Vec3f_8 &p, Vec3f_8 &w_i, OcclusionTester &occlusion) const;
+	__m256 importance(__m256i node, const Vec3f_8 &p) const;
 };
 
 #endif
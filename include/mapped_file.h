@@ -0,0 +1,62 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * A file mapped into memory, either read only to use its contents in place
+ * or read/write to fill out a file of a known size without buffering it.
+ * The mapping is released when the MappedFile is closed or destroyed
+ */
+class MappedFile {
+	uint8_t *ptr;
+	size_t length;
+	uint64_t modified;
+
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	/*
+	 * Map an existing file for reading, returns false if it couldn't be mapped
+	 */
+	bool open(const std::string &file);
+	/*
+	 * Create the file with size bytes, replacing any existing one, and map it
+	 * for writing. Returns false if it couldn't be created or mapped
+	 */
+	bool create(const std::string &file, size_t size);
+	/*
+	 * Unmap the file, writes made to a file created with create are flushed
+	 * to it by the OS
+	 */
+	void close();
+	inline const uint8_t* data() const {
+		return ptr;
+	}
+	inline uint8_t* data(){
+		return ptr;
+	}
+	inline size_t size() const {
+		return length;
+	}
+	/*
+	 * Get when the file was last modified as of opening it, in the OS's
+	 * own units. Only set for files mapped with open
+	 */
+	inline uint64_t modified_time() const {
+		return modified;
+	}
+};
+
+/*
+ * Check if the two paths name the same existing file, which may be spelled
+ * differently or reached through links. Returns false if either doesn't exist
+ */
+bool same_file(const std::string &a, const std::string &b);
+
+#endif
+
@@ -4,15 +4,17 @@
 #include "vec.h"
 
 /*
- * Structure storing 8 3x3 matrices
+ * Structure storing a packet of 3x3 matrices
  */
-struct Mat3f_8 {
-	__m256 mat[3][3];
+template<typename B>
+struct Mat3fN {
+	using Float = typename B::Float;
+	Float mat[3][3];
 
 	// Construct the identity matrix
-	inline Mat3f_8(){
-		const auto zero = _mm256_set1_ps(0.f);
-		const auto one = _mm256_set1_ps(1.f);
+	inline Mat3fN(){
+		const auto zero = B::set1(0.f);
+		const auto one = B::set1(1.f);
 		for (int i = 0; i < 3; ++i){
 			for (int j = 0; j < 3; ++j){
 				if (i == j){
@@ -25,28 +27,34 @@ struct Mat3f_8 {
 		}
 	}
 	// Construct the matrix from 3 vectors, specifying the values for each row
-	inline Mat3f_8(const Vec3f_8 &a, const Vec3f_8 &b, const Vec3f_8 &c){
+	inline Mat3fN(const Vec3fN<B> &a, const Vec3fN<B> &b, const Vec3fN<B> &c){
 		for (int i = 0; i < 3; ++i){
 			mat[0][i] = a[i];
 			mat[1][i] = b[i];
 			mat[2][i] = c[i];
 		}
 	}
-	const __m256* operator[](int i) const {
+	const Float* operator[](int i) const {
 		assert(i < 3);
 		return mat[i];
 	}
 };
-// Multiply 8 vectors with the 8 matrices
-inline Vec3f_8 operator*(const Mat3f_8 &m, const Vec3f_8 &v){
-	Vec3f_8 out;
+// Multiply the vectors with the matrices
+template<typename B>
+inline Vec3fN<B> operator*(const Mat3fN<B> &m, const Vec3fN<B> &v){
+	Vec3fN<B> out;
 	for (int i = 0; i < 3; ++i){
-		const auto a = _mm256_mul_ps(m[i][0], v.x);
-		const auto b = _mm256_fmadd_ps(m[i][1], v.y, a);
-		out[i] = _mm256_fmadd_ps(m[i][2], v.z, b);
+		const auto a = B::mul(m[i][0], v.x);
+		const auto b = B::fmadd(m[i][1], v.y, a);
+		out[i] = B::fmadd(m[i][2], v.z, b);
 	}
 	return out;
 }
 
+using Mat3f_8 = Mat3fN<AVX2>;
+#ifdef __AVX512F__
+using Mat3f_16 = Mat3fN<AVX512>;
+#endif
+
 #endif
 
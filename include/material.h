@@ -6,15 +6,115 @@
 
 struct Material {
 	virtual Colorf_8 shade(const Vec3f_8 &w_o, const Vec3f_8 &w_i) const = 0;
+	/*
+	 * Get the material's base color, written to the albedo AOV
+	 */
+	virtual Colorf albedo() const = 0;
+	/*
+	 * Check if the material is perfectly specular. Specular materials aren't lit
+	 * by sampling the lights, instead their hits spawn reflected and refracted
+	 * rays which are traced in the next generation of rays
+	 */
+	virtual bool is_specular() const {
+		return false;
+	}
+	/*
+	 * Compute the specular bounces off the surface with normal n for light leaving
+	 * along w_o. The reflected direction and its weight are written to w_r and f_r
+	 * and the transmitted ones to w_t and f_t, returns the mask of lanes where light
+	 * is transmitted. Only called for specular materials
+	 */
+	virtual __m256 bounce(const Vec3f_8&, const Vec3f_8&, Vec3f_8&, Colorf_8 &f_r, Vec3f_8&, Colorf_8&) const {
+		f_r = Colorf_8{0};
+		return _mm256_setzero_ps();
+	}
+	/*
+	 * Sample an incident direction w_i for light leaving the surface with normal n along w_o,
+	 * using the uniform random values in u. Returns the weight of the sample, the BSDF times
+	 * the cosine of w_i divided by the probability of sampling w_i
+	 */
+	virtual Colorf_8 sample(const Vec3f_8 &w_o, const Vec3f_8 &n, const Vec2f_8 &u, Vec3f_8 &w_i) const = 0;
 };
 
+/*
+ * Reflect w_o about the normal n
+ */
+inline Vec3f_8 reflect(const Vec3f_8 &w_o, const Vec3f_8 &n){
+	return _mm256_mul_ps(_mm256_set1_ps(2.f), w_o.dot(n)) * n - w_o;
+}
+
 struct LambertianMaterial : Material {
 	Colorf color;
 
 	inline LambertianMaterial(Colorf color) : color(color){}
+	inline Colorf albedo() const {
+		return color;
+	}
 	inline Colorf_8 shade(const Vec3f_8&, const Vec3f_8&) const {
 		return Colorf_8{color * static_cast<float>(M_1_PI)};
 	}
+	/*
+	 * Cosine weighted sampling of the hemisphere on w_o's side of the surface, the
+	 * cosine and 1/pi cancel with the pdf so the weight is just the color
+	 */
+	Colorf_8 sample(const Vec3f_8 &w_o, const Vec3f_8 &n, const Vec2f_8 &u, Vec3f_8 &w_i) const;
+};
+
+/*
+ * A perfect mirror, reflecting all light tinted by its color
+ */
+struct MirrorMaterial : Material {
+	Colorf color;
+
+	inline MirrorMaterial(Colorf color) : color(color){}
+	inline Colorf albedo() const {
+		return color;
+	}
+	inline Colorf_8 shade(const Vec3f_8&, const Vec3f_8&) const {
+		return Colorf_8{0};
+	}
+	inline bool is_specular() const {
+		return true;
+	}
+	inline __m256 bounce(const Vec3f_8 &w_o, const Vec3f_8 &n, Vec3f_8 &w_r, Colorf_8 &f_r,
+			Vec3f_8&, Colorf_8&) const
+	{
+		w_r = reflect(w_o, n);
+		f_r = Colorf_8{color};
+		return _mm256_setzero_ps();
+	}
+	inline Colorf_8 sample(const Vec3f_8 &w_o, const Vec3f_8 &n, const Vec2f_8&, Vec3f_8 &w_i) const {
+		w_i = reflect(w_o, n);
+		return Colorf_8{color};
+	}
+};
+
+/*
+ * A smooth dielectric like glass, light is split between reflection and
+ * transmission by the Fresnel equations and transmitted light is tinted by its color
+ */
+struct GlassMaterial : Material {
+	Colorf color;
+	// Index of refraction of the material, the outside is assumed to be air
+	float ior;
+
+	inline GlassMaterial(Colorf color, float ior = 1.5f) : color(color), ior(ior){}
+	inline Colorf albedo() const {
+		return color;
+	}
+	inline Colorf_8 shade(const Vec3f_8&, const Vec3f_8&) const {
+		return Colorf_8{0};
+	}
+	inline bool is_specular() const {
+		return true;
+	}
+	__m256 bounce(const Vec3f_8 &w_o, const Vec3f_8 &n, Vec3f_8 &w_r, Colorf_8 &f_r,
+			Vec3f_8 &w_t, Colorf_8 &f_t) const;
+	/*
+	 * Pick reflection or transmission with probability given by the Fresnel reflectance,
+	 * chosen by u.x
+	 */
+	Colorf_8 sample(const Vec3f_8 &w_o, const Vec3f_8 &n, const Vec2f_8 &u, Vec3f_8 &w_i) const;
 };
 
 #endif
@@ -0,0 +1,17 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include <string>
+#include "triangle_mesh.h"
+
+/*
+ * Load the triangles from a Wavefront OBJ file into the mesh data, only
+ * vertex positions, normals and faces are read. Polygons are triangulated
+ * as fans. The file is streamed through a fixed size buffer and parsed
+ * without going through iostreams so large models load quickly
+ * Returns false if the file couldn't be read
+ */
+bool load_obj(const std::string &file, MeshData &mesh);
+
+#endif
+
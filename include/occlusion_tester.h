@@ -11,14 +11,18 @@ struct OcclusionTester {
 	 * Set the occlusion tester to check if there's something in between a and b
 	 */
 	inline void set_points(const Vec3f_8 &a, const Vec3f_8 &b){
-		rays = Ray8{a, (b - a).normalized(), 0.001f, 0.999f};
+		const auto d = b - a;
+		const auto dist = d.length();
+		rays = Ray8{a, Vec3f_8{_mm256_div_ps(d.x, dist), _mm256_div_ps(d.y, dist), _mm256_div_ps(d.z, dist)}, 0.001f};
+		// Stop just short of b so the surface the point is on doesn't block it
+		rays.t_max = _mm256_mul_ps(dist, _mm256_set1_ps(0.999f));
 	}
 	/*
 	 * Get a mask of point pairs that are occluded in in the scene
+	 * Note: occluded rays are removed from rays.active
 	 */
 	inline __m256 occluded(const Scene &scene){
-		DiffGeom8 dg;
-		return _mm256_and_ps(scene.intersect(rays, dg), rays.active);
+		return scene.occluded(rays);
 	}
 };
 
@@ -0,0 +1,54 @@
+#ifndef PATH_TRACER_H
+#define PATH_TRACER_H
+
+#include <cstdint>
+#include "vec.h"
+#include "color.h"
+
+struct Scene;
+struct PerspectiveCamera;
+class LDSampler;
+class RNG;
+class RenderTile;
+
+/*
+ * Unidirectional path tracer with next event estimation. A block is rendered by
+ * keeping a packet of 8 paths in flight, at each hit the path gets direct lighting
+ * from one of the scene's lights and continues along a direction sampled from the hit
+ * material's BSDF, paths are killed with Russian roulette once they've made a few
+ * bounces. When a path terminates its lane is refilled with a new camera sample
+ * from the block's sampler, so the packet stays full until the block runs out of
+ * samples instead of draining down to the few lanes that take the longest paths
+ */
+class PathTracer {
+	const Scene &scene;
+	const PerspectiveCamera &camera;
+	Vec2f_8 img_dim;
+	// Maximum number of bounces a path can make
+	uint32_t max_depth;
+	// Camera samples taken from the sampler but not started as paths yet, the
+	// sampler hands out packets of samples but we may only need a few lanes
+	CACHE_ALIGN float queue_x[16];
+	CACHE_ALIGN float queue_y[16];
+	uint32_t queued;
+
+public:
+	PathTracer(const Scene &scene, const PerspectiveCamera &camera, const Vec2f_8 &img_dim,
+			uint32_t max_depth);
+	/*
+	 * Trace paths for all the samples in the block the sampler has selected and
+	 * write the light they carry to the tile
+	 */
+	void render_block(LDSampler &sampler, RNG &rng, RenderTile &tile);
+
+private:
+	/*
+	 * Start new paths in the lanes set in dead, samples holds the image position of the
+	 * lanes and is updated for the ones started. Returns the mask of lanes that were
+	 * started, which is fewer than requested once the sampler runs dry
+	 */
+	int refill(LDSampler &sampler, RNG &rng, int dead, Vec2f_8 &samples);
+};
+
+#endif
+
@@ -13,7 +13,49 @@ struct Plane : Geometry {
 
 	Plane(Vec3f pos, Vec3f normal, int material_id);
 	__m256 intersect(Ray8 &ray, DiffGeom8 &dg) const override;
+	__m256 occluded(Ray8 &ray) const override;
+	/*
+	 * Width generic versions of intersect and occluded, the 8 wide overrides
+	 * call these with the AVX2 backend
+	 */
+	template<typename B>
+	typename B::Mask intersect(RayN<B> &ray, DiffGeomN<B> &dg) const;
+	template<typename B>
+	typename B::Mask occluded(RayN<B> &ray) const;
+	// Planes are infinite so the bounds will be as well
+	BBox bounds() const override;
 };
 
+template<typename B>
+inline typename B::Mask Plane::intersect(RayN<B> &ray, DiffGeomN<B> &dg) const {
+	const auto vpos = Vec3fN<B>{pos};
+	const auto vnorm = Vec3fN<B>{normal};
+	const auto t = B::div((vpos - ray.o).dot(vnorm), ray.d.dot(vnorm));
+	auto hits = B::mask_and(B::cmp_gt(t, ray.t_min), B::cmp_lt(t, ray.t_max));
+	hits = B::mask_and(hits, ray.active);
+	// Check if all rays miss the plane
+	if (B::bits(hits) == 0){
+		return hits;
+	}
+	// Update t values for rays that did hit
+	ray.t_max = B::select(ray.t_max, t, hits);
+	const auto point = ray.at(ray.t_max);
+	dg.point.x = B::select(dg.point.x, point.x, hits);
+	dg.point.y = B::select(dg.point.y, point.y, hits);
+	dg.point.z = B::select(dg.point.z, point.z, hits);
+	dg.normal.x = B::select(dg.normal.x, vnorm.x, hits);
+	dg.normal.y = B::select(dg.normal.y, vnorm.y, hits);
+	dg.normal.z = B::select(dg.normal.z, vnorm.z, hits);
+	dg.material_id = B::select(dg.material_id, B::set1i(material_id), hits);
+	return hits;
+}
+template<typename B>
+inline typename B::Mask Plane::occluded(RayN<B> &ray) const {
+	const auto vnorm = Vec3fN<B>{normal};
+	const auto t = B::div((Vec3fN<B>{pos} - ray.o).dot(vnorm), ray.d.dot(vnorm));
+	const auto hits = B::mask_and(B::cmp_gt(t, ray.t_min), B::cmp_lt(t, ray.t_max));
+	return B::mask_and(hits, ray.active);
+}
+
 #endif
 
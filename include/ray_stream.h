@@ -0,0 +1,72 @@
+#ifndef RAY_STREAM_H
+#define RAY_STREAM_H
+
+#include <vector>
+#include <cstdint>
+#include "immintrin.h"
+#include "vec.h"
+#include "soa_geometry.h"
+#include "kernels.h"
+
+/*
+ * How secondary rays are traced: as the packets they were spawned in, or
+ * queued in a ray stream and compacted into full packets, optionally
+ * sorting the stream first
+ */
+enum class RayMode { PACKETS, STREAM, SORTED_STREAM };
+
+/*
+ * A queue of rays gathered from many packets, stored as a structure of arrays.
+ * Rays are pushed with only the lanes that are actually active and compacted
+ * together, so when the stream is traced every packet is fully populated
+ * except possibly the last one. The arrays are laid out so the stream can also be traced by
+ * the dispatched kernels at their own width. Each ray carries an id the caller can use to
+ * look up whatever it needs to know about the ray once it's been traced
+ */
+class RayStream {
+	KernelVector<float> ox, oy, oz, dx, dy, dz, t_min, t_max;
+	KernelVector<int32_t> ids;
+	uint32_t count;
+	// Scratch space for sorting, kept around to avoid re-allocating it
+	std::vector<uint64_t> keys, sorted_keys;
+	KernelVector<float> scratch;
+	KernelVector<int32_t> scratch_ids;
+
+public:
+	RayStream();
+	/*
+	 * Append the lanes of the rays set in mask to the stream, they're given the
+	 * ids first_id, first_id + 1, ... in lane order. Returns the number of rays pushed
+	 */
+	int push(const Ray8 &rays, __m256 mask, int32_t first_id);
+	/*
+	 * Append all the lanes of the rays without compacting them, e.g. to keep the rays
+	 * in the order of the samples they were taken for. Lanes not set in mask are given
+	 * an empty t range so they're skipped when traced. The stream's size must be
+	 * a multiple of 8
+	 */
+	void append(const Ray8 &rays, __m256 mask, int32_t first_id);
+	/*
+	 * Sort the rays by their direction octant and then by the Morton code of their
+	 * origin, so rays traced together in a packet are more likely to take the
+	 * same path through the BVH
+	 */
+	void sort();
+	/*
+	 * Load the 8 rays starting at i into a packet along with their ids,
+	 * rays.active is set to the lanes that hold valid rays
+	 */
+	void load(uint32_t i, Ray8 &rays, __m256i &id) const;
+	/*
+	 * Get the stream's arrays starting at ray first, which must be a multiple of KERNEL_PAD,
+	 * to trace the rays with the dispatched kernels. The kernels may update t_max
+	 */
+	RayArrays arrays(uint32_t first);
+	uint32_t size() const;
+	void clear();
+
+private:
+	void reserve(uint32_t n);
+};
+
+#endif
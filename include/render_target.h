@@ -5,14 +5,21 @@
 #include <vector>
 #include <atomic>
 #include <memory>
+#include <utility>
+#include <mutex>
+#include <fstream>
 #include "vec.h"
 #include "color.h"
+#include "diff_geom.h"
+#include "aligned_allocator.h"
+
+struct Material;
 
 /*
  * A pixel stored in the image being rendered to track pixel
  * luminance and weight for reconstruction
- * Because we need to deal with multi-thread synchronization the
- * rgb values and weights are stored as atomics
+ * Render threads don't write to these directly, they accumulate
+ * into their own RenderTile and flush it once the block is done
  */
 struct Pixel {
 	float r, g, b, weight;
@@ -22,27 +29,190 @@ struct Pixel {
 };
 
 /*
- * The render target where pixel data is stored for the rendered scene
- * along with for some reason a depth buffer is required for proj1?
+ * Arbitrary output variables that can be written alongside the color, taken
+ * from the primary hits. Each is averaged over all the pixel's samples with
+ * samples that miss the scene contributing 0, except the material ID which
+ * holds the ID of the last primary hit in the pixel or -1 if none hit. The
+ * cost is written separately, giving the average cost of the pixel's samples
+ */
+enum class AOV {
+	// Distance from the camera to the hit
+	DEPTH,
+	NORMAL,
+	ALBEDO,
+	MATERIAL_ID,
+	// Cost of tracing the sample, in the metric picked with set_cost_metric
+	COST,
+	COUNT
+};
+
+/*
+ * The AOVs being output, each pixel stores the channels of the enabled
+ * AOVs next to each other in the order of the AOV enum
+ */
+class AOVLayout {
+	// Offset of each AOV's channels in a pixel's values, -1 if it's disabled
+	int offsets[static_cast<int>(AOV::COUNT)];
+	uint32_t n_channels;
+
+public:
+	AOVLayout();
+	void enable(AOV aov);
+	inline int offset(AOV aov) const {
+		return offsets[static_cast<int>(aov)];
+	}
+	inline bool enabled(AOV aov) const {
+		return offset(aov) != -1;
+	}
+	// Get the number of values stored per pixel
+	inline uint32_t size() const {
+		return n_channels;
+	}
+	static uint32_t channels(AOV aov);
+	static const char* name(AOV aov);
+};
+
+/*
+ * A block sized buffer of pixels that a single render thread accumulates
+ * samples into while rendering a block. It's small enough to stay in cache
+ * and isn't shared with other threads, once the block is finished it's
+ * flushed to the render target in one go
+ */
+class RenderTile {
+	uint32_t block_dim;
+	// Top left pixel of the block the tile covers
+	std::pair<uint32_t, uint32_t> start;
+	std::vector<Pixel, AlignedAllocator<Pixel>> pixels;
+	// Sum of the squared luminance of each pixel's samples, used to estimate their variance
+	std::vector<float, AlignedAllocator<float>> lum_sq;
+	AOVLayout aovs;
+	std::vector<float> aov_values;
+
+	friend class RenderTarget;
+	friend class StreamingTarget;
+
+public:
+	/*
+	 * Create a tile for blocks of [block_dim, block_dim] pixels, accumulating
+	 * the AOVs in the layout along with the color
+	 */
+	RenderTile(uint32_t block_dim, const AOVLayout &aovs = AOVLayout{});
+	/*
+	 * Clear the tile and position it over the block starting at b
+	 */
+	void reset(const std::pair<uint32_t, uint32_t> &b);
+	/*
+	 * Accumulate color samples into the tile, the mask will specify
+	 * which color should actually be stored (0xff to store). Samples must
+	 * fall within the block the tile covers
+	 */
+	void write_samples(const Vec2f_8 &p, const Colorf_8 &c, __m256 mask);
+	/*
+	 * Accumulate the AOVs of the primary hits of the samples in mask, depth is
+	 * the distance to each hit and materials are used to look up the albedo.
+	 * Samples that missed aren't written since they contribute 0
+	 */
+	void write_aovs(const Vec2f_8 &p, __m256 depth, const DiffGeom8 &dg, __m256 mask,
+			const std::vector<std::shared_ptr<Material>> &materials);
+	/*
+	 * Accumulate cost into the cost AOV of each sample in mask
+	 */
+	void write_cost(const Vec2f_8 &p, float cost, __m256 mask);
+	inline bool has_aovs() const {
+		return aovs.size() != 0;
+	}
+	inline bool has_cost() const {
+		return aovs.enabled(AOV::COST);
+	}
+};
+
+/*
+ * Tonemapping operators that can be applied when resolving the image
+ */
+enum class Tonemap {
+	// Just clamp the colors to [0, 1]
+	CLAMP,
+	// x / (1 + x) on each channel
+	REINHARD,
+	// Narkowicz's fit of the ACES filmic curve
+	ACES
+};
+
+/*
+ * Settings for converting the accumulated pixels to the final 8 bit sRGB image
+ */
+struct ResolveParams {
+	// Exposure adjustment in stops, colors are scaled by 2^exposure before tonemapping
+	float exposure;
+	Tonemap tonemap;
+	// Write the channels in BGR order instead of RGB
+	bool bgr;
+
+	ResolveParams(float exposure = 0, Tonemap tonemap = Tonemap::CLAMP, bool bgr = false)
+		: exposure(exposure), tonemap(tonemap), bgr(bgr){}
+};
+
+class ThreadPool;
+
+/*
+ * The render target where the color samples of the rendered scene are
+ * accumulated, along with the values of any AOVs being output
  */
 class RenderTarget {
 	uint32_t width, height;
 	std::vector<Pixel> pixels;
+	// Sum of the squared luminance of each pixel's samples
+	std::vector<float> lum_sq;
+	AOVLayout aovs;
+	std::vector<float> aov_values;
 
 public:
 	/*
-	 * Create a render target with width * height pixels
+	 * Create a render target with width * height pixels, accumulating
+	 * the AOVs in the layout along with the color
 	 */
-	RenderTarget(uint32_t width, uint32_t height);
+	RenderTarget(uint32_t width, uint32_t height, const AOVLayout &aovs = AOVLayout{});
 	/*
 	 * Write a color samples to the image, the mask will specify
 	 * which color should actually be stored (0xff to store)
 	 */
 	void write_samples(const Vec2f_8 &p, const Colorf_8 &c, __m256 mask);
-	//Save the image or depth buffer to the desired file
-	bool save_image(const std::string &file) const;
+	/*
+	 * Add the pixels accumulated in the tile to the image, since blocks
+	 * don't overlap threads can flush their tiles concurrently
+	 */
+	void write_tile(const RenderTile &tile);
+	/*
+	 * Save the image to the desired file, the image is resolved with the parameters
+	 * passed (the channel order is picked by the file format). If a thread pool is
+	 * passed the resolve is split across its workers
+	 */
+	bool save_image(const std::string &file, const ResolveParams &params = ResolveParams{},
+			ThreadPool *pool = nullptr) const;
+	/*
+	 * Save each AOV to a PFM file named prefix_<aov name>.pfm, the linear float values
+	 * are resolved straight into the mapped file. Returns false if a file couldn't be written
+	 */
+	bool save_aovs(const std::string &prefix) const;
+	/*
+	 * Resolve the image to packed 8 bit RGB or BGR rows in a single pass, rows are written
+	 * row_stride bytes apart and bottom to top if flip is set. If a thread pool is passed
+	 * the rows are split across its workers
+	 */
+	void resolve(uint8_t *out, size_t row_stride, bool flip, const ResolveParams &params,
+			ThreadPool *pool = nullptr) const;
+	/*
+	 * Estimate the error of each pixel from the variance of its samples' luminance,
+	 * relative to the pixel's mean luminance, and flag the pixels whose error is above
+	 * the threshold in active. active is resized to hold a flag for each pixel.
+	 * Returns the number of pixels flagged
+	 */
+	uint32_t find_unconverged(float threshold, std::vector<uint8_t> &active) const;
+	// Get the total number of samples taken in the image
+	uint64_t sample_count() const;
 	uint32_t get_width() const;
 	uint32_t get_height() const;
+	const AOVLayout& get_aovs() const;
 	/*
 	 * Get a snapshot of the color buffer at the moment
 	 * stored in img
@@ -56,13 +226,84 @@ private:
 	 */
 	bool save_ppm(const std::string &file, const uint8_t *data) const;
 	/*
-	 * Save color data as a BMP image to the file, data should be
-	 * RGBA8 data and have width * height elements
+	 * Save color data as a BMP image to the file, data should be BGR8
+	 * rows padded out to a multiple of 4 bytes as BMP requires.
 	 * The image data should be flipped appropriately already for the BMP
 	 * file format (eg. starting at bottom left)
 	 */
 	bool save_bmp(const std::string &file, const uint8_t *data) const;
 };
 
+/*
+ * Render target for images too big to keep in memory, rendered with a single pass
+ * over scanline ordered blocks. Tiles are accumulated into the row of blocks, or band,
+ * they fall in and once every block in a band has been written it's resolved and
+ * written to its place in the output file and its pixels are freed. A band is only
+ * allocated when its first tile arrives, so the bands resident are the ones the
+ * workers are in the middle of: about two per worker, however big the image is
+ */
+class StreamingTarget {
+	struct Band {
+		std::vector<Pixel> pixels;
+		uint32_t blocks_done;
+	};
+
+	uint32_t width, height, block_dim;
+	ResolveParams params;
+	// Number of blocks the block queue hands out in each band. The partial band
+	// at the bottom of the image if the blocks don't evenly divide it gets none
+	// and is left black, as are any pixels to the right of the last block
+	uint32_t blocks_per_band, full_bands;
+	bool bmp;
+	// Bytes per row in the file and offset of the first row
+	size_t row_stride;
+	uint64_t data_offset;
+	std::ofstream file;
+	std::vector<std::unique_ptr<Band>> bands;
+	std::mutex band_mutex, file_mutex;
+	uint32_t resident, peak_resident, bands_written;
+	std::atomic<uint64_t> samples;
+	bool write_failed;
+	// AOVs aren't streamed so this is always empty
+	AOVLayout aovs;
+
+public:
+	/*
+	 * Create a target streaming an image of width * height pixels rendered
+	 * with blocks of [block_dim, block_dim] pixels, resolved with params
+	 */
+	StreamingTarget(uint32_t width, uint32_t height, uint32_t block_dim, const ResolveParams &params);
+	/*
+	 * Create the output file, a PPM or BMP image, and size it for the whole image
+	 * Returns false if the file couldn't be created or the format can't hold the image
+	 */
+	bool open(const std::string &file_name);
+	/*
+	 * Add the pixels accumulated in the tile to its band, writing out the band if
+	 * this was its last block. Threads can write their tiles concurrently
+	 */
+	void write_tile(const RenderTile &tile);
+	/*
+	 * Finish the file, returns false if writing failed or some bands never
+	 * received all their blocks
+	 */
+	bool close();
+	// Get the total number of samples taken in the image
+	uint64_t sample_count() const;
+	// Get the most bands that were resident at once
+	uint32_t get_peak_resident() const;
+	// Get the size of a band's accumulators in bytes
+	size_t band_size() const;
+	uint32_t get_width() const;
+	uint32_t get_height() const;
+	const AOVLayout& get_aovs() const;
+
+private:
+	/*
+	 * Resolve the band and write it to the file
+	 */
+	void write_band(uint32_t index, const Band &band);
+};
+
 #endif
 
@@ -0,0 +1,55 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+#include "simd.h"
+
+/*
+ * A vectorized PCG random number generator, each lane runs its own 32 bit
+ * PCG stream (the RXS-M-XS output variant) with a distinct increment. The state
+ * is kept in plain arrays so the same generator can be stepped by the kernels
+ * built for any ISA tier, a B::WIDTH wide step advances the first B::WIDTH lanes
+ */
+class RNG {
+	static const int LANES = 16;
+	alignas(64) int32_t state[LANES];
+	alignas(64) int32_t inc[LANES];
+
+public:
+	/*
+	 * Seed the generator, the lanes' streams are derived from the seed
+	 * so generators with different seeds won't overlap
+	 */
+	RNG(uint64_t seed);
+	/*
+	 * Get the next B::WIDTH random 32 bit values, one from each lane
+	 */
+	template<typename B>
+	typename B::Int next();
+	/*
+	 * Get the next B::WIDTH random floats in [0, 1)
+	 */
+	template<typename B>
+	typename B::Float next_float();
+	/*
+	 * Get the next random 32 bit value from the first lane
+	 */
+	uint32_t next_u32();
+};
+
+template<typename B>
+inline typename B::Int RNG::next(){
+	const auto old = B::load(state);
+	B::store(state, B::add(B::mul(old, B::set1i(747796405)), B::load(inc)));
+	const auto shift = B::add(B::srli(old, 28), B::set1i(4));
+	const auto word = B::mul(B::bit_xor(B::srlv(old, shift), old), B::set1i(277803737));
+	return B::bit_xor(B::srli(word, 22), word);
+}
+template<typename B>
+inline typename B::Float RNG::next_float(){
+	// Use the top 24 bits so every value is exactly representable
+	return B::mul(B::cvt_float(B::srli(next<B>(), 8)), B::set1(1.f / 16777216.f));
+}
+
+#endif
+
@@ -9,19 +9,62 @@
 #include "geometry.h"
 #include "material.h"
 #include "light.h"
+#include "bvh.h"
+#include "soa_geometry.h"
+#include "mapped_file.h"
 
+/*
+ * The scene stores spheres and planes grouped by type in structure of arrays
+ * batches which are intersected without any virtual calls. Other geometry
+ * like triangle meshes goes through the polymorphic Geometry interface
+ */
 struct Scene {
 	std::vector<std::shared_ptr<Geometry>> geometry;
 	std::vector<std::shared_ptr<Material>> materials;
-	PointLight light;
+	LightTree lights;
+	SphereBatch spheres;
+	PlaneBatch planes;
+	// Other geometry with finite bounds is stored in the BVH, infinite geometry
+	// can't be so it's tested separately after traversal
+	std::vector<const Geometry*> bounded, unbounded;
+	BVH bvh;
+	// The scene file the batches' arrays are viewed from, if the scene was loaded from one
+	std::unique_ptr<MappedFile> file;
 
+	/*
+	 * Create the scene from a list of polymorphic geometry, any Spheres and Planes
+	 * are copied into the batches, the rest is used through its Geometry interface
+	 */
 	Scene(std::vector<std::shared_ptr<Geometry>> geom, std::vector<std::shared_ptr<Material>> mats,
-		PointLight light);
+		std::vector<Light> lights);
+	/*
+	 * Create the scene with spheres and planes already in batches, along with
+	 * any other geometry in geom
+	 */
+	Scene(SphereBatch spheres, PlaneBatch planes, std::vector<std::shared_ptr<Geometry>> geom,
+		std::vector<std::shared_ptr<Material>> mats, std::vector<Light> lights);
 	/*
 	 * Compute the intersection of the ray packet with the scene
 	 * returns mask of rays that hit something
 	 */
 	__m256 intersect(Ray8 &rays, DiffGeom8 &dg) const;
+	/*
+	 * Find which of the active rays are blocked by something in the scene,
+	 * stopping as soon as all are blocked. Blocked rays are removed from
+	 * rays.active, returns the mask of rays that are blocked
+	 */
+	__m256 occluded(Ray8 &rays) const;
+	/*
+	 * Check if everything in the scene is in the sphere and plane batches, in which
+	 * case the scene can be traced with the dispatched kernels' intersect_batches
+	 * and occluded_batches at their own width
+	 */
+	bool batches_only() const;
+	BatchArrays batch_arrays() const;
+
+private:
+	__m256 intersect_geometry(Ray8 &rays, DiffGeom8 &dg) const;
+	__m256 occluded_geometry(Ray8 &rays) const;
 };
 
 #endif
@@ -0,0 +1,139 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include "camera.h"
+#include "light.h"
+
+struct Scene;
+
+/*
+ * Binary scene files store the sphere and plane batches' arrays, the sphere BVH,
+ * triangle meshes with their BVHs, materials, lights and camera laid out exactly as
+ * the renderer uses them, so a scene is loaded by mapping the file and pointing the
+ * batches and meshes at its sections with no parsing or BVH build. The file starts
+ * with a SceneFileHeader followed by the sections in the order of SceneSection, each
+ * starting on a cache line boundary. Values are stored little endian, which is all
+ * the renderer runs on anyway
+ */
+const char SCENE_FILE_MAGIC[8] = {'M', 'P', 'S', 'C', 'E', 'N', 'E', '\0'};
+// Bumped whenever the layout of the file changes, files with a different version are rejected
+const uint32_t SCENE_FILE_VERSION = 2;
+const uint64_t SCENE_FILE_ALIGN = 64;
+
+enum class SceneSection : uint32_t {
+	SPHERE_X,
+	SPHERE_Y,
+	SPHERE_Z,
+	SPHERE_RADIUS,
+	SPHERE_MATERIAL,
+	SPHERE_BVH_NODES,
+	SPHERE_BVH_INDICES,
+	PLANE_X,
+	PLANE_Y,
+	PLANE_Z,
+	PLANE_NX,
+	PLANE_NY,
+	PLANE_NZ,
+	PLANE_MATERIAL,
+	MESHES,
+	MESH_VERTICES,
+	MESH_NORMALS,
+	MESH_INDICES,
+	MESH_BVH_NODES,
+	MESH_BVH_INDICES,
+	MATERIALS,
+	LIGHTS,
+	COUNT
+};
+
+enum class MaterialType : int32_t {
+	LAMBERTIAN,
+	MIRROR,
+	GLASS
+};
+
+struct MaterialRecord {
+	MaterialType type;
+	float color[3];
+	// Index of refraction of glass, unused by the other materials
+	float ior;
+};
+
+struct LightRecord {
+	LightType type;
+	float pos[3], u[3], v[3];
+	float radius;
+	float emission[3];
+};
+
+/*
+ * Limits of the indices stored in a BVH, computed when the file is written so
+ * loading can check they're in range without walking the nodes
+ */
+struct BVHLimits {
+	// Largest node index an interior node refers to
+	uint32_t max_child;
+	// End of the furthest leaf range in the index array and the largest primitive index in it
+	uint32_t max_leaf_end, max_primitive;
+	// Number of levels in the BVH
+	uint32_t depth;
+};
+
+/*
+ * A triangle mesh's ranges in the mesh sections. The mesh's BVH nodes and
+ * triangle indices are relative to its own ranges
+ */
+struct MeshRecord {
+	uint64_t first_vertex, n_vertices;
+	uint64_t first_index, n_indices;
+	uint64_t first_node, n_nodes;
+	uint64_t first_bvh_index, n_bvh_indices;
+	BVHLimits bvh;
+	// Largest vertex index used by the triangles
+	uint32_t max_vertex;
+	int32_t material_id;
+};
+
+/*
+ * Location of a section in the file, count is the number of elements
+ * in the section's array
+ */
+struct SceneFileSection {
+	uint64_t offset, count;
+};
+
+struct SceneFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_sections;
+	// Size of the whole file, used to detect truncated files
+	uint64_t file_size;
+	float camera_pos[3], camera_center[3], camera_up[3];
+	float camera_fovy;
+	// Smallest and largest material id of the spheres and planes, min is
+	// greater than max if there are none
+	int32_t min_material, max_material;
+	BVHLimits sphere_bvh;
+	SceneFileSection sections[static_cast<size_t>(SceneSection::COUNT)];
+};
+
+/*
+ * Write the scene and camera to the scene file, returns false if the file
+ * couldn't be written or the scene has geometry or materials the format
+ * can't store. Only the sphere and plane batches and triangle meshes are stored
+ */
+bool save_scene_file(const std::string &file, const Scene &scene, const SceneCamera &camera);
+/*
+ * Map the scene file and create a scene using the arrays in it in place, the
+ * file stays mapped for the lifetime of the scene. Returns null if the file
+ * couldn't be mapped or isn't a valid scene file of this version. The BVH nodes,
+ * index arrays and material ids aren't read since that would touch every page of
+ * the file, they're checked against the limits stored in the header and mesh records
+ */
+std::unique_ptr<Scene> load_scene_file(const std::string &file, SceneCamera &camera);
+
+#endif
+
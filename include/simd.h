@@ -0,0 +1,315 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include "immintrin.h"
+
+/*
+ * SIMD backends that the packet types and kernels are templated on. A backend
+ * provides the float, int and mask vector types for its width along with the
+ * operations the kernels need, so the same kernel compiles to 8 wide AVX2 or
+ * 16 wide AVX-512 code. The AVX2 backend represents masks as float vectors
+ * with the sign bit set for active lanes, which is what the rest of the
+ * renderer uses with blendv and movemask. AVX-512 uses its mask registers.
+ * The backend functions can only be called from code compiled for their
+ * instruction set, see kernels.h
+ */
+struct AVX2 {
+	using Float = __m256;
+	using Int = __m256i;
+	using Mask = __m256;
+	static const int WIDTH = 8;
+
+	static inline Float set1(float x){
+		return _mm256_set1_ps(x);
+	}
+	static inline Int set1i(int32_t x){
+		return _mm256_set1_epi32(x);
+	}
+	static inline Float load(const float *p){
+		return _mm256_load_ps(p);
+	}
+	static inline Int load(const int32_t *p){
+		return _mm256_load_si256((const __m256i*)p);
+	}
+	static inline void store(float *p, Float a){
+		_mm256_store_ps(p, a);
+	}
+	static inline void store(int32_t *p, Int a){
+		_mm256_store_si256((__m256i*)p, a);
+	}
+	static inline Float add(Float a, Float b){
+		return _mm256_add_ps(a, b);
+	}
+	static inline Float sub(Float a, Float b){
+		return _mm256_sub_ps(a, b);
+	}
+	static inline Float mul(Float a, Float b){
+		return _mm256_mul_ps(a, b);
+	}
+	static inline Float div(Float a, Float b){
+		return _mm256_div_ps(a, b);
+	}
+	// a * b + c
+	static inline Float fmadd(Float a, Float b, Float c){
+		return _mm256_fmadd_ps(a, b, c);
+	}
+	// a * b - c
+	static inline Float fmsub(Float a, Float b, Float c){
+		return _mm256_fmsub_ps(a, b, c);
+	}
+	// -(a * b) + c
+	static inline Float fnmadd(Float a, Float b, Float c){
+		return _mm256_fnmadd_ps(a, b, c);
+	}
+	static inline Float sqrt(Float a){
+		return _mm256_sqrt_ps(a);
+	}
+	static inline Float rcp(Float a){
+		return _mm256_rcp_ps(a);
+	}
+	static inline Float min(Float a, Float b){
+		return _mm256_min_ps(a, b);
+	}
+	static inline Float max(Float a, Float b){
+		return _mm256_max_ps(a, b);
+	}
+	static inline Float neg(Float a){
+		return _mm256_xor_ps(a, _mm256_set1_ps(-0.f));
+	}
+	static inline Mask cmp_lt(Float a, Float b){
+		return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+	}
+	static inline Mask cmp_le(Float a, Float b){
+		return _mm256_cmp_ps(a, b, _CMP_LE_OQ);
+	}
+	static inline Mask cmp_gt(Float a, Float b){
+		return _mm256_cmp_ps(a, b, _CMP_GT_OQ);
+	}
+	static inline Mask mask_and(Mask a, Mask b){
+		return _mm256_and_ps(a, b);
+	}
+	static inline Mask mask_or(Mask a, Mask b){
+		return _mm256_or_ps(a, b);
+	}
+	// Lanes set in b but not in a, the same order as the andnot instructions
+	static inline Mask mask_andnot(Mask a, Mask b){
+		return _mm256_andnot_ps(a, b);
+	}
+	static inline Mask mask_all(){
+		return _mm256_set1_ps(-0.f);
+	}
+	static inline Mask mask_none(){
+		return _mm256_setzero_ps();
+	}
+	// Get the lanes set in the mask as a bitmask
+	static inline int bits(Mask m){
+		return _mm256_movemask_ps(m);
+	}
+	// Get the sign bits of the lanes as a bitmask
+	static inline int sign_bits(Float a){
+		return _mm256_movemask_ps(a);
+	}
+	// Pick b for the lanes set in mask and a for the others
+	static inline Float select(Float a, Float b, Mask m){
+		return _mm256_blendv_ps(a, b, m);
+	}
+	static inline Int select(Int a, Int b, Mask m){
+		return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b), m));
+	}
+	static inline Int iota(){
+		return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	}
+	static inline Int add(Int a, Int b){
+		return _mm256_add_epi32(a, b);
+	}
+	static inline Int min(Int a, Int b){
+		return _mm256_min_epi32(a, b);
+	}
+	static inline Mask cmp_lt(Int a, Int b){
+		return _mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a));
+	}
+	static inline Int slli(Int a, int n){
+		return _mm256_sll_epi32(a, _mm_cvtsi32_si128(n));
+	}
+	static inline Int srli(Int a, int n){
+		return _mm256_srl_epi32(a, _mm_cvtsi32_si128(n));
+	}
+	static inline Int srlv(Int a, Int n){
+		return _mm256_srlv_epi32(a, n);
+	}
+	static inline Int mul(Int a, Int b){
+		return _mm256_mullo_epi32(a, b);
+	}
+	static inline Int bit_and(Int a, Int b){
+		return _mm256_and_si256(a, b);
+	}
+	static inline Int bit_xor(Int a, Int b){
+		return _mm256_xor_si256(a, b);
+	}
+	static inline Int cvt_int(Float a){
+		return _mm256_cvtps_epi32(a);
+	}
+	static inline Float cvt_float(Int a){
+		return _mm256_cvtepi32_ps(a);
+	}
+	static inline Float permute(Float a, Int idx){
+		return _mm256_permutevar8x32_ps(a, idx);
+	}
+	static inline Float gather(const float *p, Int idx){
+		return _mm256_i32gather_ps(p, idx, 4);
+	}
+	static inline Int gather(const int32_t *p, Int idx){
+		return _mm256_i32gather_epi32((const int*)p, idx, 4);
+	}
+};
+
+#ifdef __AVX512F__
+struct AVX512 {
+	using Float = __m512;
+	using Int = __m512i;
+	using Mask = __mmask16;
+	static const int WIDTH = 16;
+
+	static inline Float set1(float x){
+		return _mm512_set1_ps(x);
+	}
+	static inline Int set1i(int32_t x){
+		return _mm512_set1_epi32(x);
+	}
+	static inline Float load(const float *p){
+		return _mm512_load_ps(p);
+	}
+	static inline Int load(const int32_t *p){
+		return _mm512_load_si512(p);
+	}
+	static inline void store(float *p, Float a){
+		_mm512_store_ps(p, a);
+	}
+	static inline void store(int32_t *p, Int a){
+		_mm512_store_si512(p, a);
+	}
+	static inline Float add(Float a, Float b){
+		return _mm512_add_ps(a, b);
+	}
+	static inline Float sub(Float a, Float b){
+		return _mm512_sub_ps(a, b);
+	}
+	static inline Float mul(Float a, Float b){
+		return _mm512_mul_ps(a, b);
+	}
+	static inline Float div(Float a, Float b){
+		return _mm512_div_ps(a, b);
+	}
+	static inline Float fmadd(Float a, Float b, Float c){
+		return _mm512_fmadd_ps(a, b, c);
+	}
+	static inline Float fmsub(Float a, Float b, Float c){
+		return _mm512_fmsub_ps(a, b, c);
+	}
+	static inline Float fnmadd(Float a, Float b, Float c){
+		return _mm512_fnmadd_ps(a, b, c);
+	}
+	static inline Float sqrt(Float a){
+		return _mm512_sqrt_ps(a);
+	}
+	static inline Float rcp(Float a){
+		return _mm512_rcp14_ps(a);
+	}
+	static inline Float min(Float a, Float b){
+		return _mm512_min_ps(a, b);
+	}
+	static inline Float max(Float a, Float b){
+		return _mm512_max_ps(a, b);
+	}
+	static inline Float neg(Float a){
+		// Float xor needs AVX-512DQ, flip the sign bit with an integer xor instead
+		return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a),
+					_mm512_set1_epi32(static_cast<int32_t>(0x80000000))));
+	}
+	static inline Mask cmp_lt(Float a, Float b){
+		return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ);
+	}
+	static inline Mask cmp_le(Float a, Float b){
+		return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ);
+	}
+	static inline Mask cmp_gt(Float a, Float b){
+		return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ);
+	}
+	static inline Mask mask_and(Mask a, Mask b){
+		return a & b;
+	}
+	static inline Mask mask_or(Mask a, Mask b){
+		return a | b;
+	}
+	static inline Mask mask_andnot(Mask a, Mask b){
+		return ~a & b;
+	}
+	static inline Mask mask_all(){
+		return 0xffff;
+	}
+	static inline Mask mask_none(){
+		return 0;
+	}
+	static inline int bits(Mask m){
+		return m;
+	}
+	static inline int sign_bits(Float a){
+		return _mm512_test_epi32_mask(_mm512_castps_si512(a), _mm512_set1_epi32(static_cast<int32_t>(0x80000000)));
+	}
+	static inline Float select(Float a, Float b, Mask m){
+		return _mm512_mask_blend_ps(m, a, b);
+	}
+	static inline Int select(Int a, Int b, Mask m){
+		return _mm512_mask_blend_epi32(m, a, b);
+	}
+	static inline Int iota(){
+		return _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	}
+	static inline Int add(Int a, Int b){
+		return _mm512_add_epi32(a, b);
+	}
+	static inline Int min(Int a, Int b){
+		return _mm512_min_epi32(a, b);
+	}
+	static inline Mask cmp_lt(Int a, Int b){
+		return _mm512_cmplt_epi32_mask(a, b);
+	}
+	static inline Int slli(Int a, int n){
+		return _mm512_sll_epi32(a, _mm_cvtsi32_si128(n));
+	}
+	static inline Int srli(Int a, int n){
+		return _mm512_srl_epi32(a, _mm_cvtsi32_si128(n));
+	}
+	static inline Int srlv(Int a, Int n){
+		return _mm512_srlv_epi32(a, n);
+	}
+	static inline Int mul(Int a, Int b){
+		return _mm512_mullo_epi32(a, b);
+	}
+	static inline Int bit_and(Int a, Int b){
+		return _mm512_and_si512(a, b);
+	}
+	static inline Int bit_xor(Int a, Int b){
+		return _mm512_xor_si512(a, b);
+	}
+	static inline Int cvt_int(Float a){
+		return _mm512_cvtps_epi32(a);
+	}
+	static inline Float cvt_float(Int a){
+		return _mm512_cvtepi32_ps(a);
+	}
+	static inline Float permute(Float a, Int idx){
+		return _mm512_permutexvar_ps(idx, a);
+	}
+	static inline Float gather(const float *p, Int idx){
+		return _mm512_i32gather_ps(idx, p, 4);
+	}
+	static inline Int gather(const int32_t *p, Int idx){
+		return _mm512_i32gather_epi32(idx, p, 4);
+	}
+};
+#endif
+
+#endif
+
@@ -0,0 +1,279 @@
+#ifndef SOA_GEOMETRY_H
+#define SOA_GEOMETRY_H
+
+#include <vector>
+#include <cstdint>
+#include "immintrin.h"
+#include "vec.h"
+#include "diff_geom.h"
+#include "bvh.h"
+#include "counters.h"
+#include "aligned_allocator.h"
+#include "array_view.h"
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+// Buffers passed to the dispatched kernels, which need them 64 byte aligned
+template<typename T>
+using KernelVector = std::vector<T, AlignedAllocator<T, 64>>;
+
+/*
+ * The sphere batch's arrays and BVH as plain pointers, which is all the width
+ * generic intersection code below needs. The dispatched kernels get the batches
+ * through these since the batches themselves are only built for AVX2
+ */
+struct SphereArrays {
+	const float *x, *y, *z, *radius;
+	const int32_t *material_id;
+	BVHArrays bvh;
+};
+struct PlaneArrays {
+	const float *x, *y, *z, *nx, *ny, *nz;
+	const int32_t *material_id;
+	uint32_t count;
+};
+// All the scene's batches, see Scene::batches_only
+struct BatchArrays {
+	SphereArrays spheres;
+	PlaneArrays planes;
+};
+
+/*
+ * Find the nearest hit of the active rays with the sphere within their [t_min, t_max]
+ * range, returns the mask of rays that hit and the hit t values in t. a should be
+ * ray.d.length_sqr() and inv_a its reciprocal, these are the same for every sphere
+ * so the caller computes them once per packet
+ */
+template<typename B>
+inline typename B::Mask sphere_hit(const RayN<B> &ray, typename B::Float a, typename B::Float inv_a,
+		const Vec3fN<B> &center, typename B::Float radius, typename B::Float &t)
+{
+	// Using the half b form of the quadratic: t = (b -/+ sqrt(b^2 - ac)) / a
+	const auto oc = center - ray.o;
+	const auto b = ray.d.dot(oc);
+	const auto c = B::fnmadd(radius, radius, oc.dot(oc));
+	const auto discrim = B::fnmadd(a, c, B::mul(b, b));
+	auto hits = B::mask_and(B::cmp_gt(discrim, B::set1(0)), ray.active);
+	if (B::bits(hits) == 0){
+		return hits;
+	}
+	const auto root = B::sqrt(discrim);
+	const auto t0 = B::mul(B::sub(b, root), inv_a);
+	const auto t1 = B::mul(B::add(b, root), inv_a);
+	// We want t to hold the nearest t value that is greater than ray.t_min
+	t = B::select(t0, t1, B::cmp_le(t0, ray.t_min));
+	const auto in_range = B::mask_and(B::cmp_gt(t, ray.t_min), B::cmp_lt(t, ray.t_max));
+	return B::mask_and(hits, in_range);
+}
+/*
+ * Compute the hit t values of the rays with the plane, returns the mask of active
+ * rays hitting it within their [t_min, t_max] range
+ */
+template<typename B>
+inline typename B::Mask plane_hit(const RayN<B> &ray, const Vec3fN<B> &pos, const Vec3fN<B> &normal,
+		typename B::Float &t)
+{
+	t = B::div((pos - ray.o).dot(normal), ray.d.dot(normal));
+	const auto hits = B::mask_and(B::cmp_gt(t, ray.t_min), B::cmp_lt(t, ray.t_max));
+	return B::mask_and(hits, ray.active);
+}
+// Write the hit point, normal and material to dg for the lanes set in hits
+template<typename B>
+inline void blend_hits(DiffGeomN<B> &dg, const Vec3fN<B> &point, const Vec3fN<B> &normal,
+		typename B::Int material, typename B::Mask hits)
+{
+	dg.point.x = B::select(dg.point.x, point.x, hits);
+	dg.point.y = B::select(dg.point.y, point.y, hits);
+	dg.point.z = B::select(dg.point.z, point.z, hits);
+	dg.normal.x = B::select(dg.normal.x, normal.x, hits);
+	dg.normal.y = B::select(dg.normal.y, normal.y, hits);
+	dg.normal.z = B::select(dg.normal.z, normal.z, hits);
+	dg.material_id = B::select(dg.material_id, material, hits);
+}
+/*
+ * Find the closest sphere hit by each of the rays, returns the mask of rays that
+ * hit a sphere closer than their current t_max and fills out dg for them
+ */
+template<typename B>
+typename B::Mask intersect_spheres(const SphereArrays &s, RayN<B> &ray, DiffGeomN<B> &dg){
+	// Track the closest sphere hit by each ray, the differential geometry
+	// is only computed once we've found the closest hits
+	auto prim_id = B::set1i(-1);
+	const auto a = ray.d.length_sqr();
+	const auto inv_a = B::div(B::set1(1.f), a);
+	const auto hits = bvh_intersect(s.bvh, ray,
+		[&](uint32_t i, RayN<B> &r){
+			PERF_COUNT(PRIMITIVE_TESTS, 1);
+			typename B::Float t;
+			const auto h = sphere_hit(r, a, inv_a, Vec3fN<B>{s.x[i], s.y[i], s.z[i]}, B::set1(s.radius[i]), t);
+			if (B::bits(h) != 0){
+				r.t_max = B::select(r.t_max, t, h);
+				prim_id = B::select(prim_id, B::set1i(i), h);
+			}
+			return h;
+		});
+	if (B::bits(hits) == 0){
+		return hits;
+	}
+	// Lanes that missed look up the first sphere, their values are thrown away
+	const auto id = B::select(B::set1i(0), prim_id, hits);
+	const auto center = Vec3fN<B>{B::gather(s.x, id), B::gather(s.y, id), B::gather(s.z, id)};
+	const auto inv_radius = B::div(B::set1(1.f), B::gather(s.radius, id));
+	const auto point = ray.at(ray.t_max);
+	blend_hits(dg, point, inv_radius * (point - center), B::gather(s.material_id, id), hits);
+	return hits;
+}
+/*
+ * Find which rays are blocked by any sphere, returns the mask of blocked rays
+ * and removes them from ray.active
+ */
+template<typename B>
+typename B::Mask occluded_spheres(const SphereArrays &s, RayN<B> &ray){
+	const auto a = ray.d.length_sqr();
+	const auto inv_a = B::div(B::set1(1.f), a);
+	return bvh_occluded(s.bvh, ray,
+		[&](uint32_t i, RayN<B> &r){
+			PERF_COUNT(PRIMITIVE_TESTS, 1);
+			typename B::Float t;
+			return sphere_hit(r, a, inv_a, Vec3fN<B>{s.x[i], s.y[i], s.z[i]}, B::set1(s.radius[i]), t);
+		});
+}
+template<typename B>
+typename B::Mask intersect_planes(const PlaneArrays &p, RayN<B> &ray, DiffGeomN<B> &dg){
+	auto hits = B::mask_none();
+	auto normal = Vec3fN<B>{0};
+	auto material = B::set1i(-1);
+	for (uint32_t i = 0; i < p.count; ++i){
+		PERF_COUNT(PRIMITIVE_TESTS, 1);
+		const auto n = Vec3fN<B>{p.nx[i], p.ny[i], p.nz[i]};
+		typename B::Float t;
+		const auto h = plane_hit(ray, Vec3fN<B>{p.x[i], p.y[i], p.z[i]}, n, t);
+		if (B::bits(h) != 0){
+			ray.t_max = B::select(ray.t_max, t, h);
+			normal.x = B::select(normal.x, n.x, h);
+			normal.y = B::select(normal.y, n.y, h);
+			normal.z = B::select(normal.z, n.z, h);
+			material = B::select(material, B::set1i(p.material_id[i]), h);
+			hits = B::mask_or(hits, h);
+		}
+	}
+	if (B::bits(hits) == 0){
+		return hits;
+	}
+	blend_hits(dg, ray.at(ray.t_max), normal, material, hits);
+	return hits;
+}
+template<typename B>
+typename B::Mask occluded_planes(const PlaneArrays &p, RayN<B> &ray){
+	auto blocked = B::mask_none();
+	for (uint32_t i = 0; i < p.count && B::bits(ray.active) != 0; ++i){
+		PERF_COUNT(PRIMITIVE_TESTS, 1);
+		typename B::Float t;
+		blocked = B::mask_or(blocked, plane_hit(ray, Vec3fN<B>{p.x[i], p.y[i], p.z[i]},
+				Vec3fN<B>{p.nx[i], p.ny[i], p.nz[i]}, t));
+		ray.active = B::mask_andnot(blocked, ray.active);
+	}
+	return blocked;
+}
+/*
+ * Intersect the rays with the spheres and then the planes, returns the mask of rays that hit
+ */
+template<typename B>
+typename B::Mask intersect_batches(const BatchArrays &batches, RayN<B> &ray, DiffGeomN<B> &dg){
+	const auto hits = intersect_spheres(batches.spheres, ray, dg);
+	return B::mask_or(hits, intersect_planes(batches.planes, ray, dg));
+}
+/*
+ * Find which rays are blocked by a plane or sphere, planes are the cheapest
+ * to test so they're checked first
+ */
+template<typename B>
+typename B::Mask occluded_batches(const BatchArrays &batches, RayN<B> &ray){
+	const auto blocked = occluded_planes(batches.planes, ray);
+	return B::mask_or(blocked, occluded_spheres(batches.spheres, ray));
+}
+
+/*
+ * All the spheres in the scene stored as a structure of arrays so the
+ * intersection kernels can loop over them without chasing pointers or
+ * making virtual calls. The arrays are sorted in the order the spheres
+ * are referenced by the BVH leaves, so each leaf is a contiguous range.
+ * The arrays are views of either the batch's own storage or a mapped scene file
+ */
+struct SphereBatch {
+	ArrayView<float> x, y, z, radius;
+	ArrayView<int32_t> material_id;
+	BVH bvh;
+
+	SphereBatch();
+	/*
+	 * Use sphere arrays and a BVH over them stored elsewhere, the arrays
+	 * must already be sorted to match the BVH and outlive the batch
+	 */
+	SphereBatch(ArrayView<float> x, ArrayView<float> y, ArrayView<float> z, ArrayView<float> radius,
+		ArrayView<int32_t> material_id, BVH bvh);
+	SphereBatch(const SphereBatch&) = delete;
+	SphereBatch& operator=(const SphereBatch&) = delete;
+	SphereBatch(SphereBatch&&) = default;
+	SphereBatch& operator=(SphereBatch&&) = default;
+	/*
+	 * Add a sphere to the batch's own storage, can't be used on batches
+	 * viewing spheres stored elsewhere
+	 */
+	void add(const Vec3f &pos, float r, int material);
+	/*
+	 * Build the BVH over the spheres and reorder them to match it, must
+	 * be called after adding spheres and before intersecting. Does nothing
+	 * if no spheres were added since the last build
+	 */
+	void build();
+	/*
+	 * Find the closest sphere hit by each of the rays, returns the mask of rays that
+	 * hit a sphere closer than their current t_max and fills out dg for them
+	 */
+	__m256 intersect(Ray8 &ray, DiffGeom8 &dg) const;
+	/*
+	 * Find which rays are blocked by any sphere, returns the mask of blocked rays
+	 * and removes them from ray.active
+	 */
+	__m256 occluded(Ray8 &ray) const;
+	size_t size() const;
+	SphereArrays arrays() const;
+
+private:
+	AlignedVector<float> x_store, y_store, z_store, radius_store;
+	AlignedVector<int32_t> material_store;
+	bool dirty;
+
+	void view_storage();
+};
+
+/*
+ * All the planes in the scene stored as a structure of arrays. Planes
+ * are infinite so they can't go in a BVH, we just loop over all of them.
+ * Like spheres the arrays may be owned or viewed from a mapped scene file
+ */
+struct PlaneBatch {
+	ArrayView<float> x, y, z, nx, ny, nz;
+	ArrayView<int32_t> material_id;
+
+	PlaneBatch();
+	PlaneBatch(ArrayView<float> x, ArrayView<float> y, ArrayView<float> z, ArrayView<float> nx,
+		ArrayView<float> ny, ArrayView<float> nz, ArrayView<int32_t> material_id);
+	PlaneBatch(const PlaneBatch&) = delete;
+	PlaneBatch& operator=(const PlaneBatch&) = delete;
+	PlaneBatch(PlaneBatch&&) = default;
+	PlaneBatch& operator=(PlaneBatch&&) = default;
+	void add(const Vec3f &pos, const Vec3f &normal, int material);
+	__m256 intersect(Ray8 &ray, DiffGeom8 &dg) const;
+	__m256 occluded(Ray8 &ray) const;
+	size_t size() const;
+	PlaneArrays arrays() const;
+
+private:
+	AlignedVector<float> x_store, y_store, z_store, nx_store, ny_store, nz_store;
+	AlignedVector<int32_t> material_store;
+};
+
+#endif
+
@@ -14,7 +14,74 @@ struct Sphere : Geometry {
 	 * Test 8 rays against the sphere, returns masks for the hits (0xff) and misses (0x00)
 	 */
 	__m256 intersect(Ray8 &ray, DiffGeom8 &dg) const override;
+	__m256 occluded(Ray8 &ray) const override;
+	/*
+	 * Width generic versions of intersect and occluded, the 8 wide overrides
+	 * call these with the AVX2 backend
+	 */
+	template<typename B>
+	typename B::Mask intersect(RayN<B> &ray, DiffGeomN<B> &dg) const;
+	template<typename B>
+	typename B::Mask occluded(RayN<B> &ray) const;
+	BBox bounds() const override;
 };
 
+template<typename B>
+inline typename B::Mask Sphere::intersect(RayN<B> &ray, DiffGeomN<B> &dg) const {
+	const auto center = Vec3fN<B>{pos};
+	const auto d = center - ray.o;
+	const auto a = ray.d.length_sqr();
+	const auto b = B::mul(ray.d.dot(d), B::set1(-2.f));
+	const auto c = B::fnmadd(B::set1(radius), B::set1(radius), d.dot(d));
+	// Solve the quadratic equation and store the mask of potential hits
+	// We'll update this mask as we discard other potential hits, eg. due to
+	// the hit being beyond the ray's t value
+	auto t0 = B::set1(0);
+	auto t1 = B::set1(0);
+	auto hits = solve_quadratic<B>(a, b, c, t0, t1);
+	// We want t0 to hold the nearest t value that is greater than ray.t_min
+	t0 = B::select(t0, t1, B::cmp_lt(t0, ray.t_min));
+	// Check which hits are within the ray's t range
+	const auto in_range = B::mask_and(B::cmp_gt(t0, ray.t_min), B::cmp_lt(t0, ray.t_max));
+	hits = B::mask_and(hits, in_range);
+	hits = B::mask_and(hits, ray.active);
+	// Check if all rays miss the sphere
+	if (B::bits(hits) == 0){
+		return hits;
+	}
+	// Update t values for rays that did hit
+	ray.t_max = B::select(ray.t_max, t0, hits);
+
+	const auto point = ray.at(ray.t_max);
+	dg.point.x = B::select(dg.point.x, point.x, hits);
+	dg.point.y = B::select(dg.point.y, point.y, hits);
+	dg.point.z = B::select(dg.point.z, point.z, hits);
+	const auto normal = point - center;
+	dg.normal.x = B::select(dg.normal.x, normal.x, hits);
+	dg.normal.y = B::select(dg.normal.y, normal.y, hits);
+	dg.normal.z = B::select(dg.normal.z, normal.z, hits);
+	dg.normal.normalize();
+	dg.material_id = B::select(dg.material_id, B::set1i(material_id), hits);
+	return hits;
+}
+template<typename B>
+inline typename B::Mask Sphere::occluded(RayN<B> &ray) const {
+	const auto center = Vec3fN<B>{pos};
+	const auto d = center - ray.o;
+	const auto a = ray.d.length_sqr();
+	const auto b = B::mul(ray.d.dot(d), B::set1(-2.f));
+	const auto c = B::fnmadd(B::set1(radius), B::set1(radius), d.dot(d));
+	auto t0 = B::set1(0);
+	auto t1 = B::set1(0);
+	const auto hits = B::mask_and(solve_quadratic<B>(a, b, c, t0, t1), ray.active);
+	if (B::bits(hits) == 0){
+		return hits;
+	}
+	// The ray is blocked if either hit is within its t range
+	const auto t0_in = B::mask_and(B::cmp_gt(t0, ray.t_min), B::cmp_lt(t0, ray.t_max));
+	const auto t1_in = B::mask_and(B::cmp_gt(t1, ray.t_min), B::cmp_lt(t1, ray.t_max));
+	return B::mask_and(hits, B::mask_or(t0_in, t1_in));
+}
+
 #endif
 
@@ -0,0 +1,36 @@
+#ifndef TEST_SCENE_H
+#define TEST_SCENE_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include "camera.h"
+
+struct Scene;
+
+/*
+ * Options for the built in test scene, a red sphere on a blue plane lit by a
+ * point light. The sphere can be replaced by a model or a field of spheres and
+ * the light by a rig of area lights
+ */
+struct TestSceneOptions {
+	// Number of spheres in the sphere field, 0 for the single sphere
+	uint32_t n_spheres;
+	// Number of area lights, 0 for the point light
+	uint32_t n_lights;
+	// OBJ model to place where the sphere would be, if not empty
+	std::string obj_file;
+	// Add a glass and a mirror sphere
+	bool whitted;
+
+	TestSceneOptions();
+};
+
+/*
+ * Build the test scene, returns null if the model couldn't be loaded
+ */
+std::unique_ptr<Scene> make_test_scene(const TestSceneOptions &options);
+SceneCamera test_scene_camera();
+
+#endif
+
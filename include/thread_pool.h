@@ -0,0 +1,49 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+
+/*
+ * A fixed size pool of worker threads. Work is submitted as a single task
+ * which every worker runs once, being passed its worker id in [0, size()),
+ * which is the pattern the renderer uses: each worker pulls blocks from a
+ * shared queue until it runs dry
+ */
+class ThreadPool {
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable task_ready, task_done;
+	std::function<void(uint32_t)> task;
+	// Incremented each time a new task is submitted so workers can tell
+	// a new task apart from the one they just finished
+	uint64_t generation;
+	uint32_t running;
+	bool quit;
+
+public:
+	/*
+	 * Create a pool with n worker threads, if n is 0 one thread
+	 * per hardware thread will be created
+	 */
+	ThreadPool(uint32_t n = 0);
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool();
+	/*
+	 * Run the task on every worker in the pool and wait for them all
+	 * to finish, the task is called with the id of the worker running it
+	 */
+	void run(const std::function<void(uint32_t)> &fn);
+	uint32_t size() const;
+
+private:
+	void worker_loop(uint32_t id);
+};
+
+#endif
+
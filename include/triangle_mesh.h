@@ -0,0 +1,70 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <vector>
+#include <cstdint>
+#include "vec.h"
+#include "array_view.h"
+#include "geometry.h"
+#include "bvh.h"
+
+/*
+ * Vertex and index buffers for a triangle mesh, as loaded from a model file
+ * Triangles are stored as 3 consecutive indices into the vertex buffer,
+ * normals are per-vertex and may be empty if the model didn't have any
+ */
+struct MeshData {
+	std::vector<Vec3f> vertices, normals;
+	std::vector<uint32_t> indices;
+
+	/*
+	 * Uniformly scale and translate the vertices so the mesh is centered
+	 * in the box and fits inside it
+	 */
+	void fit(const BBox &box);
+};
+
+/*
+ * A mesh of triangles sharing a vertex and index buffer. The mesh builds
+ * its own BVH over its triangles which is traversed when the mesh is hit.
+ * Like the sphere batch the buffers and BVH are views of either the mesh's
+ * own storage or a mapped scene file
+ */
+struct TriangleMesh : Geometry {
+	ArrayView<Vec3f> vertices, normals;
+	ArrayView<uint32_t> indices;
+	int material_id;
+	BVH bvh;
+
+	/*
+	 * Create the mesh from the data passed, if the data doesn't have
+	 * normals smooth normals will be computed from the triangles
+	 */
+	TriangleMesh(MeshData data, int material_id);
+	/*
+	 * Use buffers and a BVH over the triangles stored elsewhere, which
+	 * must outlive the mesh. There must be a normal for each vertex
+	 */
+	TriangleMesh(ArrayView<Vec3f> vertices, ArrayView<Vec3f> normals, ArrayView<uint32_t> indices,
+		int material_id, BVH bvh);
+	// The views would point into the other mesh's storage if we copied it
+	TriangleMesh(const TriangleMesh&) = delete;
+	TriangleMesh& operator=(const TriangleMesh&) = delete;
+	__m256 intersect(Ray8 &ray, DiffGeom8 &dg) const override;
+	__m256 occluded(Ray8 &ray) const override;
+	BBox bounds() const override;
+	uint32_t num_triangles() const;
+
+private:
+	/*
+	 * Test 8 rays against triangle i, on a hit t_max is updated and the
+	 * barycentric coordinates of the hit are returned in u and v
+	 */
+	__m256 intersect_triangle(uint32_t i, Ray8 &ray, __m256 &u, __m256 &v) const;
+
+	std::vector<Vec3f> vertex_store, normal_store;
+	std::vector<uint32_t> index_store;
+};
+
+#endif
+
@@ -6,6 +6,7 @@
 #include <ostream>
 #include <cfloat>
 #include "immintrin.h"
+#include "simd.h"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -36,14 +37,75 @@ inline __m256 vabs(__m256 v){
 	return _mm256_andnot_ps(sign_mask, v);
 }
 
+/*
+ * Compute the horizontal sum of the 8 values in the vector
+ */
+inline float hsum(__m256 v){
+	const auto a = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	const auto b = _mm_add_ps(a, _mm_movehl_ps(a, a));
+	const auto c = _mm_add_ss(b, _mm_movehdup_ps(b));
+	return _mm_cvtss_f32(c);
+}
+
+/*
+ * Compute the sine and cosine of the angles in x, which should be in [-pi, pi].
+ * The angles are reflected into [-pi/2, pi/2] and run through the Taylor series,
+ * which is accurate to about 1e-6 over that range
+ */
+inline void vsincos(__m256 x, __m256 &s, __m256 &c){
+	const auto pi = _mm256_set1_ps(static_cast<float>(M_PI));
+	const auto half_pi = _mm256_set1_ps(static_cast<float>(M_PI_2));
+	const auto neg_pi = _mm256_set1_ps(static_cast<float>(-M_PI));
+	const auto neg_half_pi = _mm256_set1_ps(static_cast<float>(-M_PI_2));
+	auto sin_reduced = [&](__m256 a){
+		a = _mm256_blendv_ps(a, _mm256_sub_ps(pi, a), _mm256_cmp_ps(a, half_pi, _CMP_GT_OQ));
+		a = _mm256_blendv_ps(a, _mm256_sub_ps(neg_pi, a), _mm256_cmp_ps(a, neg_half_pi, _CMP_LT_OQ));
+		const auto a2 = _mm256_mul_ps(a, a);
+		auto p = _mm256_set1_ps(-1.f / 39916800.f);
+		p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(1.f / 362880.f));
+		p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(-1.f / 5040.f));
+		p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(1.f / 120.f));
+		p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(-1.f / 6.f));
+		p = _mm256_fmadd_ps(p, a2, _mm256_set1_ps(1.f));
+		return _mm256_mul_ps(p, a);
+	};
+	s = sin_reduced(x);
+	// cos(x) = sin(x + pi/2), wrapping the shifted angle back into [-pi, pi]
+	auto shifted = _mm256_add_ps(x, half_pi);
+	shifted = _mm256_blendv_ps(shifted, _mm256_sub_ps(shifted, _mm256_add_ps(pi, pi)),
+			_mm256_cmp_ps(shifted, pi, _CMP_GT_OQ));
+	c = sin_reduced(shifted);
+}
+
 template<typename T>
 inline T clamp(T x, T min, T max){
 	return x < min ? min : x > max ? max : x;
 }
 
-// Attempt to solve the quadratic equation. Returns a mask of successful solutions (0xff)
-// and stores the computed t values in t0 and t1
-__m256 solve_quadratic(const __m256 a, const __m256 b, const __m256 c, __m256 &t0, __m256 &t1);
+// Attempt to solve the quadratic equation. Returns a mask of successful solutions
+// and stores the computed t values in t0 and t1, with t0 <= t1
+template<typename B>
+inline typename B::Mask solve_quadratic(const typename B::Float a, const typename B::Float b, const typename B::Float c,
+		typename B::Float &t0, typename B::Float &t1)
+{
+	auto discrim = B::fmsub(b, b, B::mul(B::mul(a, c), B::set1(4.f)));
+	const auto solved = B::cmp_gt(discrim, B::set1(0));
+	// Test for the case where none of the equations can be solved (eg. none hit)
+	if (B::bits(solved) == 0){
+		return solved;
+	}
+	// Compute +/-sqrt(discrim), setting -discrim where we have b < 0
+	discrim = B::sqrt(discrim);
+	discrim = B::select(discrim, B::neg(discrim), B::cmp_lt(b, B::set1(0)));
+	const auto q = B::mul(B::set1(-0.5f), B::add(b, discrim));
+	const auto x = B::div(q, a);
+	const auto y = B::div(c, q);
+	// Find which elements have t0 > t1 so we can swap them
+	const auto swap = B::cmp_gt(x, y);
+	t0 = B::select(x, y, swap);
+	t1 = B::select(y, x, swap);
+	return solved;
+}
 
 // A single vec3f
 struct Vec3f {
@@ -66,6 +128,20 @@ struct Vec3f {
 		const float s = 1.f / length();
 		return Vec3f{x * s, y * s, z * s};
 	}
+	inline float& operator[](int i){
+		switch (i){
+			case 0: return x;
+			case 1: return y;
+			default: return z;
+		}
+	}
+	inline const float& operator[](int i) const {
+		switch (i){
+			case 0: return x;
+			case 1: return y;
+			default: return z;
+		}
+	}
 };
 inline Vec3f operator+(const Vec3f &a, const Vec3f &b){
 	return Vec3f{a.x + b.x, a.y + b.y,  a.z + b.z};
@@ -95,48 +171,43 @@ inline std::ostream& operator<<(std::ostream &os, const Vec3f &v){
 	return os;
 }
 
-// Struct holding 8 vec3f's
-struct Vec3f_8 {
-	__m256 x, y, z;
+// Struct holding a packet of vec3f's, one per lane of the SIMD backend
+template<typename B>
+struct Vec3fN {
+	using Float = typename B::Float;
+	Float x, y, z;
 
-	inline Vec3f_8(float x = 0, float y = 0, float z = 0)
-		: x(_mm256_set1_ps(x)), y(_mm256_set1_ps(y)), z(_mm256_set1_ps(z)){}
-	inline Vec3f_8(Vec3f v)
-		: x(_mm256_set1_ps(v.x)), y(_mm256_set1_ps(v.y)), z(_mm256_set1_ps(v.z)){}
-	inline Vec3f_8(__m256 x, __m256 y, __m256 z) : x(x), y(y), z(z){}
-	// Compute length^2 of all 8 vectors
-	inline __m256 length_sqr() const {
-		const auto a = _mm256_mul_ps(x, x);
-		const auto b = _mm256_fmadd_ps(y, y, a);
-		return _mm256_fmadd_ps(z, z, b);
+	inline Vec3fN(float x = 0, float y = 0, float z = 0) : x(B::set1(x)), y(B::set1(y)), z(B::set1(z)){}
+	inline Vec3fN(Vec3f v) : x(B::set1(v.x)), y(B::set1(v.y)), z(B::set1(v.z)){}
+	inline Vec3fN(Float x, Float y, Float z) : x(x), y(y), z(z){}
+	// Compute length^2 of all the vectors
+	inline Float length_sqr() const {
+		return B::fmadd(z, z, B::fmadd(y, y, B::mul(x, x)));
 	}
-	// Compute length of all 8 vectors
-	inline __m256 length() const {
-		return _mm256_sqrt_ps(length_sqr());
+	// Compute length of all the vectors
+	inline Float length() const {
+		return B::sqrt(length_sqr());
 	}
-	// Normalize all 8 vectors
+	// Normalize all the vectors
 	inline void normalize(){
-		const auto len = _mm256_rcp_ps(length());
-		x = _mm256_mul_ps(x, len);
-		y = _mm256_mul_ps(y, len);
-		z = _mm256_mul_ps(z, len);
-	}
-	inline Vec3f_8 normalized(){
-		const auto len = _mm256_rcp_ps(length());
-		return Vec3f_8{_mm256_mul_ps(x, len), _mm256_mul_ps(y, len),
-			_mm256_mul_ps(z, len)};
-	}
-	inline __m256 dot(const Vec3f_8 &vb) const {
-		const auto a = _mm256_mul_ps(x, vb.x);
-		const auto b = _mm256_fmadd_ps(y, vb.y, a);
-		return _mm256_fmadd_ps(z, vb.z, b);
-	}
-	inline Vec3f_8 cross(const Vec3f_8 &v) const {
-		return Vec3f_8{_mm256_fmsub_ps(y, v.z, _mm256_mul_ps(z, v.y)),
-			_mm256_fmsub_ps(z, v.x, _mm256_mul_ps(x, v.z)),
-			_mm256_fmsub_ps(x, v.y, _mm256_mul_ps(y, v.z))};
-	}
-	inline __m256& operator[](size_t i){
+		const auto len = B::rcp(length());
+		x = B::mul(x, len);
+		y = B::mul(y, len);
+		z = B::mul(z, len);
+	}
+	inline Vec3fN normalized() const {
+		const auto len = B::rcp(length());
+		return Vec3fN{B::mul(x, len), B::mul(y, len), B::mul(z, len)};
+	}
+	inline Float dot(const Vec3fN &vb) const {
+		return B::fmadd(z, vb.z, B::fmadd(y, vb.y, B::mul(x, vb.x)));
+	}
+	inline Vec3fN cross(const Vec3fN &v) const {
+		return Vec3fN{B::fmsub(y, v.z, B::mul(z, v.y)),
+			B::fmsub(z, v.x, B::mul(x, v.z)),
+			B::fmsub(x, v.y, B::mul(y, v.x))};
+	}
+	inline Float& operator[](size_t i){
 		switch (i){
 			case 0: return x;
 			case 1: return y;
@@ -146,7 +217,7 @@ struct Vec3f_8 {
 				return z;
 		}
 	}
-	inline const __m256& operator[](size_t i) const {
+	inline const Float& operator[](size_t i) const {
 		switch (i){
 			case 0: return x;
 			case 1: return y;
@@ -157,78 +228,87 @@ struct Vec3f_8 {
 		}
 	}
 };
-inline Vec3f_8 operator+(const Vec3f_8 &a, const Vec3f_8 &b){
-	return Vec3f_8{_mm256_add_ps(a.x, b.x), _mm256_add_ps(a.y, b.y), _mm256_add_ps(a.z, b.z)};
+template<typename B>
+inline Vec3fN<B> operator+(const Vec3fN<B> &a, const Vec3fN<B> &b){
+	return Vec3fN<B>{B::add(a.x, b.x), B::add(a.y, b.y), B::add(a.z, b.z)};
 }
-inline Vec3f_8 operator-(const Vec3f_8 &a, const Vec3f_8 &b){
-	return Vec3f_8{_mm256_sub_ps(a.x, b.x), _mm256_sub_ps(a.y, b.y),
-		_mm256_sub_ps(a.z, b.z)};
+template<typename B>
+inline Vec3fN<B> operator-(const Vec3fN<B> &a, const Vec3fN<B> &b){
+	return Vec3fN<B>{B::sub(a.x, b.x), B::sub(a.y, b.y), B::sub(a.z, b.z)};
 }
-inline Vec3f_8 operator-(const Vec3f_8 &a){
-	const auto neg = _mm256_set1_ps(-0.f);
-	return Vec3f_8{_mm256_xor_ps(a.x, neg), _mm256_xor_ps(a.y, neg),
-		_mm256_xor_ps(a.z, neg)};
+template<typename B>
+inline Vec3fN<B> operator-(const Vec3fN<B> &a){
+	return Vec3fN<B>{B::neg(a.x), B::neg(a.y), B::neg(a.z)};
 }
 // Scale all components of the vector
-inline Vec3f_8 operator*(__m256 s, const Vec3f_8 &v){
-	return Vec3f_8{_mm256_mul_ps(s, v.x), _mm256_mul_ps(s, v.y), _mm256_mul_ps(s, v.z)};
+template<typename B>
+inline Vec3fN<B> operator*(typename B::Float s, const Vec3fN<B> &v){
+	return Vec3fN<B>{B::mul(s, v.x), B::mul(s, v.y), B::mul(s, v.z)};
 }
-inline std::ostream& operator<<(std::ostream &os, const Vec3f_8 &v){
-	os << "Vec3f_8:\n\tx = " << v.x
+template<typename B>
+inline std::ostream& operator<<(std::ostream &os, const Vec3fN<B> &v){
+	os << "Vec3f_" << B::WIDTH << ":\n\tx = " << v.x
 		<< "\n\ty = " << v.y
 		<< "\n\tz = " << v.z;
 	return os;
 }
 
-// Struct holding 8 vec2f's
-struct Vec2f_8 {
-	__m256 x, y;
+// Struct holding a packet of vec2f's
+template<typename B>
+struct Vec2fN {
+	using Float = typename B::Float;
+	Float x, y;
 
-	inline Vec2f_8(float x = 0, float y = 0) : x(_mm256_set1_ps(x)), y(_mm256_set1_ps(y)){}
-	inline Vec2f_8(__m256 x, __m256 y) : x(x), y(y){}
-	inline Vec2f_8& operator+=(const Vec2f_8 &a){
-		x = _mm256_add_ps(x, a.x);
-		y = _mm256_add_ps(y, a.y);
+	inline Vec2fN(float x = 0, float y = 0) : x(B::set1(x)), y(B::set1(y)){}
+	inline Vec2fN(Float x, Float y) : x(x), y(y){}
+	inline Vec2fN& operator+=(const Vec2fN &a){
+		x = B::add(x, a.x);
+		y = B::add(y, a.y);
 		return *this;
 	}
 };
-inline Vec2f_8 operator+(const Vec2f_8 &a, const Vec2f_8 &b){
-	return Vec2f_8{_mm256_add_ps(a.x, b.x), _mm256_add_ps(a.y, b.y)};
+template<typename B>
+inline Vec2fN<B> operator+(const Vec2fN<B> &a, const Vec2fN<B> &b){
+	return Vec2fN<B>{B::add(a.x, b.x), B::add(a.y, b.y)};
 }
-inline Vec2f_8 operator-(const Vec2f_8 &a, const Vec2f_8 &b){
-	return Vec2f_8{_mm256_sub_ps(a.x, b.x), _mm256_sub_ps(a.y, b.y)};
+template<typename B>
+inline Vec2fN<B> operator-(const Vec2fN<B> &a, const Vec2fN<B> &b){
+	return Vec2fN<B>{B::sub(a.x, b.x), B::sub(a.y, b.y)};
 }
-inline Vec2f_8 operator/(const Vec2f_8 &a, const Vec2f_8 &b){
-	return Vec2f_8{_mm256_div_ps(a.x, b.x), _mm256_div_ps(a.y, b.y)};
+template<typename B>
+inline Vec2fN<B> operator/(const Vec2fN<B> &a, const Vec2fN<B> &b){
+	return Vec2fN<B>{B::div(a.x, b.x), B::div(a.y, b.y)};
 }
-inline std::ostream& operator<<(std::ostream &os, const Vec2f_8 &v){
-	os << "Vec2f_8:\n\tx = " << v.x
+template<typename B>
+inline std::ostream& operator<<(std::ostream &os, const Vec2fN<B> &v){
+	os << "Vec2f_" << B::WIDTH << ":\n\tx = " << v.x
 		<< "\n\ty = " << v.y;
 	return os;
 }
 
-
-// Packet of 8 rays
-struct Ray8 {
-	Vec3f_8 o, d;
-	__m256 t_min, t_max;
-	__m256 active;
+// Packet of rays
+template<typename B>
+struct RayN {
+	using Float = typename B::Float;
+	Vec3fN<B> o, d;
+	Float t_min, t_max;
+	typename B::Mask active;
 
 	/*
 	 * Create a new group of active rays
-	 * Note: only the sign bit of the active mask will be set, as this is all that's used by blendv
-	 * and movemask
+	 * Note: for AVX2 only the sign bit of the active mask will be set, as this is all that's
+	 * used by blendv and movemask
 	 */
-	Ray8(Vec3f_8 o = Vec3f_8{}, Vec3f_8 d = Vec3f_8{}, float t_min_ = 0, float t_max_ = INFINITY)
-		: o(o), d(d), t_min(_mm256_set1_ps(t_min_)), t_max(_mm256_set1_ps(t_max_)),
-		active(_mm256_set1_ps(-0.f))
+	RayN(Vec3fN<B> o = Vec3fN<B>{}, Vec3fN<B> d = Vec3fN<B>{}, float t_min_ = 0, float t_max_ = INFINITY)
+		: o(o), d(d), t_min(B::set1(t_min_)), t_max(B::set1(t_max_)), active(B::mask_all())
 	{}
-	Vec3f_8 at(__m256 t) const {
+	Vec3fN<B> at(Float t) const {
 		return o + t * d;
 	}
 };
-inline std::ostream& operator<<(std::ostream &os, const Ray8 &r){
-	os << "Ray8:\no = " << r.o
+template<typename B>
+inline std::ostream& operator<<(std::ostream &os, const RayN<B> &r){
+	os << "Ray" << B::WIDTH << ":\no = " << r.o
 		<< "\nd = " << r.d
 		<< "\nt_max = " << r.t_max
 		<< "\nt_min = " << r.t_min
@@ -237,5 +317,13 @@ inline std::ostream& operator<<(std::ostream &os, const Ray8 &r){
 	return os;
 }
 
+using Vec3f_8 = Vec3fN<AVX2>;
+using Vec2f_8 = Vec2fN<AVX2>;
+using Ray8 = RayN<AVX2>;
+#ifdef __AVX512F__
+using Vec3f_16 = Vec3fN<AVX512>;
+using Vec2f_16 = Vec2fN<AVX512>;
+using Ray16 = RayN<AVX512>;
 #endif
 
+#endif
@@ -0,0 +1,205 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "scene.h"
+#include "scene_file.h"
+#include "autotune.h"
+
+static const char* order_name(BlockOrder order){
+	return order == BlockOrder::MORTON ? "morton" : "scanline";
+}
+static bool parse_order(const std::string &name, BlockOrder &order){
+	if (name == "morton"){
+		order = BlockOrder::MORTON;
+	}
+	else if (name == "scanline"){
+		order = BlockOrder::SCANLINE;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+/*
+ * Parse a line of the cache file, which holds the key in hex, the settings
+ * and the machine they were tuned on
+ */
+static bool parse_entry(const std::string &line, uint64_t &key, std::string &machine, TuneSettings &settings){
+	std::istringstream ss{line};
+	std::string order;
+	if (!(ss >> std::hex >> key >> std::dec >> settings.block_dim >> order >> settings.n_threads)
+			|| !parse_order(order, settings.order) || settings.block_dim == 0 || settings.n_threads == 0)
+	{
+		return false;
+	}
+	std::getline(ss >> std::ws, machine);
+	return !machine.empty();
+}
+template<typename T>
+static void hash_array(Hasher &hasher, const ArrayView<T> &a){
+	hasher.add(a.size());
+	hasher.add(a.data(), a.size() * sizeof(T));
+}
+static void hash_vec(Hasher &hasher, const Vec3f &v){
+	hasher.add(v.x);
+	hasher.add(v.y);
+	hasher.add(v.z);
+}
+static void hash_color(Hasher &hasher, const Colorf &c){
+	hasher.add(c.r);
+	hasher.add(c.g);
+	hasher.add(c.b);
+}
+
+Hasher::Hasher() : hash(14695981039346656037ull){}
+void Hasher::add(const void *data, size_t size){
+	const auto *bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; ++i){
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+}
+uint64_t Hasher::value() const {
+	return hash;
+}
+
+uint64_t scene_hash(const Scene &scene){
+	Hasher hasher;
+	if (scene.file){
+		// Hashing the arrays of a mapped scene would touch every page of the file, so
+		// the file is identified by its header, size and modification time instead
+		hasher.add(scene.file->data(), sizeof(SceneFileHeader));
+		hasher.add(scene.file->size());
+		hasher.add(scene.file->modified_time());
+	}
+	else {
+		const auto &s = scene.spheres;
+		for (const auto &a : {s.x, s.y, s.z, s.radius}){
+			hash_array(hasher, a);
+		}
+		hash_array(hasher, s.material_id);
+		const auto &p = scene.planes;
+		for (const auto &a : {p.x, p.y, p.z, p.nx, p.ny, p.nz}){
+			hash_array(hasher, a);
+		}
+		hash_array(hasher, p.material_id);
+	}
+	hasher.add(scene.geometry.size());
+	for (const auto &g : scene.geometry){
+		const auto b = g->bounds();
+		hash_vec(hasher, b.min);
+		hash_vec(hasher, b.max);
+	}
+	hasher.add(scene.materials.size());
+	for (const auto &m : scene.materials){
+		hash_color(hasher, m->albedo());
+		hasher.add(m->is_specular());
+		const auto *glass = dynamic_cast<const GlassMaterial*>(m.get());
+		hasher.add(glass ? glass->ior : 0.f);
+	}
+	hasher.add(scene.lights.size());
+	for (size_t i = 0; i < scene.lights.size(); ++i){
+		const auto l = scene.lights.get(i);
+		hasher.add(l.type);
+		hash_vec(hasher, l.pos);
+		hash_vec(hasher, l.u);
+		hash_vec(hasher, l.v);
+		hasher.add(l.radius);
+		hash_color(hasher, l.emission);
+	}
+	return hasher.value();
+}
+std::vector<uint32_t> candidate_block_dims(uint32_t width, uint32_t height){
+	std::vector<uint32_t> dims;
+	for (uint32_t d = 4; d <= 64; ++d){
+		if (width % d == 0 && height % d == 0){
+			dims.push_back(d);
+		}
+	}
+	return dims;
+}
+std::vector<uint32_t> candidate_thread_counts(uint32_t max_threads){
+	std::vector<uint32_t> counts;
+	for (uint32_t n = std::max(max_threads, 1u); n >= std::max(max_threads / 4, 1u); n /= 2){
+		counts.push_back(n);
+		if (n == 1){
+			break;
+		}
+	}
+	return counts;
+}
+TuneSettings autotune(const std::vector<uint32_t> &block_dims, const std::vector<BlockOrder> &orders,
+		const std::vector<uint32_t> &thread_counts, const std::function<double(const TuneSettings&)> &trial)
+{
+	TuneSettings best{block_dims.front(), orders.front(), thread_counts.front()};
+	double best_speed = -1;
+	auto run_trial = [&](const TuneSettings &s){
+		const double speed = trial(s);
+		std::cout << "Autotune: " << s.block_dim << "x" << s.block_dim << " blocks, " << order_name(s.order)
+			<< " order, " << s.n_threads << " threads: " << speed / 1e6 << "M samples/s\n";
+		if (speed > best_speed){
+			best_speed = speed;
+			best = s;
+		}
+	};
+	for (const auto &dim : block_dims){
+		for (const auto &order : orders){
+			run_trial(TuneSettings{dim, order, thread_counts.front()});
+		}
+	}
+	const auto layout = best;
+	for (size_t i = 1; i < thread_counts.size(); ++i){
+		run_trial(TuneSettings{layout.block_dim, layout.order, thread_counts[i]});
+	}
+	return best;
+}
+bool load_tuned_settings(const std::string &file, const std::string &machine, uint64_t key,
+		TuneSettings &settings)
+{
+	std::ifstream in{file};
+	std::string line;
+	while (std::getline(in, line)){
+		uint64_t line_key = 0;
+		std::string line_machine;
+		TuneSettings s;
+		if (parse_entry(line, line_key, line_machine, s) && line_key == key && line_machine == machine){
+			settings = s;
+			return true;
+		}
+	}
+	return false;
+}
+bool save_tuned_settings(const std::string &file, const std::string &machine, uint64_t key,
+		const TuneSettings &settings)
+{
+	// Keep the other entries, dropping any previous settings for this machine and key
+	std::vector<std::string> lines;
+	{
+		std::ifstream in{file};
+		std::string line;
+		while (std::getline(in, line)){
+			uint64_t line_key = 0;
+			std::string line_machine;
+			TuneSettings s;
+			if (!line.empty() && !(parse_entry(line, line_key, line_machine, s) && line_key == key
+						&& line_machine == machine))
+			{
+				lines.push_back(line);
+			}
+		}
+	}
+	std::ostringstream entry;
+	entry << std::hex << key << std::dec << " " << settings.block_dim << " " << order_name(settings.order)
+		<< " " << settings.n_threads << " " << machine;
+	lines.push_back(entry.str());
+	std::ofstream out{file};
+	for (const auto &l : lines){
+		out << l << "\n";
+	}
+	if (!out){
+		std::cerr << "save_tuned_settings Error: failed to write " << file << "\n";
+		return false;
+	}
+	return true;
+}
+
@@ -0,0 +1,552 @@
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include "vec.h"
+#include "color.h"
+#include "camera.h"
+#include "sphere.h"
+#include "plane.h"
+#include "ld_sampler.h"
+#include "rng.h"
+#include "render_target.h"
+#include "aligned_allocator.h"
+#include "test_scene.h"
+#include "scene.h"
+#include "isa.h"
+#include "kernels.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Number of rays, samples or quadratics each benchmark processes per run, small
+// enough that the inputs and outputs stay in the L2 cache
+const uint32_t N_ITEMS = 4096;
+// Cycles are reported per packet of this many items, the width the renderer traces
+const uint32_t PACKET_WIDTH = 8;
+// Each benchmark is timed this many times and the fastest run is reported
+const int N_TRIALS = 5;
+const uint32_t IMG_WIDTH = 800;
+const uint32_t IMG_HEIGHT = 600;
+// Spheres in the field of the scene traced by the batch and scene benchmarks,
+// enough that the rays spend most of their time traversing the BVH
+const uint32_t N_SCENE_SPHERES = 10000;
+
+template<typename T>
+using KernelArray = std::vector<T, AlignedAllocator<T, 64>>;
+
+enum class Input { COHERENT, INCOHERENT };
+
+static const char* input_name(Input input){
+	return input == Input::COHERENT ? "coherent" : "incoherent";
+}
+
+/*
+ * Rays in the layout the dispatched kernels take
+ */
+struct RayData {
+	KernelArray<float> ox, oy, oz, dx, dy, dz, t_min, t_max;
+
+	RayData(uint32_t n) : ox(n), oy(n), oz(n), dx(n), dy(n), dz(n), t_min(n), t_max(n){}
+	RayArrays arrays(){
+		return RayArrays{ox.data(), oy.data(), oz.data(), dx.data(), dy.data(), dz.data(),
+			t_min.data(), t_max.data()};
+	}
+};
+
+/*
+ * Hits in the layout the intersect_batches kernel writes them
+ */
+struct HitData {
+	KernelArray<float> px, py, pz, nx, ny, nz;
+	KernelArray<int32_t> material_id, hit;
+
+	HitData(uint32_t n) : px(n), py(n), pz(n), nx(n), ny(n), nz(n), material_id(n), hit(n){}
+	HitArrays arrays(){
+		return HitArrays{px.data(), py.data(), pz.data(), nx.data(), ny.data(), nz.data(),
+			material_id.data(), hit.data()};
+	}
+};
+
+/*
+ * Load the 8 rays starting at i as a packet for the renderer's 8 wide functions
+ */
+static Ray8 load_packet(const RayData &rays, uint32_t i){
+	Ray8 packet;
+	packet.o = Vec3f_8{_mm256_load_ps(&rays.ox[i]), _mm256_load_ps(&rays.oy[i]), _mm256_load_ps(&rays.oz[i])};
+	packet.d = Vec3f_8{_mm256_load_ps(&rays.dx[i]), _mm256_load_ps(&rays.dy[i]), _mm256_load_ps(&rays.dz[i])};
+	packet.t_min = _mm256_load_ps(&rays.t_min[i]);
+	packet.t_max = _mm256_load_ps(&rays.t_max[i]);
+	return packet;
+}
+/*
+ * Store the packet of rays to the 8 rays starting at i
+ */
+static void store_packet(const Ray8 &packet, RayData &rays, uint32_t i){
+	_mm256_store_ps(&rays.ox[i], packet.o.x);
+	_mm256_store_ps(&rays.oy[i], packet.o.y);
+	_mm256_store_ps(&rays.oz[i], packet.o.z);
+	_mm256_store_ps(&rays.dx[i], packet.d.x);
+	_mm256_store_ps(&rays.dy[i], packet.d.y);
+	_mm256_store_ps(&rays.dz[i], packet.d.z);
+	_mm256_store_ps(&rays.t_min[i], packet.t_min);
+	_mm256_store_ps(&rays.t_max[i], packet.t_max);
+}
+
+/*
+ * Screen positions normalized to [0, 1] for the input. Coherent positions are the
+ * pixel centers of a 64x64 window in the middle of the image in scanline order, so
+ * each packet's rays are neighbors and all of them hit the test scene's sphere.
+ * Incoherent positions are spread randomly over the whole image
+ */
+static void make_screen_positions(Input input, KernelArray<float> &u, KernelArray<float> &v){
+	u.resize(N_ITEMS);
+	v.resize(N_ITEMS);
+	if (input == Input::COHERENT){
+		const uint32_t dim = 64;
+		const uint32_t x0 = (IMG_WIDTH - dim) / 2;
+		const uint32_t y0 = (IMG_HEIGHT - dim) / 2;
+		for (uint32_t i = 0; i < N_ITEMS; ++i){
+			u[i] = (x0 + i % dim + 0.5f) / IMG_WIDTH;
+			v[i] = (y0 + i / dim + 0.5f) / IMG_HEIGHT;
+		}
+	}
+	else {
+		std::mt19937 gen{7};
+		std::uniform_real_distribution<float> dist{0, 1};
+		for (uint32_t i = 0; i < N_ITEMS; ++i){
+			u[i] = dist(gen);
+			v[i] = dist(gen);
+		}
+	}
+}
+/*
+ * Rays for the input. Coherent rays are the test scene camera's rays through the coherent
+ * screen positions, incoherent rays start anywhere in a box around the scene and go off in
+ * uniformly random directions so neighboring rays have nothing in common
+ */
+static void make_rays(Input input, const PerspectiveCamera &camera, RayData &rays){
+	if (input == Input::COHERENT){
+		KernelArray<float> u, v;
+		make_screen_positions(input, u, v);
+		for (uint32_t i = 0; i < N_ITEMS; i += PACKET_WIDTH){
+			Ray8 packet;
+			camera.generate_rays(packet, Vec2f_8{_mm256_load_ps(&u[i]), _mm256_load_ps(&v[i])});
+			store_packet(packet, rays, i);
+		}
+		return;
+	}
+	std::mt19937 gen{13};
+	std::uniform_real_distribution<float> pos{-2, 2};
+	std::normal_distribution<float> dir;
+	for (uint32_t i = 0; i < N_ITEMS; ++i){
+		rays.ox[i] = pos(gen);
+		rays.oy[i] = pos(gen);
+		rays.oz[i] = pos(gen);
+		const auto d = Vec3f{dir(gen), dir(gen), dir(gen)}.normalized();
+		rays.dx[i] = d.x;
+		rays.dy[i] = d.y;
+		rays.dz[i] = d.z;
+		rays.t_min[i] = 0;
+		rays.t_max[i] = INFINITY;
+	}
+}
+
+/*
+ * A benchmark of a function on one input, run processes n_items items each call.
+ * If the function modifies its inputs reset restores them before each run,
+ * the time taken by reset is measured on its own and subtracted
+ */
+struct Benchmark {
+	std::string name;
+	const char *input;
+	ISA isa;
+	uint32_t n_items;
+	std::function<void()> run, reset;
+};
+
+struct BenchTiming {
+	double cycles_per_packet, items_per_sec;
+};
+
+/*
+ * Time n calls of f, returning the elapsed TSC cycles and seconds
+ */
+template<typename F>
+static void time_calls(const F &f, uint64_t n, double &cycles, double &seconds){
+	const auto start = Clock::now();
+	const uint64_t tsc_start = __rdtsc();
+	for (uint64_t i = 0; i < n; ++i){
+		f();
+	}
+	cycles = static_cast<double>(__rdtsc() - tsc_start);
+	seconds = std::chrono::duration_cast<std::chrono::duration<double>>(Clock::now() - start).count();
+}
+
+static BenchTiming time_benchmark(const Benchmark &bench, double min_time){
+	auto run = [&](){
+		if (bench.reset){
+			bench.reset();
+		}
+		bench.run();
+	};
+	// Warm up the caches and find how many calls take roughly a trial's share of the time
+	uint64_t n_calls = 1;
+	double cycles = 0, seconds = 0;
+	for (;;){
+		time_calls(run, n_calls, cycles, seconds);
+		if (seconds * N_TRIALS >= min_time || n_calls >= (1ull << 40)){
+			break;
+		}
+		n_calls *= 2;
+	}
+	double best_cycles = INFINITY, best_seconds = INFINITY;
+	for (int i = 0; i < N_TRIALS; ++i){
+		time_calls(run, n_calls, cycles, seconds);
+		if (bench.reset){
+			double reset_cycles = 0, reset_seconds = 0;
+			time_calls(bench.reset, n_calls, reset_cycles, reset_seconds);
+			cycles = std::max(0.0, cycles - reset_cycles);
+			seconds = std::max(0.0, seconds - reset_seconds);
+		}
+		best_cycles = std::min(best_cycles, cycles);
+		best_seconds = std::min(best_seconds, seconds);
+	}
+	const double items = static_cast<double>(n_calls) * bench.n_items;
+	return BenchTiming{best_cycles / (items / PACKET_WIDTH), items / best_seconds};
+}
+
+/*
+ * The inputs shared by the benchmarks, built once with fixed seeds so every
+ * run of the benchmark sees the same values
+ */
+struct BenchData {
+	PerspectiveCamera camera;
+	Sphere sphere;
+	Plane plane;
+	// Rays and screen positions for each input, indexed by Input
+	RayData rays[2];
+	KernelArray<float> u[2], v[2];
+	// Coefficients of the rays' intersection with the sphere
+	KernelArray<float> a[2], b[2], c[2];
+	// The test scene with a sphere field in place of the sphere
+	std::unique_ptr<Scene> scene;
+
+	BenchData() : camera(test_scene_camera(), static_cast<float>(IMG_WIDTH) / IMG_HEIGHT),
+		sphere(Vec3f{0}, 0.5f, 0), plane(Vec3f{0, -0.5f, 0.5f}, Vec3f{0, 1, 0}, 1),
+		rays{RayData{N_ITEMS}, RayData{N_ITEMS}}
+	{
+		TestSceneOptions options;
+		options.n_spheres = N_SCENE_SPHERES;
+		scene = make_test_scene(options);
+		for (int i = 0; i < 2; ++i){
+			const auto input = static_cast<Input>(i);
+			make_screen_positions(input, u[i], v[i]);
+			make_rays(input, camera, rays[i]);
+			a[i].resize(N_ITEMS);
+			b[i].resize(N_ITEMS);
+			c[i].resize(N_ITEMS);
+			for (uint32_t j = 0; j < N_ITEMS; ++j){
+				const auto o = Vec3f{rays[i].ox[j], rays[i].oy[j], rays[i].oz[j]} - sphere.pos;
+				const auto d = Vec3f{rays[i].dx[j], rays[i].dy[j], rays[i].dz[j]};
+				a[i][j] = d.dot(d);
+				b[i][j] = 2 * d.dot(o);
+				c[i][j] = o.dot(o) - sphere.radius * sphere.radius;
+			}
+		}
+	}
+};
+
+/*
+ * Add the benchmarks of the dispatched kernels built for the ISA tier
+ */
+static void add_kernel_benchmarks(const Kernels &k, BenchData &data, std::vector<Benchmark> &benchmarks){
+	const auto *kp = &k;
+	auto *d = &data;
+	for (int i = 0; i < 2; ++i){
+		const auto *input = input_name(static_cast<Input>(i));
+		// The batch kernels trace the scene at the tier's width, like the renderer does
+		// for Whitted ray streams with the AVX-512 kernels. They move t_max up to the
+		// hits, so it's restored before each run to keep hitting the same objects
+		auto t_max = std::make_shared<KernelArray<float>>(d->rays[i].t_max);
+		auto restore_t_max = [=](){
+			std::copy(t_max->begin(), t_max->end(), d->rays[i].t_max.begin());
+		};
+		auto hits = std::make_shared<HitData>(N_ITEMS);
+		benchmarks.push_back(Benchmark{"intersect_batches", input, k.isa, N_ITEMS,
+			[=](){
+				kp->intersect_batches(d->scene->batch_arrays(), d->rays[i].arrays(), hits->arrays(), N_ITEMS);
+			}, restore_t_max});
+		auto blocked = std::make_shared<KernelArray<int32_t>>(N_ITEMS);
+		benchmarks.push_back(Benchmark{"occluded_batches", input, k.isa, N_ITEMS,
+			[=](){
+				kp->occluded_batches(d->scene->batch_arrays(), d->rays[i].arrays(), blocked->data(), N_ITEMS);
+			}, nullptr});
+	}
+
+	// Resolving goes through the selected kernels, so switch to this tier's while running
+	auto target = std::make_shared<RenderTarget>(IMG_WIDTH, IMG_HEIGHT);
+	auto img = std::make_shared<std::vector<Color24>>();
+	std::mt19937 gen{23};
+	std::uniform_real_distribution<float> dist{0, 2};
+	for (uint32_t y = 0; y < IMG_HEIGHT; ++y){
+		for (uint32_t x = 0; x < IMG_WIDTH; x += 8){
+			const auto p = Vec2f_8{_mm256_add_ps(_mm256_set1_ps(x + 0.5f),
+					_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)), _mm256_set1_ps(y + 0.5f)};
+			const auto col = Colorf_8{dist(gen), dist(gen), dist(gen)};
+			target->write_samples(p, col, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+		}
+	}
+	const auto isa = k.isa;
+	benchmarks.push_back(Benchmark{"get_colorbuf", "image", k.isa, IMG_WIDTH * IMG_HEIGHT,
+		[=](){
+			select_kernels(isa);
+			target->get_colorbuf(*img);
+		}, nullptr});
+}
+
+/*
+ * Add the benchmarks of the 8 wide AVX2 versions of the sampler, the camera, the sphere
+ * and plane tests and the quadratic solver, which the renderer runs for every packet.
+ * The results are stored so the inlined functions aren't optimized out
+ */
+static void add_packet_benchmarks(BenchData &data, std::vector<Benchmark> &benchmarks){
+	auto *d = &data;
+	for (int i = 0; i < 2; ++i){
+		const auto *input = input_name(static_cast<Input>(i));
+		// Each benchmark gets its own outputs, shared by all its runs
+		auto quad_out = std::make_shared<std::vector<KernelArray<float>>>(2, KernelArray<float>(N_ITEMS));
+		auto solved = std::make_shared<KernelArray<int32_t>>(N_ITEMS);
+		benchmarks.push_back(Benchmark{"solve_quadratic", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					auto t0 = _mm256_setzero_ps();
+					auto t1 = _mm256_setzero_ps();
+					const auto s = solve_quadratic<AVX2>(_mm256_load_ps(&d->a[i][j]), _mm256_load_ps(&d->b[i][j]),
+							_mm256_load_ps(&d->c[i][j]), t0, t1);
+					_mm256_store_ps(&(*quad_out)[0][j], t0);
+					_mm256_store_ps(&(*quad_out)[1][j], t1);
+					_mm256_store_si256((__m256i*)&(*solved)[j], _mm256_castps_si256(s));
+				}
+			}, nullptr});
+
+		auto camera_rays = std::make_shared<RayData>(N_ITEMS);
+		benchmarks.push_back(Benchmark{"generate_rays", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					Ray8 packet;
+					d->camera.generate_rays(packet, Vec2f_8{_mm256_load_ps(&d->u[i][j]), _mm256_load_ps(&d->v[i][j])});
+					store_packet(packet, *camera_rays, j);
+				}
+			}, nullptr});
+
+		// The tests are the width generic templates, the 8 wide virtual overrides would add a call
+		auto t_hit = std::make_shared<KernelArray<float>>(N_ITEMS);
+		auto material_id = std::make_shared<KernelArray<int32_t>>(N_ITEMS);
+		benchmarks.push_back(Benchmark{"Sphere::intersect", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					auto packet = load_packet(d->rays[i], j);
+					DiffGeom8 dg;
+					d->sphere.intersect<AVX2>(packet, dg);
+					_mm256_store_ps(&(*t_hit)[j], packet.t_max);
+					_mm256_store_si256((__m256i*)&(*material_id)[j], dg.material_id);
+				}
+			}, nullptr});
+		benchmarks.push_back(Benchmark{"Plane::intersect", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					auto packet = load_packet(d->rays[i], j);
+					DiffGeom8 dg;
+					d->plane.intersect<AVX2>(packet, dg);
+					_mm256_store_ps(&(*t_hit)[j], packet.t_max);
+					_mm256_store_si256((__m256i*)&(*material_id)[j], dg.material_id);
+				}
+			}, nullptr});
+	}
+
+	// The sampler always walks a block in the same order, so there's only one input.
+	// Each run takes every sample in an 8x8 block at 64spp
+	// The sampler and RNG hold cache aligned state, which make_shared doesn't respect
+	auto sampler = std::allocate_shared<LDSampler>(AlignedAllocator<LDSampler, 64>{}, 64, 8);
+	auto rng = std::allocate_shared<RNG>(AlignedAllocator<RNG, 64>{}, 17);
+	auto samples = std::make_shared<KernelArray<float>>(2 * PACKET_WIDTH);
+	benchmarks.push_back(Benchmark{"LDSampler::sample", "block", ISA::AVX2, 64 * 8 * 8,
+		[=](){
+			while (sampler->has_samples()){
+				Vec2f_8 s;
+				sampler->sample(*rng, s);
+				_mm256_store_ps(samples->data(), s.x);
+				_mm256_store_ps(samples->data() + PACKET_WIDTH, s.y);
+			}
+		},
+		[=](){
+			sampler->select_block(std::make_pair(0u, 0u));
+		}});
+}
+
+/*
+ * Add the benchmarks of the sphere batch and the whole scene, which the renderer
+ * traces 8 rays at once with AVX2. Each run traces all the input's rays as packets
+ * of 8, which copy the rays so t_max doesn't need restoring
+ */
+static void add_scene_benchmarks(BenchData &data, std::vector<Benchmark> &benchmarks){
+	auto *d = &data;
+	for (int i = 0; i < 2; ++i){
+		const auto *input = input_name(static_cast<Input>(i));
+		benchmarks.push_back(Benchmark{"SphereBatch::intersect", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				DiffGeom8 dg;
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					auto packet = load_packet(d->rays[i], j);
+					d->scene->spheres.intersect(packet, dg);
+				}
+			}, nullptr});
+		benchmarks.push_back(Benchmark{"SphereBatch::occluded", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					auto packet = load_packet(d->rays[i], j);
+					d->scene->spheres.occluded(packet);
+				}
+			}, nullptr});
+		benchmarks.push_back(Benchmark{"Scene::intersect", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				DiffGeom8 dg;
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					auto packet = load_packet(d->rays[i], j);
+					d->scene->intersect(packet, dg);
+				}
+			}, nullptr});
+		benchmarks.push_back(Benchmark{"Scene::occluded", input, ISA::AVX2, N_ITEMS,
+			[=](){
+				for (uint32_t j = 0; j < N_ITEMS; j += PACKET_WIDTH){
+					auto packet = load_packet(d->rays[i], j);
+					d->scene->occluded(packet);
+				}
+			}, nullptr});
+	}
+}
+
+/*
+ * Add the benchmarks of RenderTarget::write_samples, which is only built for AVX2.
+ * Coherent packets have all their samples in the same pixel like the sampler produces,
+ * incoherent ones scatter their samples over the image
+ */
+static void add_write_samples_benchmarks(std::vector<Benchmark> &benchmarks){
+	const uint32_t n_packets = N_ITEMS / PACKET_WIDTH;
+	for (int i = 0; i < 2; ++i){
+		const auto input = static_cast<Input>(i);
+		auto target = std::make_shared<RenderTarget>(IMG_WIDTH, IMG_HEIGHT);
+		auto x = std::make_shared<KernelArray<float>>(N_ITEMS);
+		auto y = std::make_shared<KernelArray<float>>(N_ITEMS);
+		auto col = std::make_shared<KernelArray<float>>(3 * N_ITEMS);
+		std::mt19937 gen{29};
+		std::uniform_real_distribution<float> dist{0, 1};
+		for (uint32_t j = 0; j < N_ITEMS; ++j){
+			if (input == Input::COHERENT){
+				const uint32_t pixel = j / PACKET_WIDTH;
+				(*x)[j] = IMG_WIDTH / 2 - 32 + pixel % 64 + dist(gen);
+				(*y)[j] = IMG_HEIGHT / 2 - 4 + pixel / 64 + dist(gen);
+			}
+			else {
+				(*x)[j] = dist(gen) * IMG_WIDTH;
+				(*y)[j] = dist(gen) * IMG_HEIGHT;
+			}
+			for (uint32_t c = 0; c < 3; ++c){
+				(*col)[c * N_ITEMS + j] = dist(gen);
+			}
+		}
+		benchmarks.push_back(Benchmark{"RenderTarget::write_samples", input_name(input), ISA::AVX2, N_ITEMS,
+			[=](){
+				// Vectors can't be captured, the std::function's storage is only 16 byte aligned
+				const auto mask = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+				for (uint32_t j = 0; j < n_packets; ++j){
+					const uint32_t k = j * PACKET_WIDTH;
+					const auto p = Vec2f_8{_mm256_load_ps(x->data() + k), _mm256_load_ps(y->data() + k)};
+					const auto c = Colorf_8{_mm256_load_ps(col->data() + k),
+						_mm256_load_ps(col->data() + N_ITEMS + k), _mm256_load_ps(col->data() + 2 * N_ITEMS + k)};
+					target->write_samples(p, c, mask);
+				}
+			}, nullptr});
+	}
+}
+
+int main(int argc, char **argv){
+	// The sampler, camera and render target are built for AVX2 like in the renderer
+	if (detect_isa() < ISA::AVX2){
+		std::cerr << "Error: micro_packet_bench requires a CPU with AVX2 and FMA support\n";
+		return 1;
+	}
+	std::string filter;
+	double min_time = 0.5;
+	bool tier_selected = false;
+	ISA tier = ISA::AVX2;
+	for (int i = 1; i < argc; ++i){
+		if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc){
+			filter = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc){
+			min_time = std::strtod(argv[++i], nullptr);
+		}
+		else if (std::strcmp(argv[i], "--isa") == 0 && i + 1 < argc && parse_isa(argv[i + 1], tier)){
+			if (!get_kernels(tier)){
+				std::cerr << "Error: " << isa_name(tier) << " kernels aren't supported on this CPU\n";
+				return 1;
+			}
+			tier_selected = true;
+			++i;
+		}
+		else {
+			std::cout << "Usage: " << argv[0] << " [--filter name] [--min-time seconds]"
+				<< " [--isa avx2|avx512]\n";
+			return 1;
+		}
+	}
+	const ISA default_isa = kernels().isa;
+	BenchData data;
+	std::vector<Benchmark> benchmarks;
+	for (auto isa : {ISA::AVX2, ISA::AVX512}){
+		const auto *k = get_kernels(isa);
+		if (k && (!tier_selected || isa == tier)){
+			add_kernel_benchmarks(*k, data, benchmarks);
+		}
+	}
+	if (!tier_selected || tier == ISA::AVX2){
+		add_packet_benchmarks(data, benchmarks);
+		add_scene_benchmarks(data, benchmarks);
+		add_write_samples_benchmarks(benchmarks);
+	}
+	// List each function's tiers next to each other so they're easy to compare
+	std::stable_sort(benchmarks.begin(), benchmarks.end(), [](const Benchmark &a, const Benchmark &b){
+		return a.name < b.name || (a.name == b.name && std::strcmp(a.input, b.input) < 0);
+	});
+
+	std::cout << "Cycles are TSC cycles per packet of " << PACKET_WIDTH
+		<< " rays, samples or pixels, throughput is in millions of them per second\n"
+		<< std::left << std::setw(30) << "benchmark" << std::setw(12) << "input" << std::setw(8) << "isa"
+		<< std::right << std::setw(14) << "cycles/packet" << std::setw(12) << "Mrays/s" << "\n"
+		<< std::fixed << std::setprecision(2);
+	for (const auto &b : benchmarks){
+		if (!filter.empty() && b.name.find(filter) == std::string::npos){
+			continue;
+		}
+		const auto timing = time_benchmark(b, min_time);
+		std::cout << std::left << std::setw(30) << b.name << std::setw(12) << b.input << std::setw(8)
+			<< isa_name(b.isa) << std::right << std::setw(14) << timing.cycles_per_packet
+			<< std::setw(12) << timing.items_per_sec / 1e6 << std::endl;
+	}
+	select_kernels(default_isa);
+	return 0;
+}
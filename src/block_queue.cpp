@@ -16,36 +16,184 @@ static uint32_t morton2(uint32_t x, uint32_t y){
 	return (part1_by1(y) << 1) + part1_by1(x);
 }
 
-BlockQueue::BlockQueue(uint32_t block_dim, uint32_t imgw, uint32_t imgh)
-	: block_dim(block_dim), next_block(0)
+static inline uint64_t pack_range(uint32_t begin, uint32_t end){
+	return (static_cast<uint64_t>(begin) << 32) | end;
+}
+static inline uint32_t range_begin(uint64_t r){
+	return static_cast<uint32_t>(r >> 32);
+}
+static inline uint32_t range_end(uint64_t r){
+	return static_cast<uint32_t>(r);
+}
+
+BlockQueue::BlockQueue(uint32_t block_dim, uint32_t imgw, uint32_t imgh, uint32_t n_workers, BlockOrder order)
+	: block_dim(block_dim), order(order), blocks_per_row(imgw / block_dim),
+	n_blocks(blocks_per_row * (imgh / block_dim)), ranges(std::max(n_workers, 1u)),
+	workers(std::max(n_workers, 1u))
 {
 	if (imgw % block_dim != 0 || imgh % block_dim != 0){
 		std::cout << "BlockQueue WARNING: blocks don't evenly partition the image\n";
 	}
-	blocks.resize(imgw * imgh / (block_dim * block_dim), std::make_pair(0, 0));
-	int blocks_per_row = imgw / block_dim;
-	int b = 0;
-	std::generate(blocks.begin(), blocks.end(),
-		[&](){
-			int i = b++;
-			return std::make_pair(i % blocks_per_row, i / blocks_per_row);
-		});
-	std::sort(blocks.begin(), blocks.end(),
-		[](const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b){
-			return morton2(a.first, a.second) < morton2(b.first, b.second);
-		});
-}
-std::pair<uint32_t, uint32_t> BlockQueue::next(){
-	if (next_block >= blocks.size()){
-		return end();
-	}
-	const auto b = blocks[next_block++];
+	if (order == BlockOrder::MORTON){
+		blocks.resize(n_blocks, std::make_pair(0, 0));
+		uint32_t b = 0;
+		std::generate(blocks.begin(), blocks.end(),
+			[&](){
+				const uint32_t i = b++;
+				return std::make_pair(i % blocks_per_row, i / blocks_per_row);
+			});
+		std::sort(blocks.begin(), blocks.end(),
+			[](const std::pair<uint32_t, uint32_t> &a, const std::pair<uint32_t, uint32_t> &b){
+				return morton2(a.first, a.second) < morton2(b.first, b.second);
+			});
+	}
+	partition();
+}
+std::pair<uint32_t, uint32_t> BlockQueue::next(uint32_t worker){
+	auto &state = workers[worker];
+	auto &own = ranges[worker].range;
+	uint32_t block = 0;
+	bool found = false;
+	// Pop from the front of our own range, thieves take from the back
+	// so we only contend with them when the range is almost empty
+	uint64_t r = own.load(std::memory_order_relaxed);
+	while (range_begin(r) < range_end(r)){
+		if (own.compare_exchange_weak(r, pack_range(range_begin(r) + 1, range_end(r)),
+					std::memory_order_relaxed))
+		{
+			block = range_begin(r);
+			found = true;
+			break;
+		}
+	}
+	if (!found){
+		if (!state.searching){
+			state.searching = true;
+			state.search_start = Clock::now();
+		}
+		found = steal(worker, block);
+		const auto now = Clock::now();
+		state.stats.idle += std::chrono::duration<double>(now - state.search_start).count();
+		state.search_start = now;
+		if (!found){
+			state.finished = now;
+			return end();
+		}
+		state.searching = false;
+		++state.stats.steals;
+	}
+	++state.stats.blocks;
+	const auto b = block_position(block);
 	return std::make_pair(b.first * block_dim, b.second * block_dim);
 }
 std::pair<uint32_t, uint32_t> BlockQueue::end(){
 	return std::make_pair(-1, -1);
 }
+void BlockQueue::reset(){
+	// Fold the time workers spent waiting for the last pass to finish into
+	// their stats before we lose track of when they finished
+	const auto stats = get_stats();
+	for (size_t i = 0; i < workers.size(); ++i){
+		workers[i].stats = stats[i];
+	}
+	partition();
+}
+uint32_t BlockQueue::retire(const std::function<bool(const std::pair<uint32_t, uint32_t>&)> &converged){
+	if (blocks.empty()){
+		blocks.reserve(n_blocks);
+		for (uint32_t i = 0; i < n_blocks; ++i){
+			blocks.push_back(block_position(i));
+		}
+	}
+	// Removing blocks keeps the rest in order
+	blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+		[&](const std::pair<uint32_t, uint32_t> &b){
+			return converged(std::make_pair(b.first * block_dim, b.second * block_dim));
+		}),
+		blocks.end());
+	n_blocks = blocks.size();
+	return n_blocks;
+}
 uint32_t BlockQueue::get_block_dim() const {
 	return block_dim;
 }
-
+BlockOrder BlockQueue::get_order() const {
+	return order;
+}
+std::vector<WorkerStats> BlockQueue::get_stats() const {
+	// Workers that ran out early were idle until the last one finished
+	Clock::time_point last_finish;
+	for (const auto &w : workers){
+		if (w.searching){
+			last_finish = std::max(last_finish, w.finished);
+		}
+	}
+	std::vector<WorkerStats> stats;
+	for (const auto &w : workers){
+		stats.push_back(w.stats);
+		if (w.searching){
+			stats.back().idle += std::chrono::duration<double>(last_finish - w.finished).count();
+		}
+	}
+	return stats;
+}
+void BlockQueue::report(std::ostream &os) const {
+	const auto stats = get_stats();
+	os << "BlockQueue: " << n_blocks << " blocks over " << stats.size() << " workers\n";
+	for (size_t i = 0; i < stats.size(); ++i){
+		os << "\tworker " << i << ": " << stats[i].blocks << " blocks, "
+			<< stats[i].steals << " steals, " << stats[i].idle * 1000.0 << "ms idle\n";
+	}
+}
+std::pair<uint32_t, uint32_t> BlockQueue::block_position(uint32_t i) const {
+	if (!blocks.empty()){
+		return blocks[i];
+	}
+	return std::make_pair(i % blocks_per_row, i / blocks_per_row);
+}
+void BlockQueue::partition(){
+	const uint32_t n = ranges.size();
+	for (uint32_t i = 0; i < n; ++i){
+		const uint32_t begin = static_cast<uint64_t>(n_blocks) * i / n;
+		const uint32_t end = static_cast<uint64_t>(n_blocks) * (i + 1) / n;
+		ranges[i].range.store(pack_range(begin, end), std::memory_order_relaxed);
+		workers[i].searching = false;
+	}
+}
+bool BlockQueue::steal(uint32_t worker, uint32_t &block){
+	const uint32_t n = ranges.size();
+	for (;;){
+		// Find the worker with the most blocks left, stealing from it takes
+		// the most work in one go and makes further steals less likely
+		uint32_t victim = n;
+		uint32_t most = 0;
+		uint64_t victim_range = 0;
+		for (uint32_t i = 1; i < n; ++i){
+			const uint32_t v = (worker + i) % n;
+			const uint64_t r = ranges[v].range.load(std::memory_order_relaxed);
+			const uint32_t left = range_end(r) - range_begin(r);
+			if (range_begin(r) < range_end(r) && left > most){
+				most = left;
+				victim = v;
+				victim_range = r;
+			}
+		}
+		if (victim == n){
+			return false;
+		}
+		// Take the back half of the victim's range, if only one block is
+		// left we take it and leave the victim empty
+		const uint32_t begin = range_begin(victim_range);
+		const uint32_t end = range_end(victim_range);
+		const uint32_t mid = begin + (end - begin) / 2;
+		if (ranges[victim].range.compare_exchange_strong(victim_range, pack_range(begin, mid),
+					std::memory_order_relaxed))
+		{
+			// Our own range is empty so no one else will modify it, we can
+			// just store the rest of the stolen blocks
+			ranges[worker].range.store(pack_range(mid + 1, end), std::memory_order_relaxed);
+			block = mid;
+			return true;
+		}
+	}
+}
@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <array>
+#include "bvh.h"
+
+// Number of bins used to evaluate the SAH when picking a split
+static const int N_BINS = 16;
+// Subtrees with more primitives than this are built on their own thread
+// and have their bins computed in parallel
+static const uint32_t PARALLEL_THRESHOLD = 64 * 1024;
+// Beyond this depth we stop using the SAH and just split at the median
+// so the traversal stack in BVH::intersect can't overflow
+static const int MAX_SAH_DEPTH = 64;
+
+struct BuildPrim {
+	BBox bounds;
+	Vec3f centroid;
+	uint32_t index;
+};
+
+struct BuildNode {
+	BBox bounds;
+	std::unique_ptr<BuildNode> children[2];
+	uint32_t first, count;
+	int axis;
+
+	BuildNode() : first(0), count(0), axis(0){}
+};
+
+struct Bin {
+	BBox bounds, centroid_bounds;
+	uint32_t count;
+
+	Bin() : count(0){}
+};
+
+struct Builder {
+	std::vector<BuildPrim> &prims;
+	const uint32_t max_leaf;
+	const uint32_t max_threads;
+	std::atomic<uint32_t> total_nodes;
+	std::atomic<uint32_t> threads;
+
+	Builder(std::vector<BuildPrim> &prims, uint32_t max_leaf)
+		: prims(prims), max_leaf(max_leaf),
+		max_threads(std::max(std::thread::hardware_concurrency(), 1u)),
+		total_nodes(0), threads(1)
+	{}
+	/*
+	 * Run fn(begin, end, chunk) over [begin, end) split into chunks, on
+	 * multiple threads if the range is large enough. Returns the number of chunks used
+	 */
+	template<typename F>
+	uint32_t parallel_chunks(uint32_t begin, uint32_t end, const F &fn){
+		const uint32_t n = end - begin;
+		const uint32_t n_chunks = n > PARALLEL_THRESHOLD ? max_threads : 1;
+		std::vector<std::thread> workers;
+		for (uint32_t i = 1; i < n_chunks; ++i){
+			workers.emplace_back(fn, begin + static_cast<uint64_t>(n) * i / n_chunks,
+				begin + static_cast<uint64_t>(n) * (i + 1) / n_chunks, i);
+		}
+		fn(begin, begin + n / n_chunks, 0);
+		for (auto &w : workers){
+			w.join();
+		}
+		return n_chunks;
+	}
+	/*
+	 * Compute the bounds of the primitives in [begin, end) and of their centroids
+	 */
+	void compute_bounds(uint32_t begin, uint32_t end, BBox &bounds, BBox &centroid_bounds,
+			bool parallel = true)
+	{
+		if (!parallel || end - begin <= PARALLEL_THRESHOLD || max_threads == 1){
+			for (uint32_t i = begin; i < end; ++i){
+				bounds.extend(prims[i].bounds);
+				centroid_bounds.extend(prims[i].centroid);
+			}
+			return;
+		}
+		std::vector<BBox> chunk_bounds(max_threads), chunk_centroids(max_threads);
+		const uint32_t n_chunks = parallel_chunks(begin, end,
+			[&](uint32_t b, uint32_t e, uint32_t c){
+				compute_bounds(b, e, chunk_bounds[c], chunk_centroids[c], false);
+			});
+		for (uint32_t i = 0; i < n_chunks; ++i){
+			bounds.extend(chunk_bounds[i]);
+			centroid_bounds.extend(chunk_centroids[i]);
+		}
+	}
+	/*
+	 * Bin the primitives in [begin, end) using the bin index function passed
+	 */
+	template<typename F>
+	void compute_bins(uint32_t begin, uint32_t end, const F &bin_index, std::array<Bin, N_BINS> &bins,
+			bool parallel = true)
+	{
+		if (!parallel || end - begin <= PARALLEL_THRESHOLD || max_threads == 1){
+			for (uint32_t i = begin; i < end; ++i){
+				Bin &bin = bins[bin_index(prims[i])];
+				bin.bounds.extend(prims[i].bounds);
+				bin.centroid_bounds.extend(prims[i].centroid);
+				++bin.count;
+			}
+			return;
+		}
+		std::vector<std::array<Bin, N_BINS>> chunk_bins(max_threads);
+		const uint32_t n_chunks = parallel_chunks(begin, end,
+			[&](uint32_t b, uint32_t e, uint32_t c){
+				compute_bins(b, e, bin_index, chunk_bins[c], false);
+			});
+		for (uint32_t c = 0; c < n_chunks; ++c){
+			for (int i = 0; i < N_BINS; ++i){
+				bins[i].bounds.extend(chunk_bins[c][i].bounds);
+				bins[i].centroid_bounds.extend(chunk_bins[c][i].centroid_bounds);
+				bins[i].count += chunk_bins[c][i].count;
+			}
+		}
+	}
+	/*
+	 * Build the subtree for the primitives in [begin, end), the bounds of the primitives
+	 * and their centroids are passed since the parent already computed them while binning
+	 */
+	std::unique_ptr<BuildNode> build(uint32_t begin, uint32_t end, int depth,
+			const BBox &bounds, const BBox &centroid_bounds)
+	{
+		++total_nodes;
+		std::unique_ptr<BuildNode> node{new BuildNode};
+		node->bounds = bounds;
+		const uint32_t n = end - begin;
+		// Packets are traced against every primitive in a leaf at once, so there's
+		// little point in splitting small leaves any further
+		if (n <= max_leaf){
+			make_leaf(*node, begin, end);
+			return node;
+		}
+
+		const int axis = centroid_bounds.max_extent();
+		const float c_min = centroid_bounds.min[axis];
+		const float c_extent = centroid_bounds.max[axis] - c_min;
+		uint32_t mid = begin + n / 2;
+		BBox child_bounds[2], child_centroids[2];
+		// A zero or denormal extent makes the scale infinite, and NaN for NaN centroids
+		const float bin_scale = N_BINS / c_extent;
+		if (!(bin_scale < INFINITY) || depth >= MAX_SAH_DEPTH){
+			// Can't bin the primitives if the centroids are all the same, so just split them in half
+			std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+				[axis](const BuildPrim &a, const BuildPrim &b){
+					return a.centroid[axis] < b.centroid[axis];
+				});
+			compute_bounds(begin, mid, child_bounds[0], child_centroids[0]);
+			compute_bounds(mid, end, child_bounds[1], child_centroids[1]);
+		}
+		else {
+			// Bin the primitives by centroid along the axis and find the cheapest split
+			auto bin_index = [&](const BuildPrim &p){
+				return std::min(static_cast<int>((p.centroid[axis] - c_min) * bin_scale), N_BINS - 1);
+			};
+			std::array<Bin, N_BINS> bins;
+			compute_bins(begin, end, bin_index, bins);
+			// Sweep from the right to find the cost of the right side of each split
+			std::array<float, N_BINS - 1> right_cost;
+			BBox right;
+			uint32_t right_count = 0;
+			for (int i = N_BINS - 1; i > 0; --i){
+				right.extend(bins[i].bounds);
+				right_count += bins[i].count;
+				right_cost[i - 1] = right_count == 0 ? 0 : right_count * right.surface_area();
+			}
+			// Then from the left to find the total cost of each split
+			BBox left;
+			uint32_t left_count = 0;
+			float best_cost = INFINITY;
+			int best_split = 0;
+			for (int i = 0; i < N_BINS - 1; ++i){
+				left.extend(bins[i].bounds);
+				left_count += bins[i].count;
+				const float cost = (left_count == 0 ? 0 : left_count * left.surface_area()) + right_cost[i];
+				if (left_count != 0 && left_count != n && cost < best_cost){
+					best_cost = cost;
+					best_split = i;
+				}
+			}
+			for (int i = 0; i < N_BINS; ++i){
+				const int side = i <= best_split ? 0 : 1;
+				child_bounds[side].extend(bins[i].bounds);
+				child_centroids[side].extend(bins[i].centroid_bounds);
+			}
+			auto it = std::partition(prims.begin() + begin, prims.begin() + end,
+				[&](const BuildPrim &p){
+					return bin_index(p) <= best_split;
+				});
+			mid = it - prims.begin();
+		}
+
+		node->axis = axis;
+		// Build large subtrees on another thread, if we're not already using
+		// a thread per core
+		if (n > PARALLEL_THRESHOLD && threads.fetch_add(1) < max_threads){
+			std::thread left_builder([&](){
+				node->children[0] = build(begin, mid, depth + 1, child_bounds[0], child_centroids[0]);
+			});
+			node->children[1] = build(mid, end, depth + 1, child_bounds[1], child_centroids[1]);
+			left_builder.join();
+			--threads;
+		}
+		else {
+			if (n > PARALLEL_THRESHOLD){
+				--threads;
+			}
+			node->children[0] = build(begin, mid, depth + 1, child_bounds[0], child_centroids[0]);
+			node->children[1] = build(mid, end, depth + 1, child_bounds[1], child_centroids[1]);
+		}
+		return node;
+	}
+	void make_leaf(BuildNode &node, uint32_t begin, uint32_t end){
+		node.first = begin;
+		node.count = end - begin;
+	}
+};
+
+/*
+ * Flatten the build tree into the node array in depth first order
+ */
+static uint32_t flatten(const BuildNode &node, std::vector<BVHNode> &nodes){
+	const uint32_t index = nodes.size();
+	nodes.push_back(BVHNode{});
+	BVHNode &flat = nodes.back();
+	for (int i = 0; i < 3; ++i){
+		flat.min[i] = node.bounds.min[i];
+		flat.max[i] = node.bounds.max[i];
+	}
+	flat.axis = node.axis;
+	flat.pad = 0;
+	if (node.count != 0){
+		flat.offset = node.first;
+		flat.count = node.count;
+	}
+	else {
+		flat.count = 0;
+		flatten(*node.children[0], nodes);
+		const uint32_t second = flatten(*node.children[1], nodes);
+		// The reference may have been invalidated by the vector growing
+		nodes[index].offset = second;
+	}
+	return index;
+}
+
+BVH::BVH(){}
+BVH::BVH(const std::vector<BBox> &bounds, uint32_t max_leaf){
+	if (bounds.empty()){
+		return;
+	}
+	std::vector<BuildPrim> prims(bounds.size());
+	for (size_t i = 0; i < bounds.size(); ++i){
+		prims[i].bounds = bounds[i];
+		prims[i].centroid = bounds[i].centroid();
+		prims[i].index = i;
+	}
+	Builder builder{prims, std::min(std::max(max_leaf, 1u), uint32_t{0xffff})};
+	BBox root_bounds, root_centroids;
+	builder.compute_bounds(0, prims.size(), root_bounds, root_centroids);
+	auto root = builder.build(0, prims.size(), 0, root_bounds, root_centroids);
+	node_store.reserve(builder.total_nodes);
+	flatten(*root, node_store);
+	index_store.resize(prims.size());
+	for (size_t i = 0; i < prims.size(); ++i){
+		index_store[i] = prims[i].index;
+	}
+	nodes = node_store;
+	indices = index_store;
+}
+BVH::BVH(ArrayView<BVHNode> nodes, ArrayView<uint32_t> indices) : nodes(nodes), indices(indices){}
+void BVH::renumber_primitives(){
+	index_store.resize(indices.size());
+	for (size_t i = 0; i < index_store.size(); ++i){
+		index_store[i] = i;
+	}
+	indices = index_store;
+}
+ArrayView<uint32_t> BVH::get_indices() const {
+	return indices;
+}
+ArrayView<BVHNode> BVH::get_nodes() const {
+	return nodes;
+}
+BBox BVH::bounds() const {
+	if (nodes.empty()){
+		return BBox{};
+	}
+	return BBox{Vec3f{nodes[0].min[0], nodes[0].min[1], nodes[0].min[2]},
+		Vec3f{nodes[0].max[0], nodes[0].max[1], nodes[0].max[2]}};
+}
+
@@ -0,0 +1,22 @@
+#include "compact.h"
+
+static constexpr CompactTable build_compact_table(){
+	CompactTable table{};
+	for (int mask = 0; mask < 256; ++mask){
+		int n = 0;
+		for (int i = 0; i < 8; ++i){
+			if (mask & (1 << i)){
+				table.perm[mask][n++] = i;
+			}
+		}
+		// Fill the rest with the remaining lanes, these are junk to the caller
+		for (int i = 0; i < 8; ++i){
+			if (!(mask & (1 << i))){
+				table.perm[mask][n++] = i;
+			}
+		}
+	}
+	return table;
+}
+alignas(32) const CompactTable COMPACT_TABLE = build_compact_table();
+
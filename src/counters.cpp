@@ -0,0 +1,95 @@
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#include "counters.h"
+
+thread_local PerfCounters thread_counters;
+
+static std::mutex totals_mutex;
+static PerfCounters totals;
+static CostMetric selected_metric = CostMetric::CYCLES;
+
+void merge_thread_counters(){
+	std::lock_guard<std::mutex> lock{totals_mutex};
+	for (int i = 0; i < static_cast<int>(Counter::COUNT); ++i){
+		totals.values[i] += thread_counters.values[i];
+		thread_counters.values[i] = 0;
+	}
+}
+PerfCounters total_counters(){
+	std::lock_guard<std::mutex> lock{totals_mutex};
+	return totals;
+}
+void reset_total_counters(){
+	std::lock_guard<std::mutex> lock{totals_mutex};
+	totals = PerfCounters{};
+}
+const char* counter_name(Counter c){
+	switch (c){
+		case Counter::RAY_PACKETS: return "ray_packets";
+		case Counter::RAY_SLOTS: return "ray_slots";
+		case Counter::RAY_LANES: return "ray_lanes";
+		case Counter::RAY_HITS: return "ray_hits";
+		case Counter::SHADOW_PACKETS: return "shadow_packets";
+		case Counter::SHADOW_SLOTS: return "shadow_slots";
+		case Counter::SHADOW_RAYS: return "shadow_rays";
+		case Counter::SHADOW_BLOCKED: return "shadow_blocked";
+		case Counter::SHADOW_CULLED: return "shadow_culled";
+		case Counter::BVH_NODE_TESTS: return "bvh_node_tests";
+		case Counter::PRIMITIVE_TESTS: return "primitive_tests";
+		case Counter::SHADE_PACKETS: return "shade_packets";
+		case Counter::SHADE_LANES: return "shade_lanes";
+		default: return "unknown";
+	}
+}
+bool save_counters_json(const std::string &file, const PerfCounters &counters){
+	std::ofstream out{file};
+	if (!out){
+		std::cerr << "save_counters_json Error: failed to open " << file << "\n";
+		return false;
+	}
+	// Ratio of the counts, 0 if nothing was counted
+	auto ratio = [&](double a, double b){
+		return b > 0 ? a / b : 0.0;
+	};
+	const double packets = static_cast<double>(counters[Counter::RAY_PACKETS] + counters[Counter::SHADOW_PACKETS]);
+	out << "{\n\t\"counters\": {\n";
+	for (int i = 0; i < static_cast<int>(Counter::COUNT); ++i){
+		const auto c = static_cast<Counter>(i);
+		out << "\t\t\"" << counter_name(c) << "\": " << counters[c]
+			<< (i + 1 < static_cast<int>(Counter::COUNT) ? ",\n" : "\n");
+	}
+	out << "\t},\n\t\"derived\": {\n"
+		<< "\t\t\"ray_lane_occupancy\": " << ratio(counters[Counter::RAY_LANES], counters[Counter::RAY_SLOTS])
+		<< ",\n\t\t\"ray_hit_rate\": " << ratio(counters[Counter::RAY_HITS], counters[Counter::RAY_LANES])
+		<< ",\n\t\t\"shadow_lane_occupancy\": "
+		<< ratio(counters[Counter::SHADOW_RAYS], counters[Counter::SHADOW_SLOTS])
+		<< ",\n\t\t\"shadow_blocked_rate\": " << ratio(counters[Counter::SHADOW_BLOCKED], counters[Counter::SHADOW_RAYS])
+		<< ",\n\t\t\"shadow_culled_rate\": " << ratio(counters[Counter::SHADOW_CULLED],
+				counters[Counter::SHADOW_CULLED] + counters[Counter::SHADOW_RAYS])
+		<< ",\n\t\t\"bvh_node_tests_per_packet\": " << ratio(counters[Counter::BVH_NODE_TESTS], packets)
+		<< ",\n\t\t\"primitive_tests_per_packet\": " << ratio(counters[Counter::PRIMITIVE_TESTS], packets)
+		<< ",\n\t\t\"shade_lane_occupancy\": "
+		<< ratio(counters[Counter::SHADE_LANES], 8.0 * counters[Counter::SHADE_PACKETS])
+		<< "\n\t}\n}\n";
+	return static_cast<bool>(out);
+}
+bool set_cost_metric(CostMetric metric){
+	if (metric == CostMetric::TESTS && !COUNTERS_ENABLED){
+		return false;
+	}
+	selected_metric = metric;
+	return true;
+}
+uint64_t cost_timestamp(){
+	if (selected_metric == CostMetric::TESTS){
+		return thread_counters[Counter::BVH_NODE_TESTS] + thread_counters[Counter::PRIMITIVE_TESTS];
+	}
+	return __rdtsc();
+}
+
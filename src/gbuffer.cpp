@@ -0,0 +1,374 @@
+#include <algorithm>
+#include "compact.h"
+#include "render_target.h"
+#include "scene.h"
+#include "rng.h"
+#include "occlusion_tester.h"
+#include "counters.h"
+#include "kernels.h"
+#include "gbuffer.h"
+
+// Number of primary rays queued before tracing them, enough to fill a few packets
+// of the widest tier while keeping the rays and their hits in the L1 cache
+static const uint32_t PRIMARY_CHUNK = 4 * KERNEL_PAD;
+
+HitRecords::HitRecords() : count(0){}
+void HitRecords::append(const Vec3f_8 &p, const Vec3f_8 &n, const Vec3f_8 &d, const Colorf_8 &t,
+		__m256i sample_id, int mask)
+{
+	reserve(count + 8);
+	compress_store(&px[count], p.x, mask);
+	compress_store(&py[count], p.y, mask);
+	compress_store(&pz[count], p.z, mask);
+	compress_store(&nx[count], n.x, mask);
+	compress_store(&ny[count], n.y, mask);
+	compress_store(&nz[count], n.z, mask);
+	compress_store(&dx[count], d.x, mask);
+	compress_store(&dy[count], d.y, mask);
+	compress_store(&dz[count], d.z, mask);
+	compress_store(&tr[count], t.r, mask);
+	compress_store(&tg[count], t.g, mask);
+	compress_store(&tb[count], t.b, mask);
+	count += compress_store(&sample[count], sample_id, mask);
+}
+void HitRecords::clear(){
+	count = 0;
+}
+__m256 HitRecords::load(uint32_t i, Vec3f_8 &p, Vec3f_8 &n, Vec3f_8 &d, Colorf_8 &t, __m256i &sample_id) const {
+	// The buffers are padded out to a multiple of 8 so we can always load a full packet
+	p = Vec3f_8{_mm256_load_ps(&px[i]), _mm256_load_ps(&py[i]), _mm256_load_ps(&pz[i])};
+	n = Vec3f_8{_mm256_load_ps(&nx[i]), _mm256_load_ps(&ny[i]), _mm256_load_ps(&nz[i])};
+	d = Vec3f_8{_mm256_load_ps(&dx[i]), _mm256_load_ps(&dy[i]), _mm256_load_ps(&dz[i])};
+	t = Colorf_8{_mm256_load_ps(&tr[i]), _mm256_load_ps(&tg[i]), _mm256_load_ps(&tb[i])};
+	sample_id = _mm256_load_si256((const __m256i*)&sample[i]);
+	const auto lane = _mm256_add_epi32(_mm256_set1_epi32(i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(count), lane));
+}
+void HitRecords::reserve(uint32_t n){
+	// Keep the size a multiple of 8 so load can read whole packets
+	n = (n + 7) & ~7u;
+	if (px.size() >= n){
+		return;
+	}
+	n = std::max(n, static_cast<uint32_t>(2 * px.size()));
+	for (auto *v : {&px, &py, &pz, &nx, &ny, &nz, &dx, &dy, &dz, &tr, &tg, &tb}){
+		v->resize(n);
+	}
+	sample.resize(n);
+}
+
+GBuffer::BlockSamples::BlockSamples() : count(0){}
+__m256i GBuffer::BlockSamples::add(const Vec2f_8 &s, __m256 mask){
+	if (sx.size() < count + 8){
+		const size_t n = std::max(size_t{count + 8}, 2 * sx.size());
+		for (auto *v : {&sx, &sy, &r, &g, &b, &active}){
+			v->resize(n);
+		}
+	}
+	const auto zero = _mm256_setzero_ps();
+	_mm256_store_ps(&sx[count], s.x);
+	_mm256_store_ps(&sy[count], s.y);
+	_mm256_store_ps(&r[count], zero);
+	_mm256_store_ps(&g[count], zero);
+	_mm256_store_ps(&b[count], zero);
+	_mm256_store_ps(&active[count], mask);
+	const auto id = _mm256_add_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	count += 8;
+	return id;
+}
+void GBuffer::BlockSamples::add_light(__m256i id, const Colorf_8 &c, int mask){
+	// Different lanes can contribute to the same sample so we can't scatter these
+	CACHE_ALIGN int32_t ids[8];
+	_mm256_store_si256((__m256i*)ids, id);
+	const auto *cr = (const float*)&c.r;
+	const auto *cg = (const float*)&c.g;
+	const auto *cb = (const float*)&c.b;
+	for (; mask != 0; mask &= mask - 1){
+		const int i = _tzcnt_u32(mask);
+		r[ids[i]] += cr[i];
+		g[ids[i]] += cg[i];
+		b[ids[i]] += cb[i];
+	}
+}
+void GBuffer::BlockSamples::write(RenderTile &tile) const {
+	for (uint32_t i = 0; i < count; i += 8){
+		const auto s = Vec2f_8{_mm256_load_ps(&sx[i]), _mm256_load_ps(&sy[i])};
+		const auto c = Colorf_8{_mm256_load_ps(&r[i]), _mm256_load_ps(&g[i]), _mm256_load_ps(&b[i])};
+		tile.write_samples(s, c, _mm256_load_ps(&active[i]));
+	}
+}
+void GBuffer::BlockSamples::clear(){
+	count = 0;
+}
+
+GBuffer::RayPayload::RayPayload() : count(0){}
+int32_t GBuffer::RayPayload::append(const Colorf_8 &c, __m256i sample_id, int mask){
+	const int32_t first = count;
+	// Keep the size a multiple of 8 with room for a full packet past the end
+	const uint32_t n = (count + 15) & ~7u;
+	if (r.size() < n){
+		const uint32_t size = std::max(n, static_cast<uint32_t>(2 * r.size()));
+		for (auto *v : {&r, &g, &b}){
+			v->resize(size);
+		}
+		sample.resize(size);
+	}
+	compress_store(&r[count], c.r, mask);
+	compress_store(&g[count], c.g, mask);
+	compress_store(&b[count], c.b, mask);
+	count += compress_store(&sample[count], sample_id, mask);
+	return first;
+}
+void GBuffer::RayPayload::load(__m256i id, __m256 mask, Colorf_8 &c, __m256i &sample_id) const {
+	const auto zero = _mm256_setzero_ps();
+	c = Colorf_8{_mm256_mask_i32gather_ps(zero, r.data(), id, mask, 4),
+		_mm256_mask_i32gather_ps(zero, g.data(), id, mask, 4),
+		_mm256_mask_i32gather_ps(zero, b.data(), id, mask, 4)};
+	sample_id = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), sample.data(), id,
+			_mm256_castps_si256(mask), 4);
+}
+void GBuffer::RayPayload::clear(){
+	count = 0;
+}
+
+void GBuffer::BatchHits::reserve(uint32_t n){
+	n = (n + KERNEL_PAD - 1) & ~(KERNEL_PAD - 1);
+	if (px.size() >= n){
+		return;
+	}
+	n = std::max(n, static_cast<uint32_t>(2 * px.size()));
+	for (auto *v : {&px, &py, &pz, &nx, &ny, &nz}){
+		v->resize(n);
+	}
+	material_id.resize(n);
+	hit.resize(n);
+}
+HitArrays GBuffer::BatchHits::arrays(uint32_t first){
+	return HitArrays{&px[first], &py[first], &pz[first], &nx[first], &ny[first], &nz[first],
+		&material_id[first], &hit[first]};
+}
+__m256 GBuffer::BatchHits::load(uint32_t i, DiffGeom8 &dg) const {
+	dg.point = Vec3f_8{_mm256_load_ps(&px[i]), _mm256_load_ps(&py[i]), _mm256_load_ps(&pz[i])};
+	dg.normal = Vec3f_8{_mm256_load_ps(&nx[i]), _mm256_load_ps(&ny[i]), _mm256_load_ps(&nz[i])};
+	dg.material_id = _mm256_load_si256((const __m256i*)&material_id[i]);
+	return _mm256_castsi256_ps(_mm256_load_si256((const __m256i*)&hit[i]));
+}
+
+GBuffer::GBuffer(size_t n_materials, RayMode ray_mode, uint32_t max_depth)
+	: materials(n_materials), ray_mode(ray_mode), max_depth(max_depth), first_primary(0)
+{}
+void GBuffer::add(const Ray8 &packet, const DiffGeom8 &dg, const Vec2f_8 &s, __m256 hits){
+	const auto sample_id = samples.add(s, packet.active);
+	add_hits(packet, dg, Colorf_8{1}, sample_id, hits);
+}
+bool GBuffer::traces_batches(const Scene &scene) const {
+	// The AVX2 kernels trace the same 8 rays as Scene::intersect and occluded, so going
+	// through them would only add the copies in and out of the arrays
+	return ray_mode != RayMode::PACKETS && scene.batches_only() && kernels().width != 8;
+}
+void GBuffer::queue_primary(const Scene &scene, const Ray8 &packet, const Vec2f_8 &s, RenderTile &tile){
+	const auto sample_id = samples.add(s, packet.active);
+	if (primary_rays.size() == 0){
+		first_primary = _mm256_extract_epi32(sample_id, 0);
+	}
+	// The rays are kept in the order of their samples so their ids are the sample ids
+	primary_rays.append(packet, packet.active, first_primary + primary_rays.size());
+	// The cost AOV times each kernel call so it's kept to a single packet of the widest tier
+	if (primary_rays.size() == (tile.has_cost() ? KERNEL_PAD : PRIMARY_CHUNK)){
+		trace_primary(scene, tile);
+	}
+}
+void GBuffer::trace_primary(const Scene &scene, RenderTile &tile){
+	const uint32_t count = primary_rays.size();
+	if (count == 0){
+		return;
+	}
+	batch_hits.reserve(count);
+	const uint64_t cost_start = tile.has_cost() ? cost_timestamp() : 0;
+	kernels().intersect_batches(scene.batch_arrays(), primary_rays.arrays(0), batch_hits.arrays(0), count);
+	const uint64_t cost = tile.has_cost() ? cost_timestamp() - cost_start : 0;
+	uint32_t lanes = 0;
+	for (uint32_t i = 0; i < count; i += 8){
+		lanes += _mm_popcnt_u32(_mm256_movemask_ps(_mm256_load_ps(&samples.active[first_primary + i])));
+	}
+	for (uint32_t i = 0; i < count; i += 8){
+		Ray8 packet;
+		__m256i sample_id;
+		primary_rays.load(i, packet, sample_id);
+		const uint32_t j = first_primary + i;
+		const auto s = Vec2f_8{_mm256_load_ps(&samples.sx[j]), _mm256_load_ps(&samples.sy[j])};
+		DiffGeom8 dg;
+		const auto hits = batch_hits.load(i, dg);
+		if (tile.has_aovs()){
+			tile.write_aovs(s, packet.t_max, dg, hits, scene.materials);
+		}
+		if (tile.has_cost() && lanes > 0){
+			tile.write_cost(s, static_cast<float>(cost) / lanes, _mm256_load_ps(&samples.active[j]));
+		}
+		add_hits(packet, dg, Colorf_8{1}, sample_id, hits);
+	}
+	primary_rays.clear();
+}
+void GBuffer::shade(const Scene &scene, RNG &rng, RenderTile &tile){
+	for (uint32_t depth = 0;; ++depth){
+		shade_hits(scene, rng, depth < max_depth);
+		if (bounce_rays.size() == 0){
+			break;
+		}
+		for (auto &m : materials){
+			m.clear();
+		}
+		if (ray_mode == RayMode::SORTED_STREAM){
+			bounce_rays.sort();
+		}
+		trace_bounce_rays(scene);
+	}
+	samples.write(tile);
+}
+void GBuffer::clear(){
+	for (auto &m : materials){
+		m.clear();
+	}
+	samples.clear();
+	primary_rays.clear();
+}
+const HitRecords& GBuffer::records(size_t material) const {
+	return materials[material];
+}
+void GBuffer::add_hits(const Ray8 &packet, const DiffGeom8 &dg, const Colorf_8 &throughput,
+		__m256i sample_id, __m256 hits)
+{
+	// Only keep hits with a material we know about
+	const auto valid_id = _mm256_and_si256(_mm256_cmpgt_epi32(dg.material_id, _mm256_set1_epi32(-1)),
+			_mm256_cmpgt_epi32(_mm256_set1_epi32(materials.size()), dg.material_id));
+	hits = _mm256_and_ps(hits, _mm256_castsi256_ps(valid_id));
+	int mask = _mm256_movemask_ps(hits);
+	if (mask == 0){
+		return;
+	}
+	CACHE_ALIGN int32_t ids[8];
+	_mm256_store_si256((__m256i*)ids, dg.material_id);
+	// Peel off the lanes with the same material as the first remaining lane
+	// until all the hits have been recorded
+	while (mask != 0){
+		const int id = ids[_tzcnt_u32(mask)];
+		const int same = mask & _mm256_movemask_ps(_mm256_castsi256_ps(
+					_mm256_cmpeq_epi32(dg.material_id, _mm256_set1_epi32(id))));
+		materials[id].append(dg.point, dg.normal, packet.d, throughput, sample_id, same);
+		mask &= ~same;
+	}
+}
+void GBuffer::shade_hits(const Scene &scene, RNG &rng, bool bounce){
+	const auto zero = _mm256_setzero_ps();
+	const bool stream = ray_mode != RayMode::PACKETS;
+	shadow_rays.clear();
+	shadow_payload.clear();
+	bounce_rays.clear();
+	bounce_payload.clear();
+	for (size_t m = 0; m < materials.size(); ++m){
+		const auto &records = materials[m];
+		const auto &material = *scene.materials[m];
+		if (material.is_specular() && !bounce){
+			continue;
+		}
+		for (uint32_t i = 0; i < records.count; i += 8){
+			Vec3f_8 p, n, d;
+			Colorf_8 t;
+			__m256i sample_id;
+			const auto valid = records.load(i, p, n, d, t, sample_id);
+			PERF_COUNT(SHADE_PACKETS, 1);
+			PERF_COUNT(SHADE_LANES, _mm_popcnt_u32(_mm256_movemask_ps(valid)));
+			if (material.is_specular()){
+				// Queue the reflected and transmitted rays for the next generation, lanes
+				// that don't carry any light are dropped
+				Vec3f_8 w_r, w_t;
+				Colorf_8 f_r, f_t;
+				const auto transmit = _mm256_and_ps(material.bounce(-d, n, w_r, f_r, w_t, f_t), valid);
+				const auto spawn = [&](const Vec3f_8 &w, const Colorf_8 &f, __m256 mask){
+					const auto c = t * f;
+					mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_max_ps(c.r, _mm256_max_ps(c.g, c.b)),
+								zero, _CMP_GT_OQ));
+					const int spawn_mask = _mm256_movemask_ps(mask);
+					if (spawn_mask != 0){
+						const auto id = bounce_payload.append(c, sample_id, spawn_mask);
+						bounce_rays.push(Ray8{p, w, 0.001f}, mask, id);
+					}
+				};
+				spawn(w_r, f_r, valid);
+				spawn(w_t, f_t, transmit);
+				continue;
+			}
+
+			Vec3f_8 w_i{0};
+			OcclusionTester occlusion;
+			const auto li = scene.lights.sample(p, rng, w_i, occlusion);
+			// Cull light samples on the back side of the surface before tracing
+			// shadow rays for them, they wouldn't contribute anything anyway
+			const auto cos_theta = w_i.dot(n);
+			auto lit = _mm256_and_ps(valid, _mm256_cmp_ps(cos_theta, zero, _CMP_GT_OQ));
+			PERF_COUNT(SHADOW_CULLED, _mm_popcnt_u32(_mm256_movemask_ps(_mm256_andnot_ps(lit, valid))));
+			if (_mm256_movemask_ps(lit) == 0){
+				continue;
+			}
+			const auto c = material.shade(-d, w_i) * li * t * cos_theta;
+			if (stream){
+				// Queue the shadow rays to be traced with the rest of the generation's
+				const auto id = shadow_payload.append(c, sample_id, _mm256_movemask_ps(lit));
+				shadow_rays.push(occlusion.rays, lit, id);
+				continue;
+			}
+			occlusion.rays.active = lit;
+			lit = _mm256_andnot_ps(occlusion.occluded(scene), lit);
+			samples.add_light(sample_id, c, _mm256_movemask_ps(lit));
+		}
+	}
+	if (stream){
+		trace_shadow_rays(scene);
+	}
+}
+void GBuffer::trace_shadow_rays(const Scene &scene){
+	if (shadow_rays.size() == 0){
+		return;
+	}
+	if (ray_mode == RayMode::SORTED_STREAM){
+		shadow_rays.sort();
+	}
+	const bool batched = traces_batches(scene);
+	if (batched){
+		blocked.resize(std::max(blocked.size(), static_cast<size_t>(shadow_rays.size() + KERNEL_PAD)));
+		kernels().occluded_batches(scene.batch_arrays(), shadow_rays.arrays(0), blocked.data(), shadow_rays.size());
+	}
+	for (uint32_t i = 0; i < shadow_rays.size(); i += 8){
+		Ray8 rays;
+		__m256i id;
+		shadow_rays.load(i, rays, id);
+		const auto valid = rays.active;
+		const auto occluded = batched ? _mm256_castsi256_ps(_mm256_load_si256((const __m256i*)&blocked[i]))
+			: scene.occluded(rays);
+		const auto unoccluded = _mm256_andnot_ps(occluded, valid);
+		Colorf_8 c;
+		__m256i sample_id;
+		shadow_payload.load(id, unoccluded, c, sample_id);
+		samples.add_light(sample_id, c, _mm256_movemask_ps(unoccluded));
+	}
+}
+void GBuffer::trace_bounce_rays(const Scene &scene){
+	const bool batched = traces_batches(scene);
+	if (batched){
+		batch_hits.reserve(bounce_rays.size());
+		kernels().intersect_batches(scene.batch_arrays(), bounce_rays.arrays(0), batch_hits.arrays(0),
+				bounce_rays.size());
+	}
+	for (uint32_t i = 0; i < bounce_rays.size(); i += 8){
+		Ray8 rays;
+		__m256i id;
+		bounce_rays.load(i, rays, id);
+		const auto valid = rays.active;
+		Colorf_8 throughput;
+		__m256i sample_id;
+		bounce_payload.load(id, valid, throughput, sample_id);
+		DiffGeom8 dg;
+		const auto hits = _mm256_and_ps(batched ? batch_hits.load(i, dg) : scene.intersect(rays, dg), valid);
+		add_hits(rays, dg, throughput, sample_id, hits);
+	}
+}
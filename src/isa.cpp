@@ -0,0 +1,104 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include "isa.h"
+
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]){
+#if defined(_MSC_VER)
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for (int i = 0; i < 4; ++i){
+		regs[i] = r[i];
+	}
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+// Read XCR0 to find which register states the OS saves on context switches
+static uint64_t xgetbv0(){
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+ISA detect_isa(){
+	uint32_t regs[4];
+	cpuid(0, 0, regs);
+	const uint32_t max_leaf = regs[0];
+	if (max_leaf < 7){
+		return ISA::NONE;
+	}
+	cpuid(1, 0, regs);
+	const uint32_t ecx1 = regs[2];
+	const bool fma = ecx1 & (1 << 12);
+	const bool popcnt = ecx1 & (1 << 23);
+	const bool osxsave = ecx1 & (1 << 27);
+	const bool avx = ecx1 & (1 << 28);
+	if (!osxsave || !avx || !fma || !popcnt){
+		return ISA::NONE;
+	}
+	// The OS has to save the XMM and YMM registers for us to use AVX
+	const uint64_t xcr0 = xgetbv0();
+	if ((xcr0 & 0x6) != 0x6){
+		return ISA::NONE;
+	}
+	cpuid(7, 0, regs);
+	const uint32_t ebx7 = regs[1];
+	const bool bmi1 = ebx7 & (1 << 3);
+	const bool avx2 = ebx7 & (1 << 5);
+	const bool avx512f = ebx7 & (1 << 16);
+	if (!avx2 || !bmi1){
+		return ISA::NONE;
+	}
+	// AVX-512 also needs the OS to save the opmask and upper ZMM registers
+	if (avx512f && (xcr0 & 0xe6) == 0xe6){
+		return ISA::AVX512;
+	}
+	return ISA::AVX2;
+}
+const char* isa_name(ISA isa){
+	switch (isa){
+		case ISA::AVX2: return "AVX2";
+		case ISA::AVX512: return "AVX-512";
+		default: return "none";
+	}
+}
+bool parse_isa(const char *name, ISA &isa){
+	if (std::strcmp(name, "avx2") == 0){
+		isa = ISA::AVX2;
+	}
+	else if (std::strcmp(name, "avx512") == 0){
+		isa = ISA::AVX512;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+std::string cpu_name(){
+	uint32_t regs[4];
+	cpuid(0x80000000, 0, regs);
+	if (regs[0] < 0x80000004){
+		return "unknown";
+	}
+	// The brand string is spread over the registers of 3 leaves, padded with spaces and nulls
+	char brand[49] = {0};
+	for (uint32_t i = 0; i < 3; ++i){
+		cpuid(0x80000002 + i, 0, regs);
+		std::memcpy(brand + 16 * i, regs, sizeof(regs));
+	}
+	std::string name{brand};
+	const size_t begin = name.find_first_not_of(' ');
+	const size_t end = name.find_last_not_of(' ');
+	return begin == std::string::npos ? "unknown" : name.substr(begin, end - begin + 1);
+}
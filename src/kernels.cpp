@@ -0,0 +1,56 @@
+#include <array>
+#include <cmath>
+#include "kernels.h"
+
+static ISA cpu_isa(){
+	static const ISA isa = detect_isa();
+	return isa;
+}
+static const Kernels* best_kernels(){
+	for (int i = static_cast<int>(cpu_isa()); i > static_cast<int>(ISA::AVX2); --i){
+		const Kernels *k = get_kernels(static_cast<ISA>(i));
+		if (k){
+			return k;
+		}
+	}
+	// Callers have checked for AVX2 before using the kernels
+	return avx2_kernels();
+}
+// Kernels picked with select_kernels, if any
+static const Kernels *selected = nullptr;
+
+const Kernels* get_kernels(ISA isa){
+	if (isa > cpu_isa()){
+		return nullptr;
+	}
+	switch (isa){
+		case ISA::AVX2: return avx2_kernels();
+		case ISA::AVX512: return avx512_kernels();
+		default: return nullptr;
+	}
+}
+const Kernels& kernels(){
+	static const Kernels *best = best_kernels();
+	return selected ? *selected : *best;
+}
+bool select_kernels(ISA isa){
+	const Kernels *k = get_kernels(isa);
+	if (!k){
+		return false;
+	}
+	selected = k;
+	return true;
+}
+
+const int32_t* srgb_table(){
+	static const auto table = [](){
+		std::array<int32_t, SRGB_TABLE_SIZE> t;
+		for (uint32_t i = 0; i < SRGB_TABLE_SIZE; ++i){
+			const float x = static_cast<float>(i) / (SRGB_TABLE_SIZE - 1);
+			const float s = x <= 0.0031308f ? 12.92f * x : 1.055f * std::pow(x, 1.f / 2.4f) - 0.055f;
+			t[i] = static_cast<int32_t>(std::round(255.f * s));
+		}
+		return t;
+	}();
+	return table.data();
+}
@@ -0,0 +1,8 @@
+#include "kernel_impl.h"
+
+// Built with AVX2 and FMA enabled
+const Kernels* avx2_kernels(){
+	static const Kernels table = make_kernels<AVX2>(ISA::AVX2);
+	return &table;
+}
+
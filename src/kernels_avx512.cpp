@@ -0,0 +1,12 @@
+#include "kernel_impl.h"
+
+// Built with AVX-512F enabled, if the compiler can't target it we don't have an AVX-512 tier
+const Kernels* avx512_kernels(){
+#ifdef __AVX512F__
+	static const Kernels table = make_kernels<AVX512>(ISA::AVX512);
+	return &table;
+#else
+	return nullptr;
+#endif
+}
+
@@ -1,12 +1,24 @@
 #include <iostream>
 #include <algorithm>
+#include "immintrin.h"
 #include "vec.h"
 #include "ld_sampler.h"
 
-static void sample2d(int n, uint32_t x, uint32_t y, float *s0, float *s1, int offset = 0);
-static void sample02(uint32_t n, const uint32_t x, const uint32_t y, float *s0, float *s1);
-static float van_der_corput(uint32_t n, uint32_t scramble);
-static float sobol2(uint32_t n, uint32_t scramble);
+/*
+ * Get the generator matrix column for bit b of the sample index in the first
+ * (van der Corput) and second (Sobol) dimensions of the (0, 2) sequence
+ */
+static uint32_t column_x(uint32_t b);
+static uint32_t column_y(uint32_t b);
+/*
+ * Compute the (0, 2) sequence value for index n in the dimension whose
+ * generator matrix columns are given by column
+ */
+static uint32_t generate(uint32_t n, uint32_t (*column)(uint32_t));
+/*
+ * Hash the pixel position to get its scramble for the dimension
+ */
+static uint32_t pixel_scramble(const std::pair<uint32_t, uint32_t> &pixel, uint32_t dim);
 /*
  * Round x up to the nearest power of 2
  * Based off Stephan Brumme's method
@@ -16,7 +28,8 @@ static inline uint32_t round_up_pow2(uint32_t x);
 
 // We set start's y coord so that we'll report we don't have any samples until a block is selected
 LDSampler::LDSampler(uint32_t sp, uint32_t block_dim) : spp(std::max(round_up_pow2(sp), uint32_t{8})),
-	block_dim(block_dim), samples_taken(0), start({0, block_dim}), current({0, 0})
+	block_dim(block_dim), pass_begin(0), pass_end(spp), samples_taken(0), base_x(0), base_y(0), start({0, block_dim}), current({0, 0}),
+	active(nullptr), img_width(0)
 {
 	if (sp < 8){
 		std::cout << "Warning: LDSampler only supports taking 8 or more samples per pixel,"
@@ -26,75 +39,110 @@ LDSampler::LDSampler(uint32_t sp, uint32_t block_dim) : spp(std::max(round_up_po
 		std::cout << "Warning: LDSampler only takes power of 2 samples per pixel, rounded up to"
 			<< " take " << spp << "spp\n";
 	}
+	for (uint32_t i = 0; i < 16; ++i){
+		lane_x[i] = static_cast<int32_t>(generate(i, column_x));
+		lane_y[i] = static_cast<int32_t>(generate(i, column_y));
+	}
 }
 void LDSampler::select_block(const std::pair<uint32_t, uint32_t> &b){
 	start = b;
 	current = b;
-	samples_taken = 0;
+	samples_taken = pass_begin;
+	skip_inactive();
+}
+void LDSampler::set_active_pixels(const uint8_t *a, uint32_t w){
+	active = a;
+	img_width = w;
+}
+void LDSampler::set_pass(uint32_t first, uint32_t n){
+	pass_begin = first;
+	pass_end = first + n;
+	samples_taken = pass_begin;
 }
 bool LDSampler::has_samples() const {
 	return current.second != start.second + block_dim;
 }
-__m256 LDSampler::sample(std::mt19937 &rng, Vec2f_8 &samples){
+uint32_t LDSampler::next_packet(uint32_t width, uint32_t &x, uint32_t &y,
+		std::pair<uint32_t, uint32_t> &pixel)
+{
 	if (!has_samples()){
-		return _mm256_set1_ps(0.f);
+		return 0;
 	}
-	CACHE_ALIGN float x[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
-	CACHE_ALIGN float y[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
-
-	// Take at most 8 samples per sampling pass since that's how many we can
-	// fit into a packet
-	int n = spp - samples_taken;
-	if (n > 8){
-		n = 8;
+	// Packet p holds the indices starting at gray(p) * width, so the packets
+	// are visited in Gray code order
+	const uint32_t packet = samples_taken / width;
+	if (samples_taken == pass_begin){
+		const uint32_t first = ((packet ^ (packet >> 1)) * width) | (samples_taken % width);
+		base_x = pixel_scramble(current, 0) ^ generate(first, column_x);
+		base_y = pixel_scramble(current, 1) ^ generate(first, column_y);
 	}
-	sample2d(n, distrib(rng), distrib(rng), x, y, samples_taken);
-	std::shuffle(x, x + n, rng);
-	std::shuffle(y, y + n, rng);
-	samples.x = _mm256_load_ps(x);
-	samples.y = _mm256_load_ps(y);
-	// We use -1 to signal that there is no sample to be taken for the lane, so
-	// compute mask of those samples which shouldn't be used
-	const auto active = _mm256_cmp_ps(samples.x, _mm256_set1_ps(-0.5f), _CMP_GT_OQ);
-	samples += Vec2f_8{static_cast<float>(current.first), static_cast<float>(current.second)};
+	// Take at most a packet's worth of samples per sampling pass since that's
+	// how many we can fit into a packet
+	const uint32_t n = std::min(pass_end - samples_taken, width);
+	x = base_x;
+	y = base_y;
+	pixel = current;
 
 	samples_taken += n;
 	// We're done sampling this pixel, move to the next one
-	if (samples_taken >= spp){
-		samples_taken = 0;
+	if (samples_taken >= pass_end){
+		samples_taken = pass_begin;
 		++current.first;
 		if (current.first == start.first + block_dim){
 			current.first = start.first;
 			++current.second;
 		}
+		skip_inactive();
+	}
+	else {
+		// The next packet's start differs from this one's only in the bit
+		// for the lowest set bit of the next packet's index
+		const uint32_t bit = _tzcnt_u32(packet + 1) + _tzcnt_u32(width);
+		base_x ^= column_x(bit);
+		base_y ^= column_y(bit);
 	}
-	return active;
+	return n;
 }
-void sample2d(int n, uint32_t x, uint32_t y, float *s0, float *s1, int offset){
-	for (int i = 0; i < n; ++i){
-		sample02(i + offset, x, y, s0 + i, s1 + i);
+void LDSampler::skip_inactive(){
+	if (!active){
+		return;
+	}
+	while (has_samples() && !active[current.second * img_width + current.first]){
+		++current.first;
+		if (current.first == start.first + block_dim){
+			current.first = start.first;
+			++current.second;
+		}
 	}
 }
-void sample02(uint32_t n, const uint32_t x, const uint32_t y, float *s0, float *s1){
-	*s0 = van_der_corput(n, x);
-	*s1 = sobol2(n, y);
+uint32_t column_x(uint32_t b){
+	return uint32_t{1} << (31 - b);
 }
-float van_der_corput(uint32_t n, uint32_t scramble){
-	n = (n << 16) | (n >> 16);
-	n = ((n & 0x00ff00ff) << 8) | ((n & 0xff00ff00) >> 8);
-	n = ((n & 0x0f0f0f0f) << 4) | ((n & 0xf0f0f0f0) >> 4);
-	n = ((n & 0x33333333) << 2) | ((n & 0xcccccccc) >> 2);
-	n = ((n & 0x55555555) << 1) | ((n & 0xaaaaaaaa) >> 1);
-	n ^= scramble;
-	return ((n >> 8) & 0xffffff) / float{1 << 24};
+uint32_t column_y(uint32_t b){
+	uint32_t c = uint32_t{1} << 31;
+	for (uint32_t i = 0; i < b; ++i){
+		c ^= c >> 1;
+	}
+	return c;
 }
-float sobol2(uint32_t n, uint32_t scramble){
-	for (uint32_t i = uint32_t{1} << 31; n != 0; n >>= 1, i ^= i >> 1){
+uint32_t generate(uint32_t n, uint32_t (*column)(uint32_t)){
+	uint32_t v = 0;
+	for (uint32_t b = 0; n != 0; n >>= 1, ++b){
 		if (n & 0x1){
-			scramble ^= i;
+			v ^= column(b);
 		}
 	}
-	return ((scramble >> 8) & 0xffffff) / float{1 << 24};
+	return v;
+}
+uint32_t pixel_scramble(const std::pair<uint32_t, uint32_t> &pixel, uint32_t dim){
+	// Murmur3's finalizer over the packed position
+	uint32_t h = (pixel.first * 0x9e3779b1u) ^ (pixel.second * 0x85ebca77u) ^ (dim * 0xc2b2ae3du);
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
 }
 inline uint32_t round_up_pow2(uint32_t x){
 	x--;
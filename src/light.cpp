@@ -1,12 +1,238 @@
+#include <algorithm>
 #include "light.h"
+#include "rng.h"
 #include "occlusion_tester.h"
 
-PointLight::PointLight(Vec3f pos, Colorf intensity) : pos(pos), intensity(intensity){}
-Colorf_8 PointLight::sample(const Vec3f_8 &p, Vec3f_8 &w_i, OcclusionTester &occlusion) const {
-	occlusion.set_points(p, pos);
-	w_i = (pos - p);
+Light Light::point(const Vec3f &pos, const Colorf &intensity){
+	return Light{LightType::POINT, pos, Vec3f{0}, Vec3f{0}, 0, intensity};
+}
+Light Light::sphere(const Vec3f &center, float radius, const Colorf &radiance){
+	return Light{LightType::SPHERE, center, Vec3f{0}, Vec3f{0}, radius, radiance};
+}
+Light Light::quad(const Vec3f &corner, const Vec3f &u, const Vec3f &v, const Colorf &radiance){
+	return Light{LightType::QUAD, corner, u, v, 0, radiance};
+}
+float Light::power() const {
+	const float lum = emission.luminance();
+	switch (type){
+		case LightType::POINT:
+			return lum * static_cast<float>(4 * M_PI);
+		case LightType::SPHERE:
+			return lum * static_cast<float>(4 * M_PI * M_PI) * radius * radius;
+		case LightType::QUAD:
+			return lum * static_cast<float>(M_PI) * u.cross(v).length();
+	}
+	return 0;
+}
+BBox Light::bounds() const {
+	BBox b;
+	switch (type){
+		case LightType::POINT:
+			b.extend(pos);
+			break;
+		case LightType::SPHERE:
+			b.extend(pos - Vec3f{radius, radius, radius});
+			b.extend(pos + Vec3f{radius, radius, radius});
+			break;
+		case LightType::QUAD:
+			b.extend(pos);
+			b.extend(pos + u);
+			b.extend(pos + v);
+			b.extend(pos + u + v);
+			break;
+	}
+	return b;
+}
+
+LightTree::LightTree(const std::vector<Light> &lights) : has_area(false){
+	for (const auto &l : lights){
+		x.push_back(l.pos.x);
+		y.push_back(l.pos.y);
+		z.push_back(l.pos.z);
+		ux.push_back(l.u.x);
+		uy.push_back(l.u.y);
+		uz.push_back(l.u.z);
+		vx.push_back(l.v.x);
+		vy.push_back(l.v.y);
+		vz.push_back(l.v.z);
+		radius.push_back(l.radius);
+		r.push_back(l.emission.r);
+		g.push_back(l.emission.g);
+		b.push_back(l.emission.b);
+		type.push_back(static_cast<int32_t>(l.type));
+		has_area = has_area || l.type != LightType::POINT;
+	}
+	if (lights.empty()){
+		return;
+	}
+	// A binary tree with a light in each leaf has 2n - 1 nodes
+	const size_t n_nodes = 2 * lights.size() - 1;
+	node_x.resize(n_nodes);
+	node_y.resize(n_nodes);
+	node_z.resize(n_nodes);
+	node_radius.resize(n_nodes);
+	node_power.resize(n_nodes);
+	child.resize(n_nodes);
+	light.resize(n_nodes);
+	std::vector<uint32_t> indices(lights.size());
+	for (uint32_t i = 0; i < indices.size(); ++i){
+		indices[i] = i;
+	}
+	// Node 0 is the root and the next free node is 1
+	uint32_t next_free = 1;
+	build(indices, 0, indices.size(), 0, next_free, lights);
+}
+Colorf_8 LightTree::sample(const Vec3f_8 &p, RNG &rng, Vec3f_8 &w_i, OcclusionTester &occlusion) const {
+	const auto zero = _mm256_setzero_ps();
+	const auto one = _mm256_set1_ps(1.f);
+	if (light.empty()){
+		occlusion.set_points(p, p + Vec3f_8{Vec3f{0, 1, 0}});
+		occlusion.rays.active = zero;
+		w_i = Vec3f_8{Vec3f{0, 1, 0}};
+		return Colorf_8{0};
+	}
+	// Walk down the tree picking a child at each interior node, the random number used
+	// to pick is rescaled to [0, 1) within the chosen child's range so it can be reused
+	auto node = _mm256_setzero_si256();
+	auto pdf = one;
+	auto interior = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_i32gather_epi32(child.data(), node, 4),
+				_mm256_set1_epi32(-1)));
+	if (_mm256_movemask_ps(interior) != 0){
+		auto u = rng.next_float<AVX2>();
+		do {
+			const auto left = _mm256_i32gather_epi32(child.data(), node, 4);
+			const auto right = _mm256_add_epi32(left, _mm256_set1_epi32(1));
+			const auto imp_left = importance(left, p);
+			const auto imp_right = importance(right, p);
+			const auto total = _mm256_add_ps(imp_left, imp_right);
+			const auto p_left = _mm256_blendv_ps(_mm256_set1_ps(0.5f), _mm256_div_ps(imp_left, total),
+					_mm256_cmp_ps(total, zero, _CMP_GT_OQ));
+			const auto go_left = _mm256_cmp_ps(u, p_left, _CMP_LT_OQ);
+			const auto p_child = _mm256_blendv_ps(_mm256_sub_ps(one, p_left), p_left, go_left);
+			u = _mm256_blendv_ps(_mm256_div_ps(_mm256_sub_ps(u, p_left), p_child),
+					_mm256_div_ps(u, p_child), go_left);
+			u = _mm256_min_ps(u, _mm256_set1_ps(0x1.fffffep-1f));
+			pdf = _mm256_blendv_ps(pdf, _mm256_mul_ps(pdf, p_child), interior);
+			const auto next = _mm256_blendv_ps(_mm256_castsi256_ps(right), _mm256_castsi256_ps(left), go_left);
+			node = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(node), next, interior));
+			interior = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_i32gather_epi32(child.data(), node, 4),
+						_mm256_set1_epi32(-1)));
+		}
+		while (_mm256_movemask_ps(interior) != 0);
+	}
+
+	const auto id = _mm256_i32gather_epi32(light.data(), node, 4);
+	const auto pos = Vec3f_8{_mm256_i32gather_ps(x.data(), id, 4), _mm256_i32gather_ps(y.data(), id, 4),
+		_mm256_i32gather_ps(z.data(), id, 4)};
+	const auto emission = Colorf_8{_mm256_i32gather_ps(r.data(), id, 4), _mm256_i32gather_ps(g.data(), id, 4),
+		_mm256_i32gather_ps(b.data(), id, 4)};
+	// Point on the light and the light's normal and area there, point lights
+	// are treated as having an area of 1 facing the shading point
+	auto y_light = pos;
+	auto n_light = Vec3f_8{0};
+	auto area = one;
+	auto is_area = zero;
+	if (has_area){
+		const auto light_type = _mm256_i32gather_epi32(type.data(), id, 4);
+		const auto sphere = _mm256_castsi256_ps(_mm256_cmpeq_epi32(light_type,
+					_mm256_set1_epi32(static_cast<int32_t>(LightType::SPHERE))));
+		const auto quad = _mm256_castsi256_ps(_mm256_cmpeq_epi32(light_type,
+					_mm256_set1_epi32(static_cast<int32_t>(LightType::QUAD))));
+		is_area = _mm256_or_ps(sphere, quad);
+		const auto u0 = rng.next_float<AVX2>();
+		const auto u1 = rng.next_float<AVX2>();
+
+		// Uniformly sample a point on the sphere's surface
+		const auto rad = _mm256_i32gather_ps(radius.data(), id, 4);
+		const auto cos_theta = _mm256_fnmadd_ps(_mm256_set1_ps(2.f), u0, one);
+		const auto sin_theta = _mm256_sqrt_ps(_mm256_max_ps(zero, _mm256_fnmadd_ps(cos_theta, cos_theta, one)));
+		__m256 sin_phi, cos_phi;
+		vsincos(_mm256_fmsub_ps(u1, _mm256_set1_ps(static_cast<float>(2 * M_PI)),
+					_mm256_set1_ps(static_cast<float>(M_PI))), sin_phi, cos_phi);
+		const auto sphere_n = Vec3f_8{_mm256_mul_ps(sin_theta, cos_phi), _mm256_mul_ps(sin_theta, sin_phi), cos_theta};
+		const auto sphere_area = _mm256_mul_ps(_mm256_set1_ps(static_cast<float>(4 * M_PI)), _mm256_mul_ps(rad, rad));
+
+		// Uniformly sample a point on the quad
+		const auto u = Vec3f_8{_mm256_i32gather_ps(ux.data(), id, 4), _mm256_i32gather_ps(uy.data(), id, 4),
+			_mm256_i32gather_ps(uz.data(), id, 4)};
+		const auto v = Vec3f_8{_mm256_i32gather_ps(vx.data(), id, 4), _mm256_i32gather_ps(vy.data(), id, 4),
+			_mm256_i32gather_ps(vz.data(), id, 4)};
+		auto quad_n = u.cross(v);
+		const auto quad_area = quad_n.length();
+		quad_n = Vec3f_8{_mm256_div_ps(quad_n.x, quad_area), _mm256_div_ps(quad_n.y, quad_area),
+			_mm256_div_ps(quad_n.z, quad_area)};
+
+		const auto sphere_y = pos + rad * sphere_n;
+		const auto quad_y = pos + u0 * u + u1 * v;
+		for (int i = 0; i < 3; ++i){
+			y_light[i] = _mm256_blendv_ps(_mm256_blendv_ps(y_light[i], quad_y[i], quad), sphere_y[i], sphere);
+			n_light[i] = _mm256_blendv_ps(_mm256_blendv_ps(n_light[i], quad_n[i], quad), sphere_n[i], sphere);
+		}
+		area = _mm256_blendv_ps(_mm256_blendv_ps(area, quad_area, quad), sphere_area, sphere);
+	}
+
+	occlusion.set_points(p, y_light);
+	w_i = y_light - p;
 	const auto dist_sqr = w_i.length_sqr();
 	w_i.normalize();
-	return Colorf_8{intensity} / dist_sqr;
+	// Area lights only emit from their front side, which has to face the shading point
+	const auto cos_light = _mm256_blendv_ps(one, _mm256_max_ps(zero, _mm256_sub_ps(zero, w_i.dot(n_light))), is_area);
+	const auto scale = _mm256_div_ps(_mm256_mul_ps(area, cos_light), _mm256_mul_ps(dist_sqr, pdf));
+	return emission * scale;
+}
+Light LightTree::get(size_t i) const {
+	return Light{static_cast<LightType>(type[i]), Vec3f{x[i], y[i], z[i]}, Vec3f{ux[i], uy[i], uz[i]},
+		Vec3f{vx[i], vy[i], vz[i]}, radius[i], Colorf{r[i], g[i], b[i]}};
+}
+size_t LightTree::size() const {
+	return x.size();
+}
+void LightTree::build(std::vector<uint32_t> &indices, uint32_t begin, uint32_t end, uint32_t n,
+		uint32_t &next_free, const std::vector<Light> &lights)
+{
+	BBox bounds, centroids;
+	float power = 0;
+	for (uint32_t i = begin; i < end; ++i){
+		const auto &l = lights[indices[i]];
+		const auto b = l.bounds();
+		bounds.extend(b);
+		centroids.extend(b.centroid());
+		power += l.power();
+	}
+	const auto center = bounds.centroid();
+	node_x[n] = center.x;
+	node_y[n] = center.y;
+	node_z[n] = center.z;
+	node_radius[n] = (bounds.max - center).length();
+	node_power[n] = power;
+	if (end - begin == 1){
+		child[n] = -1;
+		light[n] = indices[begin];
+		return;
+	}
+	// Split at the median along the axis the light centers are most spread out on,
+	// the children are allocated together after the nodes in use
+	const int axis = centroids.max_extent();
+	const uint32_t mid = begin + (end - begin) / 2;
+	std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+		[&](const uint32_t &a, const uint32_t &b){
+			return lights[a].bounds().centroid()[axis] < lights[b].bounds().centroid()[axis];
+		});
+	const uint32_t left = next_free;
+	next_free += 2;
+	child[n] = static_cast<int32_t>(left);
+	light[n] = -1;
+	build(indices, begin, mid, left, next_free, lights);
+	build(indices, mid, end, left + 1, next_free, lights);
+}
+__m256 LightTree::importance(__m256i node, const Vec3f_8 &p) const {
+	const auto center = Vec3f_8{_mm256_i32gather_ps(node_x.data(), node, 4),
+		_mm256_i32gather_ps(node_y.data(), node, 4), _mm256_i32gather_ps(node_z.data(), node, 4)};
+	const auto rad = _mm256_i32gather_ps(node_radius.data(), node, 4);
+	const auto power = _mm256_i32gather_ps(node_power.data(), node, 4);
+	// Clamp the distance to the node's radius so nodes containing the point aren't
+	// weighted arbitrarily high
+	const auto dist_sqr = _mm256_max_ps((center - p).length_sqr(), _mm256_mul_ps(rad, rad));
+	return _mm256_div_ps(power, _mm256_max_ps(dist_sqr, _mm256_set1_ps(1e-6f)));
 }
 
@@ -1,8 +1,13 @@
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <string>
 #include <algorithm>
-#include <random>
 #include <vector>
 #include <memory>
+#include <chrono>
+#include <cmath>
 #include "geometry.h"
 #include "immintrin.h"
 #include "vec.h"
@@ -10,8 +15,6 @@
 #include "color.h"
 #include "render_target.h"
 #include "camera.h"
-#include "sphere.h"
-#include "plane.h"
 #include "diff_geom.h"
 #include "material.h"
 #include "light.h"
@@ -19,90 +22,579 @@
 #include "block_queue.h"
 #include "ld_sampler.h"
 #include "scene.h"
+#include "scene_file.h"
+#include "test_scene.h"
+#include "thread_pool.h"
+#include "gbuffer.h"
+#include "path_tracer.h"
+#include "isa.h"
+#include "kernels.h"
+#include "counters.h"
+#include "autotune.h"
 
-void render(const Scene &scene, const PerspectiveCamera &camera, const Vec2f_8 img_dim, RenderTarget &target,
-			BlockQueue &block_queue){
-	std::random_device rand_device;
-	std::mt19937 rng(rand_device());
-	auto sampler = LDSampler{64, block_queue.get_block_dim()};
-	for (auto block = block_queue.next(); block != block_queue.end(); block = block_queue.next()){
+using Clock = std::chrono::steady_clock;
+
+/*
+ * A pass over the image, taking the samples [first_sample, first_sample + n_samples)
+ * in each pixel flagged in active, or every pixel if active is null. Workers stop
+ * taking new blocks once the deadline has passed
+ */
+struct RenderPass {
+	uint32_t index, first_sample, n_samples;
+	Clock::time_point deadline;
+	const uint8_t *active;
+};
+
+/*
+ * The light transport algorithm used to render the image: direct lighting
+ * with specular reflection and refraction, or full path tracing
+ */
+enum class Integrator {
+	WHITTED,
+	PATH
+};
+
+// Number of samples pixels need before adaptive sampling trusts their variance estimate
+const uint32_t MIN_ADAPTIVE_SPP = 16;
+
+/*
+ * Render blocks taken from the block queue until it runs dry or the pass's
+ * deadline passes, this is run by each worker thread in the pool. With the Whitted
+ * integrator the primary hits for a block are written to a G-buffer and shaded in
+ * batches per material once the block is traced, following up to max_depth specular
+ * bounces. If the G-buffer traces with the dispatched kernels the block's primary rays
+ * are queued and traced together at the kernels' width. The path tracer instead traces
+ * each path to completion, refilling lanes as paths terminate. Samples are accumulated
+ * in a per-thread tile which is flushed to the render target when the block is done,
+ * since blocks don't overlap the workers never write to the same pixels. Once the
+ * worker's own blocks are done the queue will steal more from the other workers.
+ * Target is either a RenderTarget or a StreamingTarget. The worker's counters are
+ * merged into the totals once it's done
+ */
+template<typename Target>
+void render(const Scene &scene, const PerspectiveCamera &camera, const Vec2f_8 img_dim, Target &target,
+			BlockQueue &block_queue, Integrator integrator, RayMode ray_mode, uint32_t max_depth,
+			const RenderPass &pass, uint32_t worker)
+{
+	RNG rng{(static_cast<uint64_t>(pass.index) << 32) | worker};
+	auto sampler = LDSampler{pass.n_samples, block_queue.get_block_dim()};
+	sampler.set_pass(pass.first_sample, pass.n_samples);
+	sampler.set_active_pixels(pass.active, target.get_width());
+	RenderTile tile{block_queue.get_block_dim(), target.get_aovs()};
+	GBuffer gbuffer{scene.materials.size(), ray_mode, max_depth};
+	PathTracer path_tracer{scene, camera, img_dim, max_depth};
+	const bool trace_batches = gbuffer.traces_batches(scene);
+	for (auto block = block_queue.next(worker); block != block_queue.end(); block = block_queue.next(worker)){
+		// Blocks we've taken are always finished so the pixels never have partial packets
+		if (Clock::now() > pass.deadline){
+			break;
+		}
 		sampler.select_block(block);
+		tile.reset(block);
+		if (integrator == Integrator::PATH){
+			path_tracer.render_block(sampler, rng, tile);
+			target.write_tile(tile);
+			continue;
+		}
+		gbuffer.clear();
 		while (sampler.has_samples()){
 			auto samples = Vec2f_8{0, 0};
 			Ray8 packet;
 			packet.active = sampler.sample(rng, samples);
 			camera.generate_rays(packet, samples / img_dim);
+			if (trace_batches){
+				gbuffer.queue_primary(scene, packet, samples, tile);
+				continue;
+			}
 
+			// Shading is batched over the whole block so only the primary rays' cost is known per sample
+			const uint64_t cost_start = tile.has_cost() ? cost_timestamp() : 0;
 			DiffGeom8 dg;
-			auto hits = scene.intersect(packet, dg);
-			// If we hit something, shade it, otherwise use the background color (black)
-			auto color = Colorf_8{0};
-			if (_mm256_movemask_ps(hits) != 0){
-				// How does ISPC find the unique values for its foreach_unique loop? Would like to do that
-				// if it will be nicer than this
-				std::array<int32_t, 8> mat_ids;
-				_mm256_storeu_si256((__m256i*)mat_ids.data(), dg.material_id);
-				// std::unique just removes consecutive repeated elements, so sort things first so we
-				// don't get something like -1, 0, -1 or such
-				std::sort(std::begin(mat_ids), std::end(mat_ids));
-				auto id_end = std::unique(std::begin(mat_ids), std::end(mat_ids));
-				for (auto it = std::begin(mat_ids); it != id_end; ++it){
-					if (*it == -1){
-						continue;
-					}
-					const auto use_mat = _mm256_cmpeq_epi32(dg.material_id, _mm256_set1_epi32(*it));
-					auto shade_mask = _mm256_castsi256_ps(use_mat);
-					if (_mm256_movemask_ps(shade_mask) != 0){
-						const auto w_o = -packet.d;
-						Vec3f_8 w_i{0};
-						// Setup occlusion tester and set active ray mask to just be those with
-						// corresponding to tests from hits with the material id being shaded
-						OcclusionTester occlusion;
-						const auto li = scene.light.sample(dg.point, w_i, occlusion);
-						occlusion.rays.active = shade_mask;
-						// We just need to flip the sign bit to change occluded mask to unoccluded mask since
-						// only the sign bit is used by movemask and blendv
-						auto unoccluded = _mm256_xor_ps(occlusion.occluded(scene), _mm256_set1_ps(-0.f));
-						if (_mm256_movemask_ps(unoccluded) != 0){
-							const auto c = scene.materials[*it]->shade(w_o, w_i) * li
-								* _mm256_max_ps(w_i.dot(dg.normal), _mm256_set1_ps(0.f));
-							shade_mask = _mm256_and_ps(shade_mask, unoccluded);
-							color.r = _mm256_blendv_ps(color.r, c.r, shade_mask);
-							color.g = _mm256_blendv_ps(color.g, c.g, shade_mask);
-							color.b = _mm256_blendv_ps(color.b, c.b, shade_mask);
-						}
-					}
-				}
+			const auto hits = _mm256_and_ps(scene.intersect(packet, dg), packet.active);
+			if (tile.has_aovs()){
+				tile.write_aovs(samples, packet.t_max, dg, hits, scene.materials);
+			}
+			if (tile.has_cost()){
+				tile.write_cost(samples, static_cast<float>(cost_timestamp() - cost_start)
+						/ _mm_popcnt_u32(_mm256_movemask_ps(packet.active)), packet.active);
 			}
-			target.write_samples(samples, color, packet.active);
+			// Hits are shaded once the whole block has been traced, samples that
+			// don't hit anything get the background color (black)
+			gbuffer.add(packet, dg, samples, hits);
 		}
+		if (trace_batches){
+			gbuffer.trace_primary(scene, tile);
+		}
+		gbuffer.shade(scene, rng, tile);
+		target.write_tile(tile);
+	}
+	if (COUNTERS_ENABLED){
+		merge_thread_counters();
+	}
+}
+
+bool parse_ray_mode(const char *arg, RayMode &mode){
+	if (std::strcmp(arg, "packets") == 0){
+		mode = RayMode::PACKETS;
+	}
+	else if (std::strcmp(arg, "stream") == 0){
+		mode = RayMode::STREAM;
+	}
+	else if (std::strcmp(arg, "sorted") == 0){
+		mode = RayMode::SORTED_STREAM;
 	}
+	else {
+		return false;
+	}
+	return true;
 }
 
-int main(int, char**){
-	const uint32_t width = 800;
-	const uint32_t height = 600;
-	const auto scene = Scene{
+bool parse_integrator(const char *arg, Integrator &integrator){
+	if (std::strcmp(arg, "whitted") == 0){
+		integrator = Integrator::WHITTED;
+	}
+	else if (std::strcmp(arg, "path") == 0){
+		integrator = Integrator::PATH;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Parse a comma separated list of AOV names and enable them in the layout
+ */
+bool parse_aovs(const char *arg, AOVLayout &aovs){
+	const std::string list{arg};
+	for (size_t begin = 0; begin <= list.size();){
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos){
+			end = list.size();
+		}
+		const auto name = list.substr(begin, end - begin);
+		bool found = false;
+		for (int i = 0; i < static_cast<int>(AOV::COUNT); ++i){
+			if (name == AOVLayout::name(static_cast<AOV>(i))){
+				aovs.enable(static_cast<AOV>(i));
+				found = true;
+			}
+		}
+		if (!found){
+			return false;
+		}
+		begin = end + 1;
+	}
+	return true;
+}
+
+bool parse_cost_metric(const char *arg, CostMetric &metric){
+	if (std::strcmp(arg, "cycles") == 0){
+		metric = CostMetric::CYCLES;
+	}
+	else if (std::strcmp(arg, "tests") == 0){
+		metric = CostMetric::TESTS;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+bool is_valid_spp(uint32_t spp){
+	return spp >= 8 && (spp & (spp - 1)) == 0;
+}
+
+bool parse_tonemap(const char *arg, Tonemap &tonemap){
+	if (std::strcmp(arg, "clamp") == 0){
+		tonemap = Tonemap::CLAMP;
+	}
+	else if (std::strcmp(arg, "reinhard") == 0){
+		tonemap = Tonemap::REINHARD;
+	}
+	else if (std::strcmp(arg, "aces") == 0){
+		tonemap = Tonemap::ACES;
+	}
+	else {
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char **argv){
+	// Everything but the dispatched kernels is AVX2 code
+	if (detect_isa() < ISA::AVX2){
+		std::cerr << "Error: micro_packet requires a CPU with AVX2 and FMA support\n";
+		return 1;
+	}
+	uint32_t n_threads = std::thread::hardware_concurrency();
+	bool threads_set = false;
+	uint32_t block_dim = 8;
+	// Pick the block size, block order and thread count with trial renders, unless
+	// they've already been tuned for this machine, scene and settings
+	bool autotune_settings = false;
+	bool retune = false;
+	std::string tune_cache = "micro_packet_tune.txt";
+	double tune_time = 0.5;
+	TestSceneOptions scene_options;
+	std::string scene_file;
+	uint32_t width = 800;
+	uint32_t height = 600;
+	// Image to stream the render to instead of keeping it in memory, if not empty
+	std::string stream_file;
+	AOVLayout aovs;
+	CostMetric cost_metric = CostMetric::CYCLES;
+	// JSON file to write the hot path counters to, if not empty
+	std::string counters_file;
+	RayMode ray_mode = RayMode::STREAM;
+	Integrator integrator = Integrator::WHITTED;
+	ISA isa;
+	ResolveParams resolve_params;
+	uint32_t spp = 64;
+	// Progressive rendering settings, by default all samples are taken in one pass
+	uint32_t pass_spp = 0;
+	double time_limit = 0;
+	bool snapshots = false;
+	// Error threshold for adaptive sampling, 0 if disabled
+	float adaptive = 0;
+	uint32_t max_depth = 5;
+	for (int i = 1; i < argc; ++i){
+		if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+			n_threads = std::strtoul(argv[++i], nullptr, 10);
+			threads_set = true;
+		}
+		else if (std::strcmp(argv[i], "--block-dim") == 0 && i + 1 < argc){
+			block_dim = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--autotune") == 0){
+			autotune_settings = true;
+		}
+		else if (std::strcmp(argv[i], "--retune") == 0){
+			autotune_settings = true;
+			retune = true;
+		}
+		else if (std::strcmp(argv[i], "--tune-cache") == 0 && i + 1 < argc){
+			tune_cache = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--tune-time") == 0 && i + 1 < argc){
+			tune_time = std::strtod(argv[++i], nullptr);
+		}
+		else if (std::strcmp(argv[i], "--spheres") == 0 && i + 1 < argc){
+			scene_options.n_spheres = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc){
+			scene_options.n_lights = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--obj") == 0 && i + 1 < argc){
+			scene_options.obj_file = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc){
+			scene_file = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--width") == 0 && i + 1 < argc){
+			width = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--height") == 0 && i + 1 < argc){
+			height = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--stream") == 0 && i + 1 < argc){
+			stream_file = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--aov") == 0 && i + 1 < argc && parse_aovs(argv[i + 1], aovs)){
+			++i;
+		}
+		else if (std::strcmp(argv[i], "--cost-metric") == 0 && i + 1 < argc
+				&& parse_cost_metric(argv[i + 1], cost_metric))
 		{
-			std::make_shared<Sphere>(Vec3f{0}, 0.5f, 0),
-			std::make_shared<Plane>(Vec3f{0, -0.5f, 0.5f}, Vec3f{0, 1, 0}, 1)
-		},
+			++i;
+		}
+		else if (std::strcmp(argv[i], "--counters") == 0 && i + 1 < argc){
+			counters_file = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--rays") == 0 && i + 1 < argc && parse_ray_mode(argv[i + 1], ray_mode)){
+			++i;
+		}
+		else if (std::strcmp(argv[i], "--integrator") == 0 && i + 1 < argc
+				&& parse_integrator(argv[i + 1], integrator))
 		{
-			std::make_shared<LambertianMaterial>(Colorf{1, 0, 0}),
-			std::make_shared<LambertianMaterial>(Colorf{0, 0, 1})
-		},
-		PointLight{Vec3f{1, 1, -2}, Colorf{50}}
-	};
-
-	const auto camera = PerspectiveCamera{Vec3f{0, 0, -3}, Vec3f{0, 0, 0}, Vec3f{0, 1, 0},
-		60.f, static_cast<float>(width) / height};
-	auto target = RenderTarget{width, height};
-	const auto img_dim = Vec2f_8{static_cast<float>(width), static_cast<float>(height)};
-	const uint32_t block_dim = 8;
-	auto block_queue = BlockQueue{block_dim, width, height};
+			++i;
+		}
+		else if (std::strcmp(argv[i], "--isa") == 0 && i + 1 < argc && parse_isa(argv[i + 1], isa)){
+			if (!select_kernels(isa)){
+				std::cerr << "Error: " << isa_name(isa) << " kernels aren't supported on this CPU\n";
+				return 1;
+			}
+			++i;
+		}
+		else if (std::strcmp(argv[i], "--exposure") == 0 && i + 1 < argc){
+			resolve_params.exposure = std::strtof(argv[++i], nullptr);
+		}
+		else if (std::strcmp(argv[i], "--tonemap") == 0 && i + 1 < argc
+				&& parse_tonemap(argv[i + 1], resolve_params.tonemap))
+		{
+			++i;
+		}
+		else if (std::strcmp(argv[i], "--spp") == 0 && i + 1 < argc){
+			spp = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--pass-spp") == 0 && i + 1 < argc){
+			pass_spp = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc){
+			time_limit = std::strtod(argv[++i], nullptr);
+		}
+		else if (std::strcmp(argv[i], "--snapshots") == 0){
+			snapshots = true;
+		}
+		else if (std::strcmp(argv[i], "--adaptive") == 0 && i + 1 < argc){
+			adaptive = std::strtof(argv[++i], nullptr);
+		}
+		else if (std::strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc){
+			max_depth = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--whitted") == 0){
+			scene_options.whitted = true;
+		}
+		else {
+			std::cout << "Usage: " << argv[0] << " [--threads N] [--block-dim N] [--autotune] [--retune]"
+				<< " [--tune-cache file] [--tune-time seconds] [--spheres N] [--lights N] [--obj file.obj]"
+				<< " [--scene file.mps] [--width N] [--height N] [--stream file.ppm|bmp]"
+				<< " [--aov depth,normal,albedo,material,cost] [--cost-metric cycles|tests] [--counters file.json]"
+				<< " [--rays packets|stream|sorted] [--integrator whitted|path] [--isa avx2|avx512]"
+				<< " [--exposure EV] [--tonemap clamp|reinhard|aces]"
+				<< " [--spp N] [--pass-spp N] [--time-limit seconds] [--snapshots]"
+				<< " [--adaptive threshold] [--max-depth N] [--whitted]\n";
+			return 1;
+		}
+	}
+	// A time limit or adaptive sampling need passes to stop or adapt between,
+	// default to a few samples per pass
+	if (pass_spp == 0){
+		pass_spp = time_limit > 0 || adaptive > 0 ? 8 : spp;
+	}
+	if (!is_valid_spp(spp) || !is_valid_spp(pass_spp) || pass_spp > spp){
+		std::cerr << "Error: --spp and --pass-spp must be powers of 2 of at least 8,"
+			<< " with --pass-spp no more than --spp\n";
+		return 1;
+	}
+	// Streamed bands are written out as soon as they're finished so they can only take one pass
+	if (!stream_file.empty() && (pass_spp != spp || time_limit > 0 || adaptive > 0 || snapshots)){
+		std::cerr << "Error: --stream renders in a single pass, it can't be used with --pass-spp,"
+			<< " --time-limit, --adaptive or --snapshots\n";
+		return 1;
+	}
+	if (!stream_file.empty() && aovs.size() != 0){
+		std::cerr << "Error: AOVs can't be streamed\n";
+		return 1;
+	}
+	// Trial renders are too big to hold in memory for the images worth streaming
+	if (!stream_file.empty() && autotune_settings){
+		std::cerr << "Error: --autotune can't be used with --stream\n";
+		return 1;
+	}
+	if (block_dim == 0 || tune_time <= 0){
+		std::cerr << "Error: --block-dim and --tune-time must be greater than 0\n";
+		return 1;
+	}
+	if (!counters_file.empty() && !COUNTERS_ENABLED){
+		std::cerr << "Error: --counters needs a build with the MICRO_PACKET_COUNTERS option on\n";
+		return 1;
+	}
+	if (!set_cost_metric(cost_metric)){
+		std::cerr << "Error: --cost-metric tests needs a build with the MICRO_PACKET_COUNTERS option on\n";
+		return 1;
+	}
+	if (width == 0 || height == 0){
+		std::cerr << "Error: --width and --height must be at least 1\n";
+		return 1;
+	}
+	SceneCamera scene_camera = test_scene_camera();
+	std::unique_ptr<Scene> scene;
+	if (!scene_file.empty()){
+		const auto load_start = Clock::now();
+		scene = load_scene_file(scene_file, scene_camera);
+		if (scene){
+			std::cout << "Loaded " << scene_file << " in "
+				<< std::chrono::duration<double, std::milli>(Clock::now() - load_start).count() << "ms\n";
+		}
+	}
+	else {
+		scene = make_test_scene(scene_options);
+	}
+	if (!scene){
+		return 1;
+	}
+	const bool kernel_width = integrator == Integrator::WHITTED && ray_mode != RayMode::PACKETS
+		&& scene->batches_only() && kernels().width != 8;
+	if (kernel_width){
+		std::cout << "Tracing " << kernels().width << " rays at once with the " << isa_name(kernels().isa)
+			<< " kernels\n";
+	}
+	else {
+		std::cout << "Tracing 8 rays at once with AVX2, the " << isa_name(kernels().isa)
+			<< " kernels are only used to resolve the image\n";
+	}
 
-	render(scene, camera, img_dim, target, block_queue);
+	const auto camera = PerspectiveCamera{scene_camera, static_cast<float>(width) / height};
+	const auto img_dim = Vec2f_8{static_cast<float>(width), static_cast<float>(height)};
+	BlockOrder block_order = stream_file.empty() ? BlockOrder::MORTON : BlockOrder::SCANLINE;
+	if (autotune_settings){
+		// The settings are tuned for everything that changes how much work a block is
+		Hasher key;
+		key.add(scene_hash(*scene));
+		for (const uint32_t x : {width, height, spp, pass_spp, max_depth, threads_set ? n_threads : 0}){
+			key.add(x);
+		}
+		key.add(integrator);
+		key.add(ray_mode);
+		key.add(kernels().isa);
+		key.add(aovs.size());
+		const auto machine = cpu_name() + " (" + std::to_string(std::thread::hardware_concurrency()) + " threads)";
+		TuneSettings tuned;
+		if (!retune && load_tuned_settings(tune_cache, machine, key.value(), tuned)){
+			std::cout << "Using the settings tuned for this scene from " << tune_cache << "\n";
+		}
+		else {
+			auto dims = candidate_block_dims(width, height);
+			if (dims.empty()){
+				dims.push_back(block_dim);
+			}
+			const auto threads = threads_set ? std::vector<uint32_t>{n_threads}
+				: candidate_thread_counts(std::thread::hardware_concurrency());
+			// A trial renders a pass over the blocks starting in the window [x0, x1) x [y0, y1) until
+			// it's done or out of time, and is scored on its sample rate
+			auto trial = [&](const TuneSettings &s, uint32_t x0, uint32_t x1, uint32_t y0, uint32_t y1,
+					double time_limit)
+			{
+				ThreadPool trial_pool{s.n_threads};
+				RenderTarget trial_target{width, height, aovs};
+				BlockQueue trial_queue{s.block_dim, width, height, trial_pool.size(), s.order};
+				trial_queue.retire([&](const std::pair<uint32_t, uint32_t> &b){
+					return b.first < x0 || b.first >= x1 || b.second < y0 || b.second >= y1;
+				});
+				const auto trial_start = Clock::now();
+				const RenderPass trial_pass{0, 0, pass_spp, trial_start
+					+ std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(time_limit)),
+					nullptr};
+				trial_pool.run([&](uint32_t id){
+					render(*scene, camera, img_dim, trial_target, trial_queue, integrator, ray_mode,
+						max_depth, trial_pass, id);
+				});
+				const double trial_time = std::chrono::duration<double>(Clock::now() - trial_start).count();
+				return static_cast<double>(trial_target.sample_count()) / trial_time;
+			};
+			// Rendering only part of the image would favor whichever order reaches the cheap parts
+			// first, so every trial renders the same window in the middle of the image. It's sized
+			// from how much of the image a first trial gets through in the time given to each
+			const TuneSettings base{block_dim, BlockOrder::MORTON, threads.front()};
+			const double rate = trial(base, 0, width, 0, height, tune_time);
+			const double covered = std::min(1.0, rate * tune_time / (static_cast<double>(width) * height * pass_spp));
+			const uint32_t win_w = std::min(width, std::max(64u, static_cast<uint32_t>(width * std::sqrt(covered))));
+			const uint32_t win_h = std::min(height, std::max(64u, static_cast<uint32_t>(height * std::sqrt(covered))));
+			const uint32_t x0 = (width - win_w) / 2;
+			const uint32_t y0 = (height - win_h) / 2;
+			std::cout << "Autotune: trials render " << win_w << "x" << win_h << " pixels at " << pass_spp << "spp\n";
+			tuned = autotune(dims, {BlockOrder::MORTON, BlockOrder::SCANLINE}, threads,
+				[&](const TuneSettings &s){
+					// The time limit is only a safeguard, the window should be done well before it
+					return trial(s, x0, x0 + win_w, y0, y0 + win_h, 4 * tune_time);
+				});
+			reset_total_counters();
+			save_tuned_settings(tune_cache, machine, key.value(), tuned);
+		}
+		block_dim = tuned.block_dim;
+		block_order = tuned.order;
+		n_threads = tuned.n_threads;
+		std::cout << "Rendering with " << block_dim << "x" << block_dim << " blocks in "
+			<< (block_order == BlockOrder::MORTON ? "morton" : "scanline") << " order on "
+			<< n_threads << " threads\n";
+	}
+	// Only one of the targets is created, streamed images never have all their pixels in memory
+	std::unique_ptr<RenderTarget> target;
+	std::unique_ptr<StreamingTarget> stream;
+	if (!stream_file.empty()){
+		stream.reset(new StreamingTarget{width, height, block_dim, resolve_params});
+		if (!stream->open(stream_file)){
+			return 1;
+		}
+	}
+	else {
+		target.reset(new RenderTarget{width, height, aovs});
+	}
+	ThreadPool pool{n_threads};
+	BlockQueue block_queue{block_dim, width, height, pool.size(), block_order};
+	// Sweep the image in passes until we've taken all the samples or run out of time.
+	// The workers have all finished when a pass returns so the target can be saved
+	// between passes without seeing half written tiles
+	const auto start = Clock::now();
+	const auto deadline = time_limit > 0
+		? start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(time_limit))
+		: Clock::time_point::max();
+	RenderPass pass{0, 0, pass_spp, deadline, nullptr};
+	std::vector<uint8_t> active;
+	for (; pass.first_sample < spp; ++pass.index, pass.first_sample += pass_spp){
+		const auto pass_start = Clock::now();
+		if (pass.index > 0){
+			block_queue.reset();
+		}
+		pool.run([&](uint32_t id){
+			if (stream){
+				render(*scene, camera, img_dim, *stream, block_queue, integrator, ray_mode, max_depth, pass, id);
+			}
+			else {
+				render(*scene, camera, img_dim, *target, block_queue, integrator, ray_mode, max_depth, pass, id);
+			}
+		});
+		const auto pass_end = Clock::now();
+		if (snapshots){
+			target->save_image("out.bmp", resolve_params, &pool);
+		}
+		// Don't start a pass we don't expect to finish before the deadline
+		if (pass_end + (pass_end - pass_start) > deadline){
+			++pass.index;
+			break;
+		}
+		// Once the pixels have enough samples to estimate their error we only keep
+		// sampling the noisy ones, blocks without any noisy pixels are retired
+		if (adaptive > 0 && pass.first_sample + pass_spp >= MIN_ADAPTIVE_SPP){
+			const uint32_t n_active = target->find_unconverged(adaptive, active);
+			pass.active = active.data();
+			const uint32_t n_blocks = block_queue.retire([&](const std::pair<uint32_t, uint32_t> &b){
+				for (uint32_t y = b.second; y < b.second + block_dim; ++y){
+					for (uint32_t x = b.first; x < b.first + block_dim; ++x){
+						if (active[size_t{y} * width + x]){
+							return false;
+						}
+					}
+				}
+				return true;
+			});
+			std::cout << "Pass " << pass.index << ": " << n_active << " pixels in "
+				<< n_blocks << " blocks not converged\n";
+			if (n_blocks == 0){
+				++pass.index;
+				break;
+			}
+		}
+	}
+	const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	const uint64_t samples = stream ? stream->sample_count() : target->sample_count();
+	std::cout << "Rendered " << pass.index << " passes of " << pass_spp << "spp in "
+		<< elapsed << "s, " << static_cast<double>(samples) / (static_cast<double>(width) * height)
+		<< " samples per pixel on average\n";
+	block_queue.report(std::cout);
+	if (!counters_file.empty() && !save_counters_json(counters_file, total_counters())){
+		return 1;
+	}
 
-	target.save_image("out.bmp");
+	if (stream){
+		std::cout << "Streamed to " << stream_file << " with at most " << stream->get_peak_resident()
+			<< " bands of " << stream->band_size() / 1024.0 << "KB resident\n";
+		return stream->close() ? 0 : 1;
+	}
+	target->save_image("out.bmp", resolve_params, &pool);
+	if (aovs.size() != 0 && !target->save_aovs("out")){
+		return 1;
+	}
 }
 
@@ -0,0 +1,172 @@
+#include <iostream>
+#include <cstring>
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "mapped_file.h"
+
+#if defined(_WIN32)
+/*
+ * Map the file opened as file, the file and mapping handles can be closed
+ * once the view is mapped since the view keeps them alive
+ */
+static uint8_t* map_file(HANDLE file, size_t size, bool writable){
+	const DWORD protect = writable ? PAGE_READWRITE : PAGE_READONLY;
+	HANDLE mapping = CreateFileMappingA(file, nullptr, protect, static_cast<DWORD>(uint64_t{size} >> 32),
+			static_cast<DWORD>(size), nullptr);
+	if (mapping == nullptr){
+		return nullptr;
+	}
+	void *view = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+	CloseHandle(mapping);
+	return static_cast<uint8_t*>(view);
+}
+#endif
+
+MappedFile::MappedFile() : ptr(nullptr), length(0), modified(0){}
+MappedFile::~MappedFile(){
+	close();
+}
+bool MappedFile::open(const std::string &file){
+	close();
+#if defined(_WIN32)
+	HANDLE handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER size;
+	FILETIME write_time;
+	if (handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle, &size)
+			|| !GetFileTime(handle, nullptr, nullptr, &write_time))
+	{
+		std::cerr << "MappedFile::open Error: failed to open file " << file << "\n";
+		if (handle != INVALID_HANDLE_VALUE){
+			CloseHandle(handle);
+		}
+		return false;
+	}
+	length = static_cast<size_t>(size.QuadPart);
+	modified = (uint64_t{write_time.dwHighDateTime} << 32) | write_time.dwLowDateTime;
+	ptr = length > 0 ? map_file(handle, length, false) : nullptr;
+	CloseHandle(handle);
+	if (length > 0 && ptr == nullptr){
+		std::cerr << "MappedFile::open Error: failed to map file " << file << "\n";
+		length = 0;
+		return false;
+	}
+#else
+	const int fd = ::open(file.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd == -1 || fstat(fd, &info) != 0){
+		std::cerr << "MappedFile::open Error: failed to open file " << file
+			<< ": " << std::strerror(errno) << "\n";
+		if (fd != -1){
+			::close(fd);
+		}
+		return false;
+	}
+	length = static_cast<size_t>(info.st_size);
+	modified = static_cast<uint64_t>(info.st_mtime);
+	if (length > 0){
+		void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED){
+			std::cerr << "MappedFile::open Error: failed to map file " << file
+				<< ": " << std::strerror(errno) << "\n";
+			::close(fd);
+			length = 0;
+			return false;
+		}
+		ptr = static_cast<uint8_t*>(p);
+	}
+	::close(fd);
+#endif
+	return true;
+}
+bool MappedFile::create(const std::string &file, size_t size){
+	close();
+#if defined(_WIN32)
+	HANDLE handle = CreateFileA(file.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE){
+		std::cerr << "MappedFile::create Error: failed to create file " << file << "\n";
+		return false;
+	}
+	// Mapping the file with a size grows it to that size
+	ptr = size > 0 ? map_file(handle, size, true) : nullptr;
+	CloseHandle(handle);
+	if (size > 0 && ptr == nullptr){
+		std::cerr << "MappedFile::create Error: failed to map file " << file << "\n";
+		return false;
+	}
+#else
+	const int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, static_cast<off_t>(size)) != 0){
+		std::cerr << "MappedFile::create Error: failed to create file " << file
+			<< ": " << std::strerror(errno) << "\n";
+		if (fd != -1){
+			::close(fd);
+		}
+		return false;
+	}
+	if (size > 0){
+		void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED){
+			std::cerr << "MappedFile::create Error: failed to map file " << file
+				<< ": " << std::strerror(errno) << "\n";
+			::close(fd);
+			return false;
+		}
+		ptr = static_cast<uint8_t*>(p);
+	}
+	::close(fd);
+#endif
+	length = size;
+	return true;
+}
+void MappedFile::close(){
+	if (ptr != nullptr){
+#if defined(_WIN32)
+		UnmapViewOfFile(ptr);
+#else
+		munmap(ptr, length);
+#endif
+	}
+	ptr = nullptr;
+	length = 0;
+	modified = 0;
+}
+
+#if defined(_WIN32)
+/*
+ * Get the volume and index identifying the file, returns false if it can't be opened
+ */
+static bool file_id(const std::string &file, BY_HANDLE_FILE_INFORMATION &info){
+	HANDLE handle = CreateFileA(file.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	if (handle == INVALID_HANDLE_VALUE){
+		return false;
+	}
+	const bool ok = GetFileInformationByHandle(handle, &info) != 0;
+	CloseHandle(handle);
+	return ok;
+}
+#endif
+bool same_file(const std::string &a, const std::string &b){
+#if defined(_WIN32)
+	BY_HANDLE_FILE_INFORMATION info_a, info_b;
+	return file_id(a, info_a) && file_id(b, info_b)
+		&& info_a.dwVolumeSerialNumber == info_b.dwVolumeSerialNumber
+		&& info_a.nFileIndexHigh == info_b.nFileIndexHigh
+		&& info_a.nFileIndexLow == info_b.nFileIndexLow;
+#else
+	struct stat info_a, info_b;
+	return stat(a.c_str(), &info_a) == 0 && stat(b.c_str(), &info_b) == 0
+		&& info_a.st_dev == info_b.st_dev && info_a.st_ino == info_b.st_ino;
+#endif
+}
+
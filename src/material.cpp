@@ -0,0 +1,83 @@
+#include "material.h"
+
+__m256 GlassMaterial::bounce(const Vec3f_8 &w_o, const Vec3f_8 &n, Vec3f_8 &w_r, Colorf_8 &f_r,
+		Vec3f_8 &w_t, Colorf_8 &f_t) const
+{
+	const auto zero = _mm256_setzero_ps();
+	const auto one = _mm256_set1_ps(1.f);
+	// Rays leaving the material hit the back of the surface, flip things
+	// around so we're always working on the side w_o is on
+	const auto cos_o = w_o.dot(n);
+	const auto entering = _mm256_cmp_ps(cos_o, zero, _CMP_GT_OQ);
+	const auto flip = _mm256_blendv_ps(_mm256_set1_ps(-1.f), one, entering);
+	const auto normal = flip * n;
+	const auto cos_i = _mm256_mul_ps(cos_o, flip);
+	const auto eta_i = _mm256_blendv_ps(_mm256_set1_ps(ior), one, entering);
+	const auto eta_t = _mm256_blendv_ps(one, _mm256_set1_ps(ior), entering);
+	const auto eta = _mm256_div_ps(eta_i, eta_t);
+
+	// Snell's law, lanes with sin_t >= 1 are totally internally reflected
+	const auto sin2_t = _mm256_mul_ps(_mm256_mul_ps(eta, eta), _mm256_fnmadd_ps(cos_i, cos_i, one));
+	const auto transmit = _mm256_cmp_ps(sin2_t, one, _CMP_LT_OQ);
+	const auto cos_t = _mm256_sqrt_ps(_mm256_max_ps(zero, _mm256_sub_ps(one, sin2_t)));
+
+	// Fresnel reflectance for unpolarized light
+	const auto ti = _mm256_mul_ps(eta_t, cos_i);
+	const auto it = _mm256_mul_ps(eta_i, cos_t);
+	const auto ii = _mm256_mul_ps(eta_i, cos_i);
+	const auto tt = _mm256_mul_ps(eta_t, cos_t);
+	const auto r_parl = _mm256_div_ps(_mm256_sub_ps(ti, it), _mm256_add_ps(ti, it));
+	const auto r_perp = _mm256_div_ps(_mm256_sub_ps(ii, tt), _mm256_add_ps(ii, tt));
+	auto fresnel = _mm256_mul_ps(_mm256_set1_ps(0.5f),
+			_mm256_fmadd_ps(r_parl, r_parl, _mm256_mul_ps(r_perp, r_perp)));
+	fresnel = _mm256_blendv_ps(one, fresnel, transmit);
+
+	w_r = reflect(w_o, normal);
+	f_r = Colorf_8{fresnel, fresnel, fresnel};
+	w_t = _mm256_fmsub_ps(eta, cos_i, cos_t) * normal - eta * w_o;
+	w_t.normalize();
+	f_t = Colorf_8{color} * _mm256_sub_ps(one, fresnel);
+	return transmit;
+}
+
+Colorf_8 LambertianMaterial::sample(const Vec3f_8 &w_o, const Vec3f_8 &n, const Vec2f_8 &u, Vec3f_8 &w_i) const {
+	const auto zero = _mm256_setzero_ps();
+	const auto one = _mm256_set1_ps(1.f);
+	const auto sign_bit = _mm256_set1_ps(-0.f);
+	// Sample on the side of the surface w_o is on
+	const auto side = _mm256_and_ps(w_o.dot(n), sign_bit);
+	const auto normal = Vec3f_8{_mm256_xor_ps(n.x, side), _mm256_xor_ps(n.y, side), _mm256_xor_ps(n.z, side)};
+	// Branchless orthonormal basis around the normal from Duff et al.
+	const auto sign = _mm256_or_ps(_mm256_and_ps(normal.z, sign_bit), one);
+	const auto a = _mm256_div_ps(_mm256_set1_ps(-1.f), _mm256_add_ps(sign, normal.z));
+	const auto b = _mm256_mul_ps(_mm256_mul_ps(normal.x, normal.y), a);
+	const auto tangent = Vec3f_8{_mm256_fmadd_ps(_mm256_mul_ps(sign, _mm256_mul_ps(normal.x, normal.x)), a, one),
+		_mm256_mul_ps(sign, b), _mm256_mul_ps(_mm256_sub_ps(zero, sign), normal.x)};
+	const auto bitangent = Vec3f_8{b, _mm256_fmadd_ps(_mm256_mul_ps(normal.y, normal.y), a, sign),
+		_mm256_sub_ps(zero, normal.y)};
+
+	// Pick a point on the unit disk and project it up to the hemisphere
+	const auto r = _mm256_sqrt_ps(u.x);
+	const auto phi = _mm256_fmsub_ps(u.y, _mm256_set1_ps(static_cast<float>(2 * M_PI)),
+			_mm256_set1_ps(static_cast<float>(M_PI)));
+	__m256 sin_phi, cos_phi;
+	vsincos(phi, sin_phi, cos_phi);
+	const auto x = _mm256_mul_ps(r, cos_phi);
+	const auto y = _mm256_mul_ps(r, sin_phi);
+	const auto z = _mm256_sqrt_ps(_mm256_max_ps(zero, _mm256_sub_ps(one, u.x)));
+	w_i = x * tangent + y * bitangent + z * normal;
+	return Colorf_8{color};
+}
+Colorf_8 GlassMaterial::sample(const Vec3f_8 &w_o, const Vec3f_8 &n, const Vec2f_8 &u, Vec3f_8 &w_i) const {
+	Vec3f_8 w_r, w_t;
+	Colorf_8 f_r, f_t;
+	const auto transmit = bounce(w_o, n, w_r, f_r, w_t, f_t);
+	// f_r holds the Fresnel reflectance, which is the probability of picking reflection
+	// so the weight of a reflected sample is 1 and a transmitted one is the color
+	const auto refract = _mm256_and_ps(transmit, _mm256_cmp_ps(u.x, f_r.r, _CMP_GE_OQ));
+	w_i = Vec3f_8{_mm256_blendv_ps(w_r.x, w_t.x, refract), _mm256_blendv_ps(w_r.y, w_t.y, refract),
+		_mm256_blendv_ps(w_r.z, w_t.z, refract)};
+	return Colorf_8{_mm256_blendv_ps(_mm256_set1_ps(1.f), _mm256_set1_ps(color.r), refract),
+		_mm256_blendv_ps(_mm256_set1_ps(1.f), _mm256_set1_ps(color.g), refract),
+		_mm256_blendv_ps(_mm256_set1_ps(1.f), _mm256_set1_ps(color.b), refract)};
+}
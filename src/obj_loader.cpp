@@ -0,0 +1,283 @@
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <cstdio>
+#include <cstring>
+#include "obj_loader.h"
+
+// Size of the chunks the file is read in
+static const size_t CHUNK_SIZE = 16 * 1024 * 1024;
+
+// Normal index used in the vertex map for face vertices without normals
+static const uint64_t NO_NORMAL = 0xffffffff;
+
+static inline bool is_space(char c){
+	return c == ' ' || c == '\t' || c == '\r';
+}
+static inline const char* skip_space(const char *c, const char *end){
+	while (c != end && is_space(*c)){
+		++c;
+	}
+	return c;
+}
+/*
+ * Parse a float starting at c, we don't need the full generality (or locale
+ * handling) of strtof so this is a lot faster
+ */
+static const char* parse_float(const char *c, const char *end, float &out){
+	static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+		1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+	c = skip_space(c, end);
+	bool neg = false;
+	if (c != end && (*c == '-' || *c == '+')){
+		neg = *c == '-';
+		++c;
+	}
+	uint64_t mantissa = 0;
+	int exponent = 0;
+	int digits = 0;
+	for (; c != end && *c >= '0' && *c <= '9'; ++c){
+		if (digits < 18){
+			mantissa = mantissa * 10 + (*c - '0');
+			++digits;
+		}
+		else {
+			++exponent;
+		}
+	}
+	if (c != end && *c == '.'){
+		for (++c; c != end && *c >= '0' && *c <= '9'; ++c){
+			if (digits < 18){
+				mantissa = mantissa * 10 + (*c - '0');
+				++digits;
+				--exponent;
+			}
+		}
+	}
+	if (c != end && (*c == 'e' || *c == 'E')){
+		++c;
+		bool exp_neg = false;
+		if (c != end && (*c == '-' || *c == '+')){
+			exp_neg = *c == '-';
+			++c;
+		}
+		int e = 0;
+		for (; c != end && *c >= '0' && *c <= '9'; ++c){
+			e = e * 10 + (*c - '0');
+		}
+		exponent += exp_neg ? -e : e;
+	}
+	double value = static_cast<double>(mantissa);
+	if (exponent < 0){
+		value = exponent >= -18 ? value / pow10[-exponent] : value * std::pow(10.0, exponent);
+	}
+	else if (exponent > 0){
+		value = exponent <= 18 ? value * pow10[exponent] : value * std::pow(10.0, exponent);
+	}
+	out = static_cast<float>(neg ? -value : value);
+	return c;
+}
+static const char* parse_int(const char *c, const char *end, int64_t &out){
+	bool neg = false;
+	if (c != end && *c == '-'){
+		neg = true;
+		++c;
+	}
+	int64_t value = 0;
+	for (; c != end && *c >= '0' && *c <= '9'; ++c){
+		value = value * 10 + (*c - '0');
+	}
+	out = neg ? -value : value;
+	return c;
+}
+/*
+ * Convert an OBJ index, which is 1-based or negative to index from the
+ * end of the list so far, to a 0-based index. Returns -1 if it's invalid
+ */
+static inline int64_t fix_index(int64_t i, size_t count){
+	if (i > 0 && static_cast<size_t>(i) <= count){
+		return i - 1;
+	}
+	if (i < 0 && static_cast<size_t>(-i) <= count){
+		return count + i;
+	}
+	return -1;
+}
+
+struct ObjParser {
+	MeshData &mesh;
+	std::vector<Vec3f> positions, normals;
+	// Maps position/normal index pairs to the mesh vertex created for them,
+	// only needed if the file has normals since otherwise vertices are just positions
+	std::unordered_map<uint64_t, uint32_t> vertex_map;
+	std::vector<uint32_t> face;
+	size_t line_number;
+	// direct is set if faces without normals have indexed the positions directly,
+	// missing_normals if some mesh vertices were created without a normal
+	bool ok, direct, missing_normals;
+
+	ObjParser(MeshData &mesh) : mesh(mesh), line_number(0), ok(true), direct(false), missing_normals(false){}
+	uint32_t get_vertex(int64_t p, int64_t n){
+		if (vertex_map.empty()){
+			if (n < 0){
+				direct = true;
+				return p;
+			}
+			// Faces without normals were already indexing the positions
+			// directly, so keep the positions seen so far as vertices
+			if (direct){
+				for (uint32_t i = 0; i < positions.size(); ++i){
+					mesh.vertices.push_back(positions[i]);
+					mesh.normals.push_back(Vec3f{0, 0, 0});
+					vertex_map[(static_cast<uint64_t>(i) << 32) | NO_NORMAL] = i;
+				}
+				missing_normals = true;
+			}
+		}
+		const uint64_t key = (static_cast<uint64_t>(p) << 32) | (n < 0 ? NO_NORMAL : static_cast<uint64_t>(n));
+		auto it = vertex_map.find(key);
+		if (it != vertex_map.end()){
+			return it->second;
+		}
+		const uint32_t v = mesh.vertices.size();
+		mesh.vertices.push_back(positions[p]);
+		if (n < 0){
+			mesh.normals.push_back(Vec3f{0, 0, 0});
+			missing_normals = true;
+		}
+		else {
+			mesh.normals.push_back(normals[n]);
+		}
+		vertex_map[key] = v;
+		return v;
+	}
+	void parse_line(const char *c, const char *end){
+		++line_number;
+		c = skip_space(c, end);
+		if (end - c < 2){
+			return;
+		}
+		if (c[0] == 'v' && is_space(c[1])){
+			Vec3f v;
+			c = parse_float(c + 2, end, v.x);
+			c = parse_float(c, end, v.y);
+			parse_float(c, end, v.z);
+			positions.push_back(v);
+		}
+		else if (c[0] == 'v' && c[1] == 'n'){
+			Vec3f n;
+			c = parse_float(c + 2, end, n.x);
+			c = parse_float(c, end, n.y);
+			parse_float(c, end, n.z);
+			normals.push_back(n);
+		}
+		else if (c[0] == 'f' && is_space(c[1])){
+			face.clear();
+			c = skip_space(c + 2, end);
+			while (c != end){
+				// Each face vertex is p, p/t, p//n or p/t/n
+				int64_t p = 0, t = 0, n = 0;
+				c = parse_int(c, end, p);
+				if (c != end && *c == '/'){
+					++c;
+					if (c != end && *c != '/'){
+						c = parse_int(c, end, t);
+					}
+					if (c != end && *c == '/'){
+						c = parse_int(c + 1, end, n);
+					}
+				}
+				p = fix_index(p, positions.size());
+				if (p < 0){
+					std::cerr << "load_obj Error: invalid vertex index on line " << line_number << "\n";
+					ok = false;
+					return;
+				}
+				// Face vertices without a normal get -1
+				if (n != 0){
+					n = fix_index(n, normals.size());
+					if (n < 0){
+						std::cerr << "load_obj Error: invalid normal index on line " << line_number << "\n";
+						ok = false;
+						return;
+					}
+				}
+				else {
+					n = -1;
+				}
+				face.push_back(get_vertex(p, n));
+				c = skip_space(c, end);
+			}
+			for (size_t i = 2; i < face.size(); ++i){
+				mesh.indices.push_back(face[0]);
+				mesh.indices.push_back(face[i - 1]);
+				mesh.indices.push_back(face[i]);
+			}
+		}
+	}
+};
+
+bool load_obj(const std::string &file, MeshData &mesh){
+	FILE *fp = fopen(file.c_str(), "rb");
+	if (!fp){
+		std::cerr << "load_obj Error: failed to open file " << file << std::endl;
+		return false;
+	}
+	mesh = MeshData{};
+	ObjParser parser{mesh};
+	std::vector<char> buf(CHUNK_SIZE);
+	// Number of bytes at the start of the buffer left over from a line
+	// that was split across the end of the previous chunk
+	size_t carry = 0;
+	for (;;){
+		const size_t read = fread(buf.data() + carry, 1, buf.size() - carry, fp);
+		const size_t size = carry + read;
+		const char *begin = buf.data();
+		const char *end = begin + size;
+		const char *line = begin;
+		for (;;){
+			const char *nl = static_cast<const char*>(std::memchr(line, '\n', end - line));
+			if (!nl){
+				break;
+			}
+			parser.parse_line(line, nl);
+			line = nl + 1;
+		}
+		carry = end - line;
+		if (read == 0){
+			// Parse any final line without a trailing newline
+			if (carry != 0){
+				parser.parse_line(line, end);
+			}
+			break;
+		}
+		// Grow the buffer if a single line doesn't fit in it
+		if (carry == buf.size()){
+			buf.resize(buf.size() * 2);
+		}
+		else {
+			std::memmove(buf.data(), line, carry);
+		}
+		if (!parser.ok){
+			break;
+		}
+	}
+	fclose(fp);
+	if (!parser.ok){
+		return false;
+	}
+	// If there were no normals we didn't need to split vertices so the
+	// mesh vertices are just the positions
+	if (parser.vertex_map.empty()){
+		mesh.vertices = std::move(parser.positions);
+		mesh.normals.clear();
+	}
+	else if (parser.missing_normals){
+		// Some faces had normals and others didn't, drop the normals and
+		// let the mesh compute smooth ones
+		std::cout << "load_obj Warning: " << file << " only has normals for some faces, ignoring them\n";
+		mesh.normals.clear();
+	}
+	return true;
+}
+
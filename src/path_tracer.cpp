@@ -0,0 +1,192 @@
+#include <cstring>
+#include "scene.h"
+#include "camera.h"
+#include "ld_sampler.h"
+#include "rng.h"
+#include "render_target.h"
+#include "occlusion_tester.h"
+#include "compact.h"
+#include "counters.h"
+#include "path_tracer.h"
+
+// Number of bounces a path makes before it's subject to Russian roulette
+const int32_t ROULETTE_DEPTH = 3;
+
+/*
+ * Expand the 8 bit lane mask to a vector mask
+ */
+static inline __m256 lane_mask(int mask){
+	const auto bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits));
+}
+static inline Vec3f_8 select(const Vec3f_8 &a, const Vec3f_8 &b, __m256 mask){
+	return Vec3f_8{_mm256_blendv_ps(a.x, b.x, mask), _mm256_blendv_ps(a.y, b.y, mask),
+		_mm256_blendv_ps(a.z, b.z, mask)};
+}
+static inline Colorf_8 select(const Colorf_8 &a, const Colorf_8 &b, __m256 mask){
+	return Colorf_8{_mm256_blendv_ps(a.r, b.r, mask), _mm256_blendv_ps(a.g, b.g, mask),
+		_mm256_blendv_ps(a.b, b.b, mask)};
+}
+static inline __m256 max_component(const Colorf_8 &c){
+	return _mm256_max_ps(c.r, _mm256_max_ps(c.g, c.b));
+}
+
+PathTracer::PathTracer(const Scene &scene, const PerspectiveCamera &camera, const Vec2f_8 &img_dim,
+		uint32_t max_depth)
+	: scene(scene), camera(camera), img_dim(img_dim), max_depth(max_depth), queued(0)
+{}
+void PathTracer::render_block(LDSampler &sampler, RNG &rng, RenderTile &tile){
+	const auto zero = _mm256_setzero_ps();
+	const auto one = _mm256_set1_ps(1.f);
+	const auto n_materials = _mm256_set1_epi32(static_cast<int32_t>(scene.materials.size()));
+	queued = 0;
+	Ray8 ray;
+	ray.active = zero;
+	auto samples = Vec2f_8{0, 0};
+	Colorf_8 throughput{0}, radiance{0};
+	// Number of surfaces each lane's path has hit
+	auto depth = _mm256_setzero_si256();
+	bool sampling = true;
+	for (;;){
+		int alive = _mm256_movemask_ps(ray.active);
+		if (alive != 0xff && sampling){
+			const int dead = ~alive & 0xff;
+			const int started = refill(sampler, rng, dead, samples);
+			sampling = started == dead;
+			if (started != 0){
+				const auto start = lane_mask(started);
+				Ray8 camera_rays;
+				camera.generate_rays(camera_rays, samples / img_dim);
+				ray.o = select(ray.o, camera_rays.o, start);
+				ray.d = select(ray.d, camera_rays.d, start);
+				ray.t_min = _mm256_blendv_ps(ray.t_min, camera_rays.t_min, start);
+				ray.t_max = _mm256_blendv_ps(ray.t_max, camera_rays.t_max, start);
+				ray.active = _mm256_or_ps(ray.active, start);
+				throughput = select(throughput, Colorf_8{1}, start);
+				radiance = select(radiance, Colorf_8{0}, start);
+				depth = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(depth), zero, start));
+				alive |= started;
+			}
+		}
+		if (alive == 0){
+			break;
+		}
+		const auto active = ray.active;
+		const uint64_t cost_start = tile.has_cost() ? cost_timestamp() : 0;
+		DiffGeom8 dg;
+		auto hits = _mm256_and_ps(scene.intersect(ray, dg), active);
+		// Paths that hit something we don't have a material for are terminated
+		const auto valid_id = _mm256_and_si256(_mm256_cmpgt_epi32(dg.material_id, _mm256_set1_epi32(-1)),
+				_mm256_cmpgt_epi32(n_materials, dg.material_id));
+		hits = _mm256_and_ps(hits, _mm256_castsi256_ps(valid_id));
+		// Lanes that haven't bounced yet are at their primary hit
+		if (tile.has_aovs()){
+			const auto primary = _mm256_castsi256_ps(_mm256_cmpeq_epi32(depth, _mm256_setzero_si256()));
+			tile.write_aovs(samples, ray.t_max, dg, _mm256_and_ps(hits, primary), scene.materials);
+		}
+		PERF_COUNT(SHADE_PACKETS, 1);
+		PERF_COUNT(SHADE_LANES, _mm_popcnt_u32(_mm256_movemask_ps(hits)));
+		const auto &p = dg.point;
+		const auto &n = dg.normal;
+		const auto w_o = -ray.d;
+
+		OcclusionTester occlusion;
+		Vec3f_8 w_l{0};
+		const auto li = scene.lights.sample(p, rng, w_l, occlusion);
+		const auto u = Vec2f_8{rng.next_float<AVX2>(), rng.next_float<AVX2>()};
+		// Sample each material's BSDF for its lanes, peeling off the lanes with the
+		// same material as the first remaining one
+		Colorf_8 weight{0}, f{0};
+		Vec3f_8 w_i{0};
+		auto diffuse = zero;
+		CACHE_ALIGN int32_t ids[8];
+		_mm256_store_si256((__m256i*)ids, dg.material_id);
+		for (int mask = _mm256_movemask_ps(hits); mask != 0;){
+			const int id = ids[_tzcnt_u32(mask)];
+			const int same = mask & _mm256_movemask_ps(_mm256_castsi256_ps(
+						_mm256_cmpeq_epi32(dg.material_id, _mm256_set1_epi32(id))));
+			const auto lanes = lane_mask(same);
+			const auto &material = *scene.materials[id];
+			Vec3f_8 w;
+			weight = select(weight, material.sample(w_o, n, u, w), lanes);
+			w_i = select(w_i, w, lanes);
+			if (!material.is_specular()){
+				f = select(f, material.shade(w_o, w_l), lanes);
+				diffuse = _mm256_or_ps(diffuse, lanes);
+			}
+			mask &= ~same;
+		}
+
+		// Next event estimation, the light only reaches the surface if it's on the
+		// same side the path arrived from. Lights aren't visible to the BSDF samples so
+		// specular surfaces can't be lit by them
+		const auto cos_l = w_l.dot(n);
+		auto lit = _mm256_and_ps(diffuse, _mm256_cmp_ps(_mm256_mul_ps(cos_l, w_o.dot(n)), zero, _CMP_GT_OQ));
+		PERF_COUNT(SHADOW_CULLED, _mm_popcnt_u32(_mm256_movemask_ps(_mm256_andnot_ps(lit, diffuse))));
+		if (_mm256_movemask_ps(lit) != 0){
+			occlusion.rays.active = lit;
+			lit = _mm256_andnot_ps(occlusion.occluded(scene), lit);
+			const auto c = throughput * f * li * vabs(cos_l);
+			radiance = select(radiance, radiance + c, lit);
+		}
+
+		// Continue the paths that can still carry light along the sampled directions
+		throughput = throughput * weight;
+		depth = _mm256_add_epi32(depth, _mm256_set1_epi32(1));
+		auto next = _mm256_and_ps(hits, _mm256_cmp_ps(max_component(throughput), zero, _CMP_GT_OQ));
+		next = _mm256_and_ps(next, _mm256_castsi256_ps(_mm256_cmpgt_epi32(
+						_mm256_set1_epi32(static_cast<int32_t>(max_depth)), depth)));
+		// Russian roulette, paths carrying little light are likely to be killed and the
+		// survivors are weighted up to keep the estimate unbiased
+		const auto roulette = _mm256_and_ps(next, _mm256_castsi256_ps(_mm256_cmpgt_epi32(depth,
+						_mm256_set1_epi32(ROULETTE_DEPTH - 1))));
+		if (_mm256_movemask_ps(roulette) != 0){
+			const auto q = _mm256_max_ps(_mm256_set1_ps(0.05f), _mm256_sub_ps(one, max_component(throughput)));
+			const auto survive = _mm256_cmp_ps(rng.next_float<AVX2>(), q, _CMP_GE_OQ);
+			next = _mm256_andnot_ps(_mm256_andnot_ps(survive, roulette), next);
+			throughput = select(throughput, throughput / _mm256_sub_ps(one, q), _mm256_and_ps(roulette, survive));
+		}
+		const auto done = _mm256_andnot_ps(next, active);
+		tile.write_samples(samples, radiance, done);
+		// Each path's sample is charged its share of the packet's cost for every bounce it takes
+		if (tile.has_cost()){
+			tile.write_cost(samples, static_cast<float>(cost_timestamp() - cost_start)
+					/ _mm_popcnt_u32(_mm256_movemask_ps(active)), active);
+		}
+
+		ray.o = p;
+		ray.d = w_i.normalized();
+		ray.t_min = _mm256_set1_ps(0.001f);
+		ray.t_max = _mm256_set1_ps(INFINITY);
+		ray.active = next;
+	}
+}
+int PathTracer::refill(LDSampler &sampler, RNG &rng, int dead, Vec2f_8 &samples){
+	// Pull packets from the sampler until we have enough queued to fill the dead lanes,
+	// fewer than 8 are needed so the queue never holds more than 15
+	const uint32_t needed = _mm_popcnt_u32(dead);
+	while (queued < needed && sampler.has_samples()){
+		auto s = Vec2f_8{0, 0};
+		const int mask = _mm256_movemask_ps(sampler.sample(rng, s));
+		compress_store(&queue_x[queued], s.x, mask);
+		queued += compress_store(&queue_y[queued], s.y, mask);
+	}
+	CACHE_ALIGN float x[8];
+	CACHE_ALIGN float y[8];
+	_mm256_store_ps(x, samples.x);
+	_mm256_store_ps(y, samples.y);
+	int started = 0;
+	uint32_t taken = 0;
+	for (int m = dead; m != 0 && taken < queued; m &= m - 1, ++taken){
+		const int lane = _tzcnt_u32(m);
+		x[lane] = queue_x[taken];
+		y[lane] = queue_y[taken];
+		started |= 1 << lane;
+	}
+	queued -= taken;
+	std::memmove(queue_x, queue_x + taken, queued * sizeof(float));
+	std::memmove(queue_y, queue_y + taken, queued * sizeof(float));
+	samples = Vec2f_8{_mm256_load_ps(x), _mm256_load_ps(y)};
+	return started;
+}
+
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include "compact.h"
+#include "bbox.h"
+#include "ray_stream.h"
+
+// Spread the lower 10 bits of x out so there are two 0 bits between each bit
+static uint32_t part1by2(uint32_t x){
+	x &= 0x000003ff;
+	x = (x ^ (x << 16)) & 0xff0000ff;
+	x = (x ^ (x <<  8)) & 0x0300f00f;
+	x = (x ^ (x <<  4)) & 0x030c30c3;
+	x = (x ^ (x <<  2)) & 0x09249249;
+	return x;
+}
+static const int RADIX_BITS = 10;
+static const uint32_t RADIX_SIZE = 1 << RADIX_BITS;
+
+static uint32_t morton3(uint32_t x, uint32_t y, uint32_t z){
+	return (part1by2(z) << 2) + (part1by2(y) << 1) + part1by2(x);
+}
+
+RayStream::RayStream() : count(0){}
+int RayStream::push(const Ray8 &rays, __m256 mask, int32_t first_id){
+	const int m = _mm256_movemask_ps(mask);
+	if (m == 0){
+		return 0;
+	}
+	reserve(count + 8);
+	compress_store(&ox[count], rays.o.x, m);
+	compress_store(&oy[count], rays.o.y, m);
+	compress_store(&oz[count], rays.o.z, m);
+	compress_store(&dx[count], rays.d.x, m);
+	compress_store(&dy[count], rays.d.y, m);
+	compress_store(&dz[count], rays.d.z, m);
+	compress_store(&t_min[count], rays.t_min, m);
+	compress_store(&t_max[count], rays.t_max, m);
+	// The rays are compacted in lane order so their ids are just consecutive
+	_mm256_storeu_si256((__m256i*)&ids[count], _mm256_add_epi32(_mm256_set1_epi32(first_id),
+				_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	const int n = _mm_popcnt_u32(m);
+	count += n;
+	return n;
+}
+void RayStream::append(const Ray8 &rays, __m256 mask, int32_t first_id){
+	reserve(count + 8);
+	_mm256_store_ps(&ox[count], rays.o.x);
+	_mm256_store_ps(&oy[count], rays.o.y);
+	_mm256_store_ps(&oz[count], rays.o.z);
+	_mm256_store_ps(&dx[count], rays.d.x);
+	_mm256_store_ps(&dy[count], rays.d.y);
+	_mm256_store_ps(&dz[count], rays.d.z);
+	_mm256_store_ps(&t_min[count], rays.t_min);
+	_mm256_store_ps(&t_max[count], _mm256_blendv_ps(_mm256_set1_ps(-INFINITY), rays.t_max, mask));
+	_mm256_store_si256((__m256i*)&ids[count], _mm256_add_epi32(_mm256_set1_epi32(first_id),
+				_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	count += 8;
+}
+void RayStream::sort(){
+	if (count < 2){
+		return;
+	}
+	BBox bounds;
+	for (uint32_t i = 0; i < count; ++i){
+		bounds.extend(Vec3f{ox[i], oy[i], oz[i]});
+	}
+	const auto extent = bounds.max - bounds.min;
+	float scale[3];
+	for (int i = 0; i < 3; ++i){
+		scale[i] = extent[i] > 0 ? 511.f / extent[i] : 0;
+	}
+	// Keys are the direction octant in the top bits followed by a 27 bit Morton
+	// code of the origin, the ray's index goes in the low word so sorting the keys
+	// gives us the new order of the rays
+	keys.resize(count);
+	for (uint32_t i = 0; i < count; ++i){
+		const uint64_t octant = (dx[i] < 0 ? 1 : 0) | (dy[i] < 0 ? 2 : 0) | (dz[i] < 0 ? 4 : 0);
+		const uint64_t code = morton3(static_cast<uint32_t>((ox[i] - bounds.min.x) * scale[0]),
+				static_cast<uint32_t>((oy[i] - bounds.min.y) * scale[1]),
+				static_cast<uint32_t>((oz[i] - bounds.min.z) * scale[2]));
+		keys[i] = (((octant << 27) | code) << 32) | i;
+	}
+	// The keys are only 30 bits so an LSD radix sort on them takes three passes
+	sorted_keys.resize(count);
+	for (int shift = 32; shift < 62; shift += RADIX_BITS){
+		uint32_t offsets[RADIX_SIZE] = {0};
+		for (uint32_t i = 0; i < count; ++i){
+			++offsets[(keys[i] >> shift) & (RADIX_SIZE - 1)];
+		}
+		uint32_t total = 0;
+		for (auto &o : offsets){
+			const uint32_t n = o;
+			o = total;
+			total += n;
+		}
+		for (uint32_t i = 0; i < count; ++i){
+			sorted_keys[offsets[(keys[i] >> shift) & (RADIX_SIZE - 1)]++] = keys[i];
+		}
+		std::swap(keys, sorted_keys);
+	}
+	scratch.resize(ox.size());
+	scratch_ids.resize(ids.size());
+	for (auto *v : {&ox, &oy, &oz, &dx, &dy, &dz, &t_min, &t_max}){
+		for (uint32_t i = 0; i < count; ++i){
+			scratch[i] = (*v)[keys[i] & 0xffffffff];
+		}
+		std::swap(*v, scratch);
+	}
+	for (uint32_t i = 0; i < count; ++i){
+		scratch_ids[i] = ids[keys[i] & 0xffffffff];
+	}
+	std::swap(ids, scratch_ids);
+}
+void RayStream::load(uint32_t i, Ray8 &rays, __m256i &id) const {
+	// The buffers are padded out to a multiple of 8 so we can always load a full packet
+	rays.o = Vec3f_8{_mm256_load_ps(&ox[i]), _mm256_load_ps(&oy[i]), _mm256_load_ps(&oz[i])};
+	rays.d = Vec3f_8{_mm256_load_ps(&dx[i]), _mm256_load_ps(&dy[i]), _mm256_load_ps(&dz[i])};
+	rays.t_min = _mm256_load_ps(&t_min[i]);
+	rays.t_max = _mm256_load_ps(&t_max[i]);
+	id = _mm256_load_si256((const __m256i*)&ids[i]);
+	const auto lane = _mm256_add_epi32(_mm256_set1_epi32(i), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	rays.active = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(count), lane));
+}
+RayArrays RayStream::arrays(uint32_t first){
+	return RayArrays{&ox[first], &oy[first], &oz[first], &dx[first], &dy[first], &dz[first],
+		&t_min[first], &t_max[first]};
+}
+uint32_t RayStream::size() const {
+	return count;
+}
+void RayStream::clear(){
+	count = 0;
+}
+void RayStream::reserve(uint32_t n){
+	// Keep the size a multiple of KERNEL_PAD so load and the kernels can read whole packets
+	n = (n + KERNEL_PAD - 1) & ~(KERNEL_PAD - 1);
+	if (ox.size() >= n){
+		return;
+	}
+	n = std::max(n, static_cast<uint32_t>(2 * ox.size()));
+	for (auto *v : {&ox, &oy, &oz, &dx, &dy, &dz, &t_min, &t_max}){
+		v->resize(n);
+	}
+	ids.resize(n);
+}
@@ -7,13 +7,20 @@
 #include <cmath>
 #include <memory>
 #include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <algorithm>
 #include "immintrin.h"
 #include "render_target.h"
+#include "kernels.h"
+#include "thread_pool.h"
+#include "material.h"
+#include "mapped_file.h"
 
 /*
  * Convenient wrapper for BMP header information for a 24bpp BMP
  */
-#pragma pack(1)
+#pragma pack(push, 1)
 struct BMPHeader {
 	std::array<uint8_t, 2> header = {'B', 'M'};
 	uint32_t file_size;
@@ -35,20 +42,213 @@ struct BMPHeader {
 		: file_size(54 + img_size), dims({w, h}), img_size(img_size)
 	{}
 };
+#pragma pack(pop)
 
 Pixel::Pixel() : r(0), g(0), b(0), weight(0){}
 Pixel::Pixel(const Pixel &p) : r(p.r), g(p.g), b(p.b), weight(p.weight){}
 
-RenderTarget::RenderTarget(uint32_t width, uint32_t height)
-	: width(width), height(height), pixels(width * height){}
+AOVLayout::AOVLayout() : n_channels(0){
+	std::fill(std::begin(offsets), std::end(offsets), -1);
+}
+void AOVLayout::enable(AOV aov){
+	if (enabled(aov)){
+		return;
+	}
+	// Recompute the offsets so the channels stay in the order of the enum
+	offsets[static_cast<int>(aov)] = 0;
+	n_channels = 0;
+	for (int i = 0; i < static_cast<int>(AOV::COUNT); ++i){
+		if (offsets[i] != -1){
+			offsets[i] = n_channels;
+			n_channels += channels(static_cast<AOV>(i));
+		}
+	}
+}
+uint32_t AOVLayout::channels(AOV aov){
+	return aov == AOV::NORMAL || aov == AOV::ALBEDO ? 3 : 1;
+}
+const char* AOVLayout::name(AOV aov){
+	switch (aov){
+		case AOV::DEPTH: return "depth";
+		case AOV::NORMAL: return "normal";
+		case AOV::ALBEDO: return "albedo";
+		case AOV::MATERIAL_ID: return "material";
+		case AOV::COST: return "cost";
+		default: return "";
+	}
+}
+
+/*
+ * Reset the AOV values of n pixels, material IDs start out as -1 since
+ * they're overwritten instead of accumulated
+ */
+static void clear_aovs(const AOVLayout &aovs, float *values, size_t n){
+	std::fill(values, values + n * aovs.size(), 0.f);
+	if (aovs.enabled(AOV::MATERIAL_ID)){
+		for (size_t i = 0; i < n; ++i){
+			values[i * aovs.size() + aovs.offset(AOV::MATERIAL_ID)] = -1.f;
+		}
+	}
+}
+/*
+ * Add the AOV values of n pixels in src to dst
+ */
+static void add_aovs(const AOVLayout &aovs, const float *src, float *dst, size_t n){
+	const int material = aovs.offset(AOV::MATERIAL_ID);
+	for (size_t i = 0; i < n; ++i, src += aovs.size(), dst += aovs.size()){
+		for (int c = 0; c < static_cast<int>(aovs.size()); ++c){
+			if (c != material){
+				dst[c] += src[c];
+			}
+			else if (src[c] >= 0){
+				dst[c] = src[c];
+			}
+		}
+	}
+}
+
+RenderTile::RenderTile(uint32_t block_dim, const AOVLayout &aovs)
+	: block_dim(block_dim), start(0, 0), pixels(block_dim * block_dim), lum_sq(block_dim * block_dim),
+	aovs(aovs), aov_values(block_dim * block_dim * aovs.size())
+{}
+void RenderTile::reset(const std::pair<uint32_t, uint32_t> &b){
+	start = b;
+	std::fill(pixels.begin(), pixels.end(), Pixel{});
+	std::fill(lum_sq.begin(), lum_sq.end(), 0.f);
+	clear_aovs(aovs, aov_values.data(), pixels.size());
+}
+void RenderTile::write_samples(const Vec2f_8 &p, const Colorf_8 &c, __m256 mask){
+	const auto write_mask = _mm256_movemask_ps(mask);
+	if (write_mask == 0){
+		return;
+	}
+	// Compute the index of the pixel in the tile that each sample falls in
+	const auto dim = _mm256_set1_epi32(block_dim - 1);
+	const auto zero = _mm256_setzero_si256();
+	auto ix = _mm256_sub_epi32(_mm256_cvttps_epi32(p.x), _mm256_set1_epi32(start.first));
+	auto iy = _mm256_sub_epi32(_mm256_cvttps_epi32(p.y), _mm256_set1_epi32(start.second));
+	ix = _mm256_max_epi32(zero, _mm256_min_epi32(dim, ix));
+	iy = _mm256_max_epi32(zero, _mm256_min_epi32(dim, iy));
+	const auto idx = _mm256_add_epi32(_mm256_mullo_epi32(iy, _mm256_set1_epi32(block_dim)), ix);
+	const auto lum = c.luminance();
+	const auto sq = _mm256_mul_ps(lum, lum);
+
+	// The sampler takes all of a pixel's samples before moving on so usually every
+	// lane is in the same pixel, in which case we can just sum the lanes together
+	const auto first = _mm256_permutevar8x32_epi32(idx, _mm256_set1_epi32(_tzcnt_u32(write_mask)));
+	const auto same = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(idx, first)));
+	if ((same & write_mask) == write_mask){
+		const int i = _mm256_extract_epi32(first, 0);
+		Pixel &px = pixels[i];
+		const auto zerof = _mm256_setzero_ps();
+		px.r += hsum(_mm256_blendv_ps(zerof, c.r, mask));
+		px.g += hsum(_mm256_blendv_ps(zerof, c.g, mask));
+		px.b += hsum(_mm256_blendv_ps(zerof, c.b, mask));
+		px.weight += _mm_popcnt_u32(write_mask);
+		lum_sq[i] += hsum(_mm256_blendv_ps(zerof, sq, mask));
+		return;
+	}
+	CACHE_ALIGN int32_t indices[8];
+	_mm256_store_si256((__m256i*)indices, idx);
+	const auto *cr = (const float*)&c.r;
+	const auto *cg = (const float*)&c.g;
+	const auto *cb = (const float*)&c.b;
+	const auto *csq = (const float*)&sq;
+	for (int i = 0; i < 8; ++i){
+		if (write_mask & (1 << i)){
+			Pixel &px = pixels[indices[i]];
+			px.r += cr[i];
+			px.g += cg[i];
+			px.b += cb[i];
+			px.weight += 1;
+			lum_sq[indices[i]] += csq[i];
+		}
+	}
+}
+
+void RenderTile::write_aovs(const Vec2f_8 &p, __m256 depth, const DiffGeom8 &dg, __m256 mask,
+		const std::vector<std::shared_ptr<Material>> &materials)
+{
+	const auto write_mask = _mm256_movemask_ps(mask);
+	if (write_mask == 0 || !has_aovs()){
+		return;
+	}
+	CACHE_ALIGN float px[8], py[8], d[8], nx[8], ny[8], nz[8];
+	CACHE_ALIGN int32_t ids[8];
+	_mm256_store_ps(px, p.x);
+	_mm256_store_ps(py, p.y);
+	_mm256_store_ps(d, depth);
+	_mm256_store_ps(nx, dg.normal.x);
+	_mm256_store_ps(ny, dg.normal.y);
+	_mm256_store_ps(nz, dg.normal.z);
+	_mm256_store_si256((__m256i*)ids, dg.material_id);
+	const int dim = static_cast<int>(block_dim);
+	for (int i = 0; i < 8; ++i){
+		if (!(write_mask & (1 << i))){
+			continue;
+		}
+		const int x = clamp(static_cast<int>(px[i]) - static_cast<int>(start.first), 0, dim - 1);
+		const int y = clamp(static_cast<int>(py[i]) - static_cast<int>(start.second), 0, dim - 1);
+		float *v = &aov_values[(y * dim + x) * aovs.size()];
+		if (aovs.enabled(AOV::DEPTH)){
+			v[aovs.offset(AOV::DEPTH)] += d[i];
+		}
+		if (aovs.enabled(AOV::NORMAL)){
+			float *n = v + aovs.offset(AOV::NORMAL);
+			n[0] += nx[i];
+			n[1] += ny[i];
+			n[2] += nz[i];
+		}
+		const bool valid_id = ids[i] >= 0 && ids[i] < static_cast<int32_t>(materials.size());
+		if (aovs.enabled(AOV::ALBEDO) && valid_id){
+			const auto albedo = materials[ids[i]]->albedo();
+			float *a = v + aovs.offset(AOV::ALBEDO);
+			a[0] += albedo.r;
+			a[1] += albedo.g;
+			a[2] += albedo.b;
+		}
+		if (aovs.enabled(AOV::MATERIAL_ID)){
+			v[aovs.offset(AOV::MATERIAL_ID)] = static_cast<float>(ids[i]);
+		}
+	}
+}
+
+void RenderTile::write_cost(const Vec2f_8 &p, float cost, __m256 mask){
+	const auto write_mask = _mm256_movemask_ps(mask);
+	if (write_mask == 0 || !has_cost()){
+		return;
+	}
+	CACHE_ALIGN float px[8], py[8];
+	_mm256_store_ps(px, p.x);
+	_mm256_store_ps(py, p.y);
+	const int dim = static_cast<int>(block_dim);
+	const int offset = aovs.offset(AOV::COST);
+	for (int i = 0; i < 8; ++i){
+		if (write_mask & (1 << i)){
+			const int x = clamp(static_cast<int>(px[i]) - static_cast<int>(start.first), 0, dim - 1);
+			const int y = clamp(static_cast<int>(py[i]) - static_cast<int>(start.second), 0, dim - 1);
+			aov_values[(y * dim + x) * aovs.size() + offset] += cost;
+		}
+	}
+}
+
+RenderTarget::RenderTarget(uint32_t width, uint32_t height, const AOVLayout &aovs)
+	: width(width), height(height), pixels(width * height), lum_sq(width * height), aovs(aovs),
+	aov_values(size_t{width} * height * aovs.size())
+{
+	clear_aovs(aovs, aov_values.data(), pixels.size());
+}
 void RenderTarget::write_samples(const Vec2f_8 &p, const Colorf_8 &c, __m256 mask){
-	// Compute the discrete pixel coordinates which the sample hits
-	const auto img_p = p - Vec2f_8{0.5};
-	const auto *img_x = (const float*)&img_p.x;
-	const auto *img_y = (const float*)&img_p.y;
+	// Compute the discrete pixel coordinates which the sample hits, pixel
+	// x covers [x, x + 1) so we just truncate the sample position
+	const auto *img_x = (const float*)&p.x;
+	const auto *img_y = (const float*)&p.y;
 	const auto *cr = (const float*)&c.r;
 	const auto *cg = (const float*)&c.g;
 	const auto *cb = (const float*)&c.b;
+	const auto lum = c.luminance();
+	const auto sq = _mm256_mul_ps(lum, lum);
+	const auto *csq = (const float*)&sq;
 	const auto write_mask = _mm256_movemask_ps(mask);
 	for (int i = 0, mask = 1; i < 8; ++i, mask <<= 1){
 		if (write_mask & mask){
@@ -59,37 +259,135 @@ void RenderTarget::write_samples(const Vec2f_8 &p, const Colorf_8 &c, __m256 mas
 			p.g += cg[i];
 			p.b += cb[i];
 			p.weight += 1;
+			lum_sq[iy * width + ix] += csq[i];
 		}
 	}
 }
-bool RenderTarget::save_image(const std::string &file) const {
+void RenderTarget::write_tile(const RenderTile &tile){
+	const uint32_t x_end = std::min(tile.start.first + tile.block_dim, width);
+	const uint32_t y_end = std::min(tile.start.second + tile.block_dim, height);
+	for (uint32_t y = tile.start.second; y < y_end; ++y){
+		const Pixel *src = &tile.pixels[(y - tile.start.second) * tile.block_dim];
+		Pixel *dst = &pixels[y * width + tile.start.first];
+		const float *src_sq = &tile.lum_sq[(y - tile.start.second) * tile.block_dim];
+		float *dst_sq = &lum_sq[y * width + tile.start.first];
+		for (uint32_t x = 0; x < x_end - tile.start.first; ++x){
+			// Pixel is 4 floats so we can just add the whole thing at once
+			const auto a = _mm_loadu_ps(&dst[x].r);
+			const auto b = _mm_load_ps(&src[x].r);
+			_mm_storeu_ps(&dst[x].r, _mm_add_ps(a, b));
+			dst_sq[x] += src_sq[x];
+		}
+		if (tile.has_aovs()){
+			add_aovs(aovs, &tile.aov_values[(y - tile.start.second) * tile.block_dim * aovs.size()],
+					&aov_values[(size_t{y} * width + tile.start.first) * aovs.size()], x_end - tile.start.first);
+		}
+	}
+}
+bool RenderTarget::save_image(const std::string &file, const ResolveParams &params, ThreadPool *pool) const {
 	// Compute the correct image from the saved pixel data and write
 	// it to the desired file
 	std::string file_ext = file.substr(file.rfind(".") + 1);
 	if (file_ext == "ppm"){
-		std::vector<Color24> img(width * height);
-		get_colorbuf(img);
-		return save_ppm(file, &img[0].r);
+		std::vector<uint8_t> img(3 * width * height);
+		resolve(img.data(), 3 * width, false, ResolveParams{params.exposure, params.tonemap, false}, pool);
+		return save_ppm(file, img.data());
 	}
 	if (file_ext == "bmp"){
-		std::vector<Color24> img(width * height);
-		get_colorbuf(img);
-		//Do y-flip for BMP since BMP starts at the bottom-left
-		for (uint32_t y = 0; y < height / 2; ++y){
-			Color24 *a = &img[y * width];
-			Color24 *b = &img[(height - y - 1) * width];
+		// BMP wants BGR rows starting at the bottom-left, each padded to 4 bytes
+		const size_t row_stride = (3 * width + 3) & ~size_t{3};
+		std::vector<uint8_t> img(row_stride * height);
+		resolve(img.data(), row_stride, true, ResolveParams{params.exposure, params.tonemap, true}, pool);
+		return save_bmp(file, img.data());
+	}
+	std::cout << "Unsupported output image format: " << file_ext << std::endl;
+	return false;
+}
+bool RenderTarget::save_aovs(const std::string &prefix) const {
+	for (int i = 0; i < static_cast<int>(AOV::COUNT); ++i){
+		const auto aov = static_cast<AOV>(i);
+		if (!aovs.enabled(aov)){
+			continue;
+		}
+		const uint32_t channels = AOVLayout::channels(aov);
+		const std::string file = prefix + "_" + AOVLayout::name(aov) + ".pfm";
+		// A negative scale marks the floats as little endian
+		const std::string header = std::string{channels == 3 ? "PF" : "Pf"} + "\n" + std::to_string(width)
+			+ " " + std::to_string(height) + "\n-1.0\n";
+		const size_t row_size = sizeof(float) * channels * width;
+		MappedFile mapped;
+		if (!mapped.create(file, header.size() + row_size * height)){
+			return false;
+		}
+		std::memcpy(mapped.data(), header.data(), header.size());
+		const int offset = aovs.offset(aov);
+		const bool average = aov != AOV::MATERIAL_ID;
+		// PFM rows run from the bottom of the image to the top. The header leaves the
+		// floats unaligned so they're copied in instead of stored through a float pointer
+		for (uint32_t y = 0; y < height; ++y){
+			uint8_t *row = mapped.data() + header.size() + row_size * (height - y - 1);
 			for (uint32_t x = 0; x < width; ++x){
-				std::swap(a[x], b[x]);
+				const size_t px = size_t{y} * width + x;
+				const float *v = &aov_values[px * aovs.size() + offset];
+				const float scale = average && pixels[px].weight > 0 ? 1.f / pixels[px].weight : 1.f;
+				for (uint32_t c = 0; c < channels; ++c){
+					const float value = v[c] * scale;
+					std::memcpy(row + sizeof(float) * (x * channels + c), &value, sizeof(float));
+				}
 			}
 		}
-		// We also need to convert to BGRA order for BMP
-		for (auto &c : img){
-			std::swap(c.r, c.b);
+	}
+	return true;
+}
+void RenderTarget::resolve(uint8_t *out, size_t row_stride, bool flip, const ResolveParams &params,
+		ThreadPool *pool) const
+{
+	const auto &k = kernels();
+	auto resolve_rows = [&](uint32_t begin, uint32_t end){
+		for (uint32_t y = begin; y < end; ++y){
+			uint8_t *row = out + row_stride * (flip ? height - y - 1 : y);
+			k.resolve(&pixels[y * width], row, width, params);
+		}
+	};
+	if (!pool || pool->size() < 2){
+		resolve_rows(0, height);
+		return;
+	}
+	// Workers take chunks of rows until they run out
+	const uint32_t chunk = 16;
+	std::atomic<uint32_t> next_row{0};
+	pool->run([&](uint32_t){
+		for (uint32_t y = next_row.fetch_add(chunk); y < height; y = next_row.fetch_add(chunk)){
+			resolve_rows(y, std::min(y + chunk, height));
 		}
-		return save_bmp(file, &img[0].r);
+	});
+}
+uint32_t RenderTarget::find_unconverged(float threshold, std::vector<uint8_t> &active) const {
+	active.resize(width * height);
+	uint32_t n_active = 0;
+	for (size_t i = 0; i < pixels.size(); ++i){
+		const Pixel &p = pixels[i];
+		bool converged = false;
+		if (p.weight > 1){
+			const float mean = Colorf{p.r, p.g, p.b}.luminance() / p.weight;
+			// Sample variance of the luminance, the error is the standard error of the mean.
+			// The relative error blows up for nearly black pixels, so it's measured against
+			// a small floor instead
+			const float variance = std::max(0.f, lum_sq[i] / p.weight - mean * mean) * p.weight / (p.weight - 1);
+			const float error = std::sqrt(variance / p.weight) / std::max(mean, 0.01f);
+			converged = error <= threshold;
+		}
+		active[i] = converged ? 0 : 1;
+		n_active += active[i];
 	}
-	std::cout << "Unsupported output image format: " << file_ext << std::endl;
-	return false;
+	return n_active;
+}
+uint64_t RenderTarget::sample_count() const {
+	double n = 0;
+	for (const auto &p : pixels){
+		n += p.weight;
+	}
+	return static_cast<uint64_t>(n);
 }
 uint32_t RenderTarget::get_width() const {
 	return width;
@@ -97,20 +395,13 @@ uint32_t RenderTarget::get_width() const {
 uint32_t RenderTarget::get_height() const {
 	return height;
 }
+const AOVLayout& RenderTarget::get_aovs() const {
+	return aovs;
+}
 void RenderTarget::get_colorbuf(std::vector<Color24> &img) const { 
 	// Compute the correct image from the saved pixel data
 	img.resize(width * height);
-	for (uint32_t y = 0; y < height; ++y){
-		for (uint32_t x = 0; x < width; ++x){
-			const Pixel &p = pixels[y * width + x];
-			if (p.weight != 0){
-				Colorf c{p.r, p.g, p.b};
-				c /= p.weight;
-				c.normalize();
-				img[y * width + x] = c.to_sRGB();
-			}
-		}
-	}
+	resolve(&img[0].r, 3 * width, false, ResolveParams{});
 }
 bool RenderTarget::save_ppm(const std::string &file, const uint8_t *data) const {
 	FILE *fp = fopen(file.c_str(), "wb");
@@ -134,29 +425,152 @@ bool RenderTarget::save_bmp(const std::string &file, const uint8_t *data) const
 			<< file << std::endl;
 		return false;
 	}
-	uint32_t w = width, h = height;
-	BMPHeader bmp_header{4 * w * h, static_cast<int32_t>(w),
-		static_cast<int32_t>(h)};
-	if (fwrite(&bmp_header, sizeof(BMPHeader), 1, fp) != 1){
+	const size_t img_size = ((3 * width + 3) & ~size_t{3}) * height;
+	BMPHeader bmp_header{static_cast<uint32_t>(img_size), static_cast<int32_t>(width),
+		static_cast<int32_t>(height)};
+	if (fwrite(&bmp_header, sizeof(BMPHeader), 1, fp) != 1
+			|| fwrite(data, 1, img_size, fp) != img_size)
+	{
 		fclose(fp);
 		return false;
 	}
-	// Write each row follwed by any necessary padding
-	uint32_t padding = (w * 3) % 4;
-	for (uint32_t r = 0; r < h; ++r){
-		if (fwrite(data + 3 * w * r, 1, 3 * w, fp) != 3 * w){
-			fclose(fp);
+	fclose(fp);
+	return true;
+}
+
+StreamingTarget::StreamingTarget(uint32_t width, uint32_t height, uint32_t block_dim, const ResolveParams &params)
+	: width(width), height(height), block_dim(block_dim), params(params), blocks_per_band(width / block_dim),
+	full_bands(height / block_dim), bmp(false), row_stride(0), data_offset(0),
+	bands((height + block_dim - 1) / block_dim), resident(0), peak_resident(0), bands_written(0),
+	samples(0), write_failed(false)
+{}
+bool StreamingTarget::open(const std::string &file_name){
+	const std::string file_ext = file_name.substr(file_name.rfind(".") + 1);
+	std::string header;
+	if (file_ext == "ppm"){
+		row_stride = 3 * size_t{width};
+		header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+		params.bgr = false;
+	}
+	else if (file_ext == "bmp"){
+		bmp = true;
+		row_stride = (3 * size_t{width} + 3) & ~size_t{3};
+		const uint64_t img_size = uint64_t{row_stride} * height;
+		if (img_size + sizeof(BMPHeader) > std::numeric_limits<uint32_t>::max()){
+			std::cerr << "StreamingTarget::open Error: image is too big for a BMP, save it as a PPM\n";
 			return false;
 		}
-		if (padding != 0){
-			if (fwrite(data, 1, padding, fp) != padding){
-				fclose(fp);
-				return false;
-			}
-		}
-
+		BMPHeader bmp_header{static_cast<uint32_t>(img_size), static_cast<int32_t>(width),
+			static_cast<int32_t>(height)};
+		header.assign(reinterpret_cast<const char*>(&bmp_header), sizeof(BMPHeader));
+		params.bgr = true;
+	}
+	else {
+		std::cout << "Unsupported output image format: " << file_ext << std::endl;
+		return false;
+	}
+	data_offset = header.size();
+	file.open(file_name, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file){
+		std::cerr << "StreamingTarget::open Error: failed to open file " << file_name << std::endl;
+		return false;
+	}
+	file.write(header.data(), header.size());
+	// Size the file for the whole image up front so bands can be written
+	// in any order, the gaps read back as zeros until they're filled
+	const uint64_t file_size = data_offset + uint64_t{row_stride} * height;
+	file.seekp(static_cast<std::streamoff>(file_size - 1));
+	file.put(0);
+	if (!file){
+		std::cerr << "StreamingTarget::open Error: failed to write file " << file_name << std::endl;
+		return false;
 	}
-	fclose(fp);
 	return true;
 }
+void StreamingTarget::write_tile(const RenderTile &tile){
+	const uint32_t index = tile.start.second / block_dim;
+	Band *band = nullptr;
+	{
+		std::lock_guard<std::mutex> lock{band_mutex};
+		if (!bands[index]){
+			bands[index].reset(new Band{std::vector<Pixel>(size_t{width} * block_dim), 0});
+			++resident;
+			peak_resident = std::max(peak_resident, resident);
+		}
+		band = bands[index].get();
+	}
+	// Blocks don't overlap so tiles can be added to the band without holding the lock
+	const uint32_t x_end = std::min(tile.start.first + tile.block_dim, width);
+	const uint32_t y_end = std::min(tile.start.second + tile.block_dim, height);
+	float weight = 0;
+	for (uint32_t y = tile.start.second; y < y_end; ++y){
+		const Pixel *src = &tile.pixels[(y - tile.start.second) * tile.block_dim];
+		Pixel *dst = &band->pixels[size_t{y - index * block_dim} * width + tile.start.first];
+		for (uint32_t x = 0; x < x_end - tile.start.first; ++x){
+			const auto a = _mm_loadu_ps(&dst[x].r);
+			const auto b = _mm_load_ps(&src[x].r);
+			_mm_storeu_ps(&dst[x].r, _mm_add_ps(a, b));
+			weight += src[x].weight;
+		}
+	}
+	samples.fetch_add(static_cast<uint64_t>(weight), std::memory_order_relaxed);
+	// The thread adding the band's last block writes it out, the lock makes sure
+	// it sees the pixels the other threads added
+	std::unique_ptr<Band> finished;
+	{
+		std::lock_guard<std::mutex> lock{band_mutex};
+		if (++band->blocks_done == blocks_per_band){
+			finished = std::move(bands[index]);
+			--resident;
+		}
+	}
+	if (finished){
+		write_band(index, *finished);
+	}
+}
+bool StreamingTarget::close(){
+	bool ok = !write_failed;
+	if (bands_written != full_bands){
+		std::cerr << "StreamingTarget::close Error: " << full_bands - bands_written
+			<< " bands weren't finished\n";
+		ok = false;
+	}
+	file.close();
+	return ok && !file.fail();
+}
+uint64_t StreamingTarget::sample_count() const {
+	return samples.load();
+}
+uint32_t StreamingTarget::get_peak_resident() const {
+	return peak_resident;
+}
+size_t StreamingTarget::band_size() const {
+	return sizeof(Pixel) * width * block_dim;
+}
+uint32_t StreamingTarget::get_width() const {
+	return width;
+}
+uint32_t StreamingTarget::get_height() const {
+	return height;
+}
+const AOVLayout& StreamingTarget::get_aovs() const {
+	return aovs;
+}
+void StreamingTarget::write_band(uint32_t index, const Band &band){
+	const uint32_t y_begin = index * block_dim;
+	const uint32_t rows = std::min(block_dim, height - y_begin);
+	// BMP rows run bottom to top so the band is stored flipped, either way
+	// its rows are contiguous in the file
+	std::vector<uint8_t> out(row_stride * rows, 0);
+	const auto &k = kernels();
+	for (uint32_t r = 0; r < rows; ++r){
+		k.resolve(&band.pixels[size_t{r} * width], &out[row_stride * (bmp ? rows - r - 1 : r)], width, params);
+	}
+	const uint64_t first_row = bmp ? height - y_begin - rows : y_begin;
+	std::lock_guard<std::mutex> lock{file_mutex};
+	file.seekp(static_cast<std::streamoff>(data_offset + first_row * row_stride));
+	file.write(reinterpret_cast<const char*>(out.data()), out.size());
+	write_failed = write_failed || !file;
+	++bands_written;
+}
 
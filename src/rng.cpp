@@ -0,0 +1,25 @@
+#include "rng.h"
+
+// SplitMix64, used to spread the seed out over the lanes' states and increments
+static uint64_t splitmix64(uint64_t &x){
+	uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+RNG::RNG(uint64_t seed){
+	for (int i = 0; i < LANES; ++i){
+		const uint64_t s = splitmix64(seed);
+		state[i] = static_cast<int32_t>(s);
+		// The increment must be odd for the generator to have a full period
+		inc[i] = static_cast<int32_t>((s >> 32) | 1);
+	}
+}
+uint32_t RNG::next_u32(){
+	const uint32_t old = static_cast<uint32_t>(state[0]);
+	state[0] = static_cast<int32_t>(old * 747796405u + static_cast<uint32_t>(inc[0]));
+	const uint32_t word = ((old >> ((old >> 28) + 4)) ^ old) * 277803737u;
+	return (word >> 22) ^ word;
+}
+
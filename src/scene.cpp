@@ -1,13 +1,91 @@
 #include "scene.h"
+#include "sphere.h"
+#include "plane.h"
+#include "counters.h"
 
-Scene::Scene(std::vector<std::shared_ptr<Geometry>> geom, std::vector<std::shared_ptr<Material>> mats, PointLight light)
-	: geometry(geom), materials(mats), light(light)
+Scene::Scene(std::vector<std::shared_ptr<Geometry>> geom, std::vector<std::shared_ptr<Material>> mats,
+		std::vector<Light> lights)
+	: Scene(SphereBatch{}, PlaneBatch{}, geom, mats, lights)
 {}
+Scene::Scene(SphereBatch sphere_batch, PlaneBatch plane_batch, std::vector<std::shared_ptr<Geometry>> geom,
+		std::vector<std::shared_ptr<Material>> mats, std::vector<Light> lights)
+	: materials(mats), lights(lights), spheres(std::move(sphere_batch)), planes(std::move(plane_batch))
+{
+	std::vector<BBox> bounds;
+	for (const auto &g : geom){
+		if (const auto *s = dynamic_cast<const Sphere*>(g.get())){
+			spheres.add(s->pos, s->radius, s->material_id);
+			continue;
+		}
+		if (const auto *p = dynamic_cast<const Plane*>(g.get())){
+			planes.add(p->pos, p->normal, p->material_id);
+			continue;
+		}
+		geometry.push_back(g);
+		const auto b = g->bounds();
+		if (b.is_finite()){
+			bounded.push_back(g.get());
+			bounds.push_back(b);
+		}
+		else {
+			unbounded.push_back(g.get());
+		}
+	}
+	spheres.build();
+	bvh = BVH{bounds};
+}
 __m256 Scene::intersect(Ray8 &rays, DiffGeom8 &dg) const {
-	__m256 hits = _mm256_set1_ps(0.f);
-	for (const auto &g : geometry){
+	PERF_COUNT(RAY_PACKETS, 1);
+	PERF_COUNT(RAY_SLOTS, 8);
+	PERF_COUNT(RAY_LANES, _mm_popcnt_u32(_mm256_movemask_ps(rays.active)));
+	const auto hits = intersect_geometry(rays, dg);
+	PERF_COUNT(RAY_HITS, _mm_popcnt_u32(_mm256_movemask_ps(_mm256_and_ps(hits, rays.active))));
+	return hits;
+}
+__m256 Scene::occluded(Ray8 &rays) const {
+	PERF_COUNT(SHADOW_PACKETS, 1);
+	PERF_COUNT(SHADOW_SLOTS, 8);
+	PERF_COUNT(SHADOW_RAYS, _mm_popcnt_u32(_mm256_movemask_ps(rays.active)));
+	const auto blocked = occluded_geometry(rays);
+	PERF_COUNT(SHADOW_BLOCKED, _mm_popcnt_u32(_mm256_movemask_ps(blocked)));
+	return blocked;
+}
+bool Scene::batches_only() const {
+	return geometry.empty();
+}
+BatchArrays Scene::batch_arrays() const {
+	return BatchArrays{spheres.arrays(), planes.arrays()};
+}
+__m256 Scene::intersect_geometry(Ray8 &rays, DiffGeom8 &dg) const {
+	auto hits = spheres.intersect(rays, dg);
+	hits = _mm256_or_ps(hits, planes.intersect(rays, dg));
+	hits = _mm256_or_ps(hits, bvh.intersect(rays,
+		[&](uint32_t i, Ray8 &r){
+			PERF_COUNT(PRIMITIVE_TESTS, 1);
+			return bounded[i]->intersect(r, dg);
+		}));
+	for (const auto &g : unbounded){
+		PERF_COUNT(PRIMITIVE_TESTS, 1);
 		hits = _mm256_or_ps(hits, g->intersect(rays, dg));
 	}
 	return hits;
 }
-
+__m256 Scene::occluded_geometry(Ray8 &rays) const {
+	// Planes are the cheapest to test so check them first
+	auto blocked = planes.occluded(rays);
+	blocked = _mm256_or_ps(blocked, spheres.occluded(rays));
+	blocked = _mm256_or_ps(blocked, bvh.occluded(rays,
+		[&](uint32_t i, Ray8 &r){
+			PERF_COUNT(PRIMITIVE_TESTS, 1);
+			return bounded[i]->occluded(r);
+		}));
+	for (const auto &g : unbounded){
+		if (_mm256_movemask_ps(rays.active) == 0){
+			break;
+		}
+		PERF_COUNT(PRIMITIVE_TESTS, 1);
+		blocked = _mm256_or_ps(blocked, g->occluded(rays));
+		rays.active = _mm256_andnot_ps(blocked, rays.active);
+	}
+	return blocked;
+}
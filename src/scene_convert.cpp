@@ -0,0 +1,68 @@
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include "scene.h"
+#include "scene_file.h"
+#include "mapped_file.h"
+#include "test_scene.h"
+#include "isa.h"
+
+/*
+ * Build one of the test scenes micro_packet can render, optionally with an OBJ
+ * model in place of the sphere, or load an existing scene file and save it as
+ * a binary scene file which micro_packet can map with --scene
+ */
+int main(int argc, char **argv){
+	// Building the scene uses the AVX2 BVH and geometry code
+	if (detect_isa() < ISA::AVX2){
+		std::cerr << "Error: micro_packet_convert requires a CPU with AVX2 and FMA support\n";
+		return 1;
+	}
+	TestSceneOptions options;
+	std::string in_file, out_file;
+	for (int i = 1; i < argc; ++i){
+		if (std::strcmp(argv[i], "--spheres") == 0 && i + 1 < argc){
+			options.n_spheres = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--lights") == 0 && i + 1 < argc){
+			options.n_lights = std::strtoul(argv[++i], nullptr, 10);
+		}
+		else if (std::strcmp(argv[i], "--whitted") == 0){
+			options.whitted = true;
+		}
+		else if (std::strcmp(argv[i], "--obj") == 0 && i + 1 < argc){
+			options.obj_file = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "--scene") == 0 && i + 1 < argc){
+			in_file = argv[++i];
+		}
+		else if (argv[i][0] != '-' && out_file.empty()){
+			out_file = argv[i];
+		}
+		else {
+			out_file.clear();
+			break;
+		}
+	}
+	if (out_file.empty()){
+		std::cout << "Usage: " << argv[0] << " [--spheres N] [--lights N] [--whitted] [--obj file.obj]"
+			<< " [--scene in.mps] out.mps\n";
+		return 1;
+	}
+	// The loaded scene is used in place from the mapping of its file, so it can't be overwritten
+	if (!in_file.empty() && same_file(in_file, out_file)){
+		std::cerr << "Error: can't save the scene over the file it's loaded from\n";
+		return 1;
+	}
+	SceneCamera camera = test_scene_camera();
+	const auto scene = in_file.empty() ? make_test_scene(options) : load_scene_file(in_file, camera);
+	if (!scene || !save_scene_file(out_file, *scene, camera)){
+		return 1;
+	}
+	std::cout << "Saved " << scene->spheres.size() << " spheres, " << scene->planes.size() << " planes, "
+		<< scene->geometry.size() << " meshes, " << scene->materials.size() << " materials and "
+		<< scene->lights.size() << " lights to " << out_file << "\n";
+	return 0;
+}
+
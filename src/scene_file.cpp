@@ -0,0 +1,355 @@
+#include <iostream>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include "scene.h"
+#include "triangle_mesh.h"
+#include "mapped_file.h"
+#include "scene_file.h"
+
+/*
+ * The array stored in a section when writing the file
+ */
+struct SectionData {
+	const void *data;
+	uint64_t count, elem_size;
+};
+
+template<typename T>
+static SectionData section_data(const T *data, size_t count){
+	return SectionData{data, count, sizeof(T)};
+}
+static uint64_t align_up(uint64_t x){
+	return (x + SCENE_FILE_ALIGN - 1) & ~(SCENE_FILE_ALIGN - 1);
+}
+static MaterialRecord make_material_record(const Material &material, bool &ok){
+	MaterialRecord record{MaterialType::LAMBERTIAN, {0, 0, 0}, 1};
+	Colorf color;
+	ok = true;
+	if (const auto *m = dynamic_cast<const LambertianMaterial*>(&material)){
+		color = m->color;
+	}
+	else if (const auto *m = dynamic_cast<const MirrorMaterial*>(&material)){
+		record.type = MaterialType::MIRROR;
+		color = m->color;
+	}
+	else if (const auto *m = dynamic_cast<const GlassMaterial*>(&material)){
+		record.type = MaterialType::GLASS;
+		color = m->color;
+		record.ior = m->ior;
+	}
+	else {
+		ok = false;
+	}
+	record.color[0] = color.r;
+	record.color[1] = color.g;
+	record.color[2] = color.b;
+	return record;
+}
+static BVHLimits bvh_limits(ArrayView<BVHNode> nodes, ArrayView<uint32_t> indices){
+	BVHLimits limits{0, 0, 0, 0};
+	// Nodes are stored depth first so each node's level is set before we reach it
+	std::vector<uint32_t> level(nodes.size(), 1);
+	for (uint32_t i = 0; i < nodes.size(); ++i){
+		const auto &node = nodes[i];
+		limits.depth = std::max(limits.depth, level[i]);
+		if (node.is_leaf()){
+			limits.max_leaf_end = std::max(limits.max_leaf_end, node.offset + node.count);
+			continue;
+		}
+		limits.max_child = std::max(limits.max_child, std::max(i + 1, node.offset));
+		level[i + 1] = level[i] + 1;
+		level[node.offset] = level[i] + 1;
+	}
+	for (const auto &i : indices){
+		limits.max_primitive = std::max(limits.max_primitive, i);
+	}
+	return limits;
+}
+/*
+ * Check the BVH's limits against the sizes of the arrays it indexes and
+ * that traversal's stack is deep enough for it
+ */
+static bool bvh_limits_valid(const BVHLimits &limits, uint64_t n_nodes, uint64_t n_indices, uint64_t n_primitives){
+	if (n_nodes == 0){
+		return n_indices == 0;
+	}
+	return limits.max_child < n_nodes && limits.max_leaf_end <= n_indices
+		&& limits.max_primitive < n_primitives && limits.depth <= BVH_STACK_SIZE;
+}
+static LightRecord make_light_record(const Light &light){
+	return LightRecord{light.type, {light.pos.x, light.pos.y, light.pos.z}, {light.u.x, light.u.y, light.u.z},
+		{light.v.x, light.v.y, light.v.z}, light.radius, {light.emission.r, light.emission.g, light.emission.b}};
+}
+
+bool save_scene_file(const std::string &file, const Scene &scene, const SceneCamera &camera){
+	// The meshes' arrays are stored one after the other in the mesh sections
+	std::vector<MeshRecord> meshes;
+	std::vector<Vec3f> mesh_vertices, mesh_normals;
+	std::vector<uint32_t> mesh_indices, mesh_bvh_indices;
+	std::vector<BVHNode> mesh_nodes;
+	for (const auto &g : scene.geometry){
+		const auto *mesh = dynamic_cast<const TriangleMesh*>(g.get());
+		if (!mesh){
+			std::cerr << "save_scene_file Error: only spheres, planes and triangle meshes can be stored"
+				<< " in scene files\n";
+			return false;
+		}
+		const auto nodes = mesh->bvh.get_nodes();
+		const auto indices = mesh->bvh.get_indices();
+		MeshRecord record{mesh_vertices.size(), mesh->vertices.size(), mesh_indices.size(), mesh->indices.size(),
+			mesh_nodes.size(), nodes.size(), mesh_bvh_indices.size(), indices.size(), bvh_limits(nodes, indices),
+			0, mesh->material_id};
+		for (const auto &i : mesh->indices){
+			record.max_vertex = std::max(record.max_vertex, i);
+		}
+		meshes.push_back(record);
+		mesh_vertices.insert(mesh_vertices.end(), mesh->vertices.begin(), mesh->vertices.end());
+		mesh_normals.insert(mesh_normals.end(), mesh->normals.begin(), mesh->normals.end());
+		mesh_indices.insert(mesh_indices.end(), mesh->indices.begin(), mesh->indices.end());
+		mesh_nodes.insert(mesh_nodes.end(), nodes.begin(), nodes.end());
+		mesh_bvh_indices.insert(mesh_bvh_indices.end(), indices.begin(), indices.end());
+	}
+	std::vector<MaterialRecord> materials;
+	for (const auto &m : scene.materials){
+		bool ok = false;
+		materials.push_back(make_material_record(*m, ok));
+		if (!ok){
+			std::cerr << "save_scene_file Error: material " << materials.size() - 1
+				<< " is of a type that can't be stored in scene files\n";
+			return false;
+		}
+	}
+	std::vector<LightRecord> lights;
+	for (size_t i = 0; i < scene.lights.size(); ++i){
+		lights.push_back(make_light_record(scene.lights.get(i)));
+	}
+	const auto &s = scene.spheres;
+	const auto &p = scene.planes;
+	const auto nodes = s.bvh.get_nodes();
+	const auto indices = s.bvh.get_indices();
+	const SectionData sections[] = {
+		section_data(s.x.data(), s.size()), section_data(s.y.data(), s.size()),
+		section_data(s.z.data(), s.size()), section_data(s.radius.data(), s.size()),
+		section_data(s.material_id.data(), s.size()),
+		section_data(nodes.data(), nodes.size()), section_data(indices.data(), indices.size()),
+		section_data(p.x.data(), p.size()), section_data(p.y.data(), p.size()),
+		section_data(p.z.data(), p.size()), section_data(p.nx.data(), p.size()),
+		section_data(p.ny.data(), p.size()), section_data(p.nz.data(), p.size()),
+		section_data(p.material_id.data(), p.size()),
+		section_data(meshes.data(), meshes.size()),
+		section_data(mesh_vertices.data(), mesh_vertices.size()),
+		section_data(mesh_normals.data(), mesh_normals.size()),
+		section_data(mesh_indices.data(), mesh_indices.size()),
+		section_data(mesh_nodes.data(), mesh_nodes.size()),
+		section_data(mesh_bvh_indices.data(), mesh_bvh_indices.size()),
+		section_data(materials.data(), materials.size()),
+		section_data(lights.data(), lights.size())
+	};
+	static_assert(sizeof(sections) / sizeof(SectionData) == static_cast<size_t>(SceneSection::COUNT),
+			"A section is missing from the scene file writer");
+
+	SceneFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.n_sections = static_cast<uint32_t>(SceneSection::COUNT);
+	const Vec3f *cam[] = {&camera.pos, &camera.center, &camera.up};
+	float *out[] = {header.camera_pos, header.camera_center, header.camera_up};
+	for (int i = 0; i < 3; ++i){
+		for (int j = 0; j < 3; ++j){
+			out[i][j] = (*cam[i])[j];
+		}
+	}
+	header.camera_fovy = camera.fovy;
+	header.min_material = std::numeric_limits<int32_t>::max();
+	header.max_material = std::numeric_limits<int32_t>::min();
+	for (const auto *ids : {&s.material_id, &p.material_id}){
+		for (const auto &id : *ids){
+			header.min_material = std::min(header.min_material, id);
+			header.max_material = std::max(header.max_material, id);
+		}
+	}
+	header.sphere_bvh = bvh_limits(nodes, indices);
+	uint64_t offset = align_up(sizeof(SceneFileHeader));
+	for (size_t i = 0; i < static_cast<size_t>(SceneSection::COUNT); ++i){
+		header.sections[i] = SceneFileSection{offset, sections[i].count};
+		offset = align_up(offset + sections[i].count * sections[i].elem_size);
+	}
+	header.file_size = offset;
+
+	// Write the file through a mapping so the arrays are copied straight into it
+	MappedFile mapped;
+	if (!mapped.create(file, header.file_size)){
+		return false;
+	}
+	std::memset(mapped.data(), 0, mapped.size());
+	std::memcpy(mapped.data(), &header, sizeof(header));
+	for (size_t i = 0; i < static_cast<size_t>(SceneSection::COUNT); ++i){
+		if (sections[i].count > 0){
+			std::memcpy(mapped.data() + header.sections[i].offset, sections[i].data,
+					sections[i].count * sections[i].elem_size);
+		}
+	}
+	return true;
+}
+
+/*
+ * Views of the sections of a mapped scene file, checking that the sections
+ * lie within the file
+ */
+class SceneFileReader {
+	const MappedFile &file;
+	const SceneFileHeader &header;
+
+public:
+	bool valid;
+
+	SceneFileReader(const MappedFile &file)
+		: file(file), header(*reinterpret_cast<const SceneFileHeader*>(file.data())), valid(true)
+	{}
+	template<typename T>
+	ArrayView<T> section(SceneSection s){
+		const auto &sec = header.sections[static_cast<size_t>(s)];
+		if (sec.offset % SCENE_FILE_ALIGN != 0 || sec.offset > file.size()
+				|| sec.count > (file.size() - sec.offset) / sizeof(T))
+		{
+			valid = false;
+			return ArrayView<T>{};
+		}
+		return ArrayView<T>{reinterpret_cast<const T*>(file.data() + sec.offset), sec.count};
+	}
+};
+
+std::unique_ptr<Scene> load_scene_file(const std::string &file, SceneCamera &camera){
+	auto mapped = std::unique_ptr<MappedFile>{new MappedFile};
+	if (!mapped->open(file)){
+		return nullptr;
+	}
+	const auto *header = reinterpret_cast<const SceneFileHeader*>(mapped->data());
+	if (mapped->size() < sizeof(SceneFileHeader)
+			|| std::memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)) != 0)
+	{
+		std::cerr << "load_scene_file Error: " << file << " is not a scene file\n";
+		return nullptr;
+	}
+	if (header->version != SCENE_FILE_VERSION || header->n_sections != static_cast<uint32_t>(SceneSection::COUNT)){
+		std::cerr << "load_scene_file Error: " << file << " is version " << header->version
+			<< " but only version " << SCENE_FILE_VERSION << " is supported\n";
+		return nullptr;
+	}
+	if (header->file_size != mapped->size()){
+		std::cerr << "load_scene_file Error: " << file << " is truncated\n";
+		return nullptr;
+	}
+	SceneFileReader reader{*mapped};
+	const auto sx = reader.section<float>(SceneSection::SPHERE_X);
+	const auto sy = reader.section<float>(SceneSection::SPHERE_Y);
+	const auto sz = reader.section<float>(SceneSection::SPHERE_Z);
+	const auto radius = reader.section<float>(SceneSection::SPHERE_RADIUS);
+	const auto sphere_material = reader.section<int32_t>(SceneSection::SPHERE_MATERIAL);
+	const auto nodes = reader.section<BVHNode>(SceneSection::SPHERE_BVH_NODES);
+	const auto indices = reader.section<uint32_t>(SceneSection::SPHERE_BVH_INDICES);
+	const auto px = reader.section<float>(SceneSection::PLANE_X);
+	const auto py = reader.section<float>(SceneSection::PLANE_Y);
+	const auto pz = reader.section<float>(SceneSection::PLANE_Z);
+	const auto nx = reader.section<float>(SceneSection::PLANE_NX);
+	const auto ny = reader.section<float>(SceneSection::PLANE_NY);
+	const auto nz = reader.section<float>(SceneSection::PLANE_NZ);
+	const auto plane_material = reader.section<int32_t>(SceneSection::PLANE_MATERIAL);
+	const auto mesh_records = reader.section<MeshRecord>(SceneSection::MESHES);
+	const auto mesh_vertices = reader.section<Vec3f>(SceneSection::MESH_VERTICES);
+	const auto mesh_normals = reader.section<Vec3f>(SceneSection::MESH_NORMALS);
+	const auto mesh_indices = reader.section<uint32_t>(SceneSection::MESH_INDICES);
+	const auto mesh_nodes = reader.section<BVHNode>(SceneSection::MESH_BVH_NODES);
+	const auto mesh_bvh_indices = reader.section<uint32_t>(SceneSection::MESH_BVH_INDICES);
+	const auto material_records = reader.section<MaterialRecord>(SceneSection::MATERIALS);
+	const auto light_records = reader.section<LightRecord>(SceneSection::LIGHTS);
+	const size_t n_spheres = sx.size();
+	const size_t n_planes = px.size();
+	const bool spheres_valid = sy.size() == n_spheres && sz.size() == n_spheres && radius.size() == n_spheres
+		&& sphere_material.size() == n_spheres && indices.size() == n_spheres
+		&& bvh_limits_valid(header->sphere_bvh, nodes.size(), indices.size(), n_spheres);
+	const bool planes_valid = py.size() == n_planes && pz.size() == n_planes && nx.size() == n_planes
+		&& ny.size() == n_planes && nz.size() == n_planes && plane_material.size() == n_planes;
+	if (!reader.valid || !spheres_valid || !planes_valid || mesh_normals.size() != mesh_vertices.size()){
+		std::cerr << "load_scene_file Error: " << file << " has invalid sections\n";
+		return nullptr;
+	}
+	const int64_t n_materials = static_cast<int64_t>(material_records.size());
+	if (n_spheres + n_planes > 0 && (header->min_material < 0 || header->min_material > header->max_material
+			|| header->max_material >= n_materials))
+	{
+		std::cerr << "load_scene_file Error: " << file << " has material ids out of range\n";
+		return nullptr;
+	}
+
+	std::vector<std::shared_ptr<Material>> materials;
+	for (const auto &m : material_records){
+		const auto color = Colorf{m.color[0], m.color[1], m.color[2]};
+		switch (m.type){
+			case MaterialType::LAMBERTIAN:
+				materials.push_back(std::make_shared<LambertianMaterial>(color));
+				break;
+			case MaterialType::MIRROR:
+				materials.push_back(std::make_shared<MirrorMaterial>(color));
+				break;
+			case MaterialType::GLASS:
+				materials.push_back(std::make_shared<GlassMaterial>(color, m.ior));
+				break;
+			default:
+				std::cerr << "load_scene_file Error: " << file << " has an unknown material type\n";
+				return nullptr;
+		}
+	}
+	// The light tree is small next to the geometry so it's cheaper to rebuild
+	// it than to store its node arrays
+	std::vector<Light> lights;
+	for (const auto &l : light_records){
+		if (l.type != LightType::POINT && l.type != LightType::SPHERE && l.type != LightType::QUAD){
+			std::cerr << "load_scene_file Error: " << file << " has an unknown light type\n";
+			return nullptr;
+		}
+		lights.push_back(Light{l.type, Vec3f{l.pos[0], l.pos[1], l.pos[2]}, Vec3f{l.u[0], l.u[1], l.u[2]},
+				Vec3f{l.v[0], l.v[1], l.v[2]}, l.radius, Colorf{l.emission[0], l.emission[1], l.emission[2]}});
+	}
+	// Check the meshes' ranges lie within the mesh sections
+	auto in_section = [](uint64_t first, uint64_t n, uint64_t size){
+		return n <= size && first <= size - n;
+	};
+	std::vector<std::shared_ptr<Geometry>> meshes;
+	for (const auto &m : mesh_records){
+		const bool valid = in_section(m.first_vertex, m.n_vertices, mesh_vertices.size())
+			&& in_section(m.first_index, m.n_indices, mesh_indices.size())
+			&& in_section(m.first_node, m.n_nodes, mesh_nodes.size())
+			&& in_section(m.first_bvh_index, m.n_bvh_indices, mesh_bvh_indices.size())
+			&& m.n_indices % 3 == 0 && (m.n_indices == 0 || m.max_vertex < m.n_vertices)
+			&& bvh_limits_valid(m.bvh, m.n_nodes, m.n_bvh_indices, m.n_indices / 3)
+			&& m.material_id >= 0 && m.material_id < n_materials;
+		if (!valid){
+			std::cerr << "load_scene_file Error: " << file << " has an invalid mesh\n";
+			return nullptr;
+		}
+		meshes.push_back(std::make_shared<TriangleMesh>(
+			ArrayView<Vec3f>{mesh_vertices.data() + m.first_vertex, m.n_vertices},
+			ArrayView<Vec3f>{mesh_normals.data() + m.first_vertex, m.n_vertices},
+			ArrayView<uint32_t>{mesh_indices.data() + m.first_index, m.n_indices},
+			m.material_id,
+			BVH{ArrayView<BVHNode>{mesh_nodes.data() + m.first_node, m.n_nodes},
+				ArrayView<uint32_t>{mesh_bvh_indices.data() + m.first_bvh_index, m.n_bvh_indices}}));
+	}
+	camera = SceneCamera{Vec3f{header->camera_pos[0], header->camera_pos[1], header->camera_pos[2]},
+		Vec3f{header->camera_center[0], header->camera_center[1], header->camera_center[2]},
+		Vec3f{header->camera_up[0], header->camera_up[1], header->camera_up[2]}, header->camera_fovy};
+
+	auto scene = std::unique_ptr<Scene>{new Scene{
+		SphereBatch{sx, sy, sz, radius, sphere_material, BVH{nodes, indices}},
+		PlaneBatch{px, py, pz, nx, ny, nz, plane_material},
+		meshes,
+		materials,
+		lights
+	}};
+	scene->file = std::move(mapped);
+	return scene;
+}
+
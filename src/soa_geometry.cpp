@@ -0,0 +1,102 @@
+#include "soa_geometry.h"
+
+SphereBatch::SphereBatch() : dirty(false){}
+SphereBatch::SphereBatch(ArrayView<float> x, ArrayView<float> y, ArrayView<float> z, ArrayView<float> radius,
+		ArrayView<int32_t> material_id, BVH bvh)
+	: x(x), y(y), z(z), radius(radius), material_id(material_id), bvh(std::move(bvh)), dirty(false)
+{}
+void SphereBatch::add(const Vec3f &pos, float r, int material){
+	x_store.push_back(pos.x);
+	y_store.push_back(pos.y);
+	z_store.push_back(pos.z);
+	radius_store.push_back(r);
+	material_store.push_back(material);
+	view_storage();
+	dirty = true;
+}
+void SphereBatch::build(){
+	if (!dirty){
+		return;
+	}
+	dirty = false;
+	std::vector<BBox> bounds(size());
+	for (size_t i = 0; i < size(); ++i){
+		const auto p = Vec3f{x[i], y[i], z[i]};
+		const auto r = Vec3f{radius[i], radius[i], radius[i]};
+		bounds[i] = BBox{p - r, p + r};
+	}
+	bvh = BVH{bounds};
+	// Sort the spheres into the order the BVH references them, after which
+	// the leaves can reference the spheres by their position in the arrays
+	const auto order = bvh.get_indices();
+	auto reorder = [&](auto &v){
+		auto sorted = v;
+		for (size_t i = 0; i < order.size(); ++i){
+			sorted[i] = v[order[i]];
+		}
+		v = std::move(sorted);
+	};
+	reorder(x_store);
+	reorder(y_store);
+	reorder(z_store);
+	reorder(radius_store);
+	reorder(material_store);
+	view_storage();
+	bvh.renumber_primitives();
+}
+__m256 SphereBatch::intersect(Ray8 &ray, DiffGeom8 &dg) const {
+	return intersect_spheres(arrays(), ray, dg);
+}
+__m256 SphereBatch::occluded(Ray8 &ray) const {
+	return occluded_spheres(arrays(), ray);
+}
+size_t SphereBatch::size() const {
+	return x.size();
+}
+SphereArrays SphereBatch::arrays() const {
+	return SphereArrays{x.data(), y.data(), z.data(), radius.data(), material_id.data(), bvh.arrays()};
+}
+void SphereBatch::view_storage(){
+	x = x_store;
+	y = y_store;
+	z = z_store;
+	radius = radius_store;
+	material_id = material_store;
+}
+
+PlaneBatch::PlaneBatch(){}
+PlaneBatch::PlaneBatch(ArrayView<float> x, ArrayView<float> y, ArrayView<float> z, ArrayView<float> nx,
+		ArrayView<float> ny, ArrayView<float> nz, ArrayView<int32_t> material_id)
+	: x(x), y(y), z(z), nx(nx), ny(ny), nz(nz), material_id(material_id)
+{}
+void PlaneBatch::add(const Vec3f &pos, const Vec3f &normal, int material){
+	const auto n = normal.normalized();
+	x_store.push_back(pos.x);
+	y_store.push_back(pos.y);
+	z_store.push_back(pos.z);
+	nx_store.push_back(n.x);
+	ny_store.push_back(n.y);
+	nz_store.push_back(n.z);
+	material_store.push_back(material);
+	x = x_store;
+	y = y_store;
+	z = z_store;
+	nx = nx_store;
+	ny = ny_store;
+	nz = nz_store;
+	material_id = material_store;
+}
+__m256 PlaneBatch::intersect(Ray8 &ray, DiffGeom8 &dg) const {
+	return intersect_planes(arrays(), ray, dg);
+}
+__m256 PlaneBatch::occluded(Ray8 &ray) const {
+	return occluded_planes(arrays(), ray);
+}
+size_t PlaneBatch::size() const {
+	return x.size();
+}
+PlaneArrays PlaneBatch::arrays() const {
+	return PlaneArrays{x.data(), y.data(), z.data(), nx.data(), ny.data(), nz.data(), material_id.data(),
+		static_cast<uint32_t>(size())};
+}
+
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <random>
+#include <cmath>
+#include "scene.h"
+#include "sphere.h"
+#include "plane.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+#include "test_scene.h"
+
+/*
+ * Fill a box in front of the camera with n randomly placed small spheres,
+ * used to test scenes with a large number of objects
+ */
+static void make_sphere_field(uint32_t n, SphereBatch &spheres){
+	std::mt19937 rng(1234);
+	std::uniform_real_distribution<float> x(-1.5f, 1.5f), y(-0.5f, 1.f), z(-0.5f, 2.5f);
+	const float radius = 0.4f / std::cbrt(static_cast<float>(n));
+	for (uint32_t i = 0; i < n; ++i){
+		const auto pos = Vec3f{x(rng), y(rng), z(rng)};
+		spheres.add(pos, radius, i % 2);
+	}
+}
+
+/*
+ * Fill a box above the scene with n small sphere and quad lights, used to test
+ * scenes with many lights. The lights emit as much power in total as the
+ * default point light with intensity total_intensity
+ */
+static void make_light_rig(uint32_t n, float total_intensity, std::vector<Light> &lights){
+	std::mt19937 rng(4321);
+	std::uniform_real_distribution<float> x(-3.f, 3.f), y(1.f, 3.f), z(-3.f, 2.f), hue(0.5f, 1.f);
+	const float radius = 0.05f;
+	const float size = 0.2f;
+	// Power of a sphere light is 4 pi^2 r^2 L and of a quad is pi A L, we want each to
+	// emit 4 pi I / n like a point light with intensity I / n
+	const float sphere_radiance = total_intensity / (static_cast<float>(M_PI) * radius * radius * n);
+	const float quad_radiance = 4.f * total_intensity / (size * size * n);
+	for (uint32_t i = 0; i < n; ++i){
+		const auto pos = Vec3f{x(rng), y(rng), z(rng)};
+		const auto color = Colorf{hue(rng), hue(rng), hue(rng)};
+		if (i % 2 == 0){
+			lights.push_back(Light::sphere(pos, radius, color * sphere_radiance));
+		}
+		else {
+			// Face the quad down towards the scene
+			lights.push_back(Light::quad(pos, Vec3f{size, 0, 0}, Vec3f{0, 0, size}, color * quad_radiance));
+		}
+	}
+}
+
+TestSceneOptions::TestSceneOptions() : n_spheres(0), n_lights(0), whitted(false){}
+
+std::unique_ptr<Scene> make_test_scene(const TestSceneOptions &options){
+	std::vector<std::shared_ptr<Geometry>> geometry;
+	SphereBatch sphere_field;
+	geometry.push_back(std::make_shared<Plane>(Vec3f{0, -0.5f, 0.5f}, Vec3f{0, 1, 0}, 1));
+	if (!options.obj_file.empty()){
+		// Place the model where the sphere would be
+		MeshData mesh;
+		if (!load_obj(options.obj_file, mesh)){
+			return nullptr;
+		}
+		mesh.fit(BBox{Vec3f{-0.5f, -0.5f, -0.5f}, Vec3f{0.5f, 0.5f, 0.5f}});
+		auto tri_mesh = std::make_shared<TriangleMesh>(std::move(mesh), 0);
+		std::cout << "Loaded " << tri_mesh->num_triangles() << " triangles from " << options.obj_file << "\n";
+		geometry.push_back(tri_mesh);
+	}
+	else if (options.n_spheres == 0){
+		geometry.push_back(std::make_shared<Sphere>(Vec3f{0}, 0.5f, 0));
+	}
+	else {
+		make_sphere_field(options.n_spheres, sphere_field);
+	}
+	if (options.whitted){
+		// A glass sphere in front of the scene and a mirror sphere behind it
+		geometry.push_back(std::make_shared<Sphere>(Vec3f{-0.55f, -0.2f, -1.f}, 0.3f, 3));
+		geometry.push_back(std::make_shared<Sphere>(Vec3f{0.9f, 0.f, 0.9f}, 0.5f, 2));
+	}
+	std::vector<Light> lights;
+	if (options.n_lights == 0){
+		lights.push_back(Light::point(Vec3f{1, 1, -2}, Colorf{50}));
+	}
+	else {
+		make_light_rig(options.n_lights, 50, lights);
+	}
+	return std::unique_ptr<Scene>{new Scene{
+		std::move(sphere_field),
+		PlaneBatch{},
+		geometry,
+		{
+			std::make_shared<LambertianMaterial>(Colorf{1, 0, 0}),
+			std::make_shared<LambertianMaterial>(Colorf{0, 0, 1}),
+			std::make_shared<MirrorMaterial>(Colorf{0.9f}),
+			std::make_shared<GlassMaterial>(Colorf{1}, 1.5f)
+		},
+		lights
+	}};
+}
+SceneCamera test_scene_camera(){
+	return SceneCamera{Vec3f{0, 0, -3}, Vec3f{0, 0, 0}, Vec3f{0, 1, 0}, 60.f};
+}
+
@@ -0,0 +1,54 @@
+#include <algorithm>
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(uint32_t n) : generation(0), running(0), quit(false){
+	if (n == 0){
+		n = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	workers.reserve(n);
+	for (uint32_t i = 0; i < n; ++i){
+		workers.emplace_back(&ThreadPool::worker_loop, this, i);
+	}
+}
+ThreadPool::~ThreadPool(){
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	task_ready.notify_all();
+	for (auto &w : workers){
+		w.join();
+	}
+}
+void ThreadPool::run(const std::function<void(uint32_t)> &fn){
+	std::unique_lock<std::mutex> lock(mutex);
+	task = fn;
+	running = workers.size();
+	++generation;
+	task_ready.notify_all();
+	task_done.wait(lock, [&](){ return running == 0; });
+	task = nullptr;
+}
+uint32_t ThreadPool::size() const {
+	return workers.size();
+}
+void ThreadPool::worker_loop(uint32_t id){
+	uint64_t seen = 0;
+	for (;;){
+		std::unique_lock<std::mutex> lock(mutex);
+		task_ready.wait(lock, [&](){ return quit || generation != seen; });
+		if (quit){
+			return;
+		}
+		seen = generation;
+		lock.unlock();
+
+		task(id);
+
+		lock.lock();
+		if (--running == 0){
+			task_done.notify_one();
+		}
+	}
+}
+
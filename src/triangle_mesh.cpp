@@ -0,0 +1,155 @@
+#include <algorithm>
+#include "triangle_mesh.h"
+
+void MeshData::fit(const BBox &box){
+	BBox mesh_box;
+	for (const auto &v : vertices){
+		mesh_box.extend(v);
+	}
+	const auto mesh_size = mesh_box.max - mesh_box.min;
+	const auto box_size = box.max - box.min;
+	float scale = INFINITY;
+	for (int i = 0; i < 3; ++i){
+		if (mesh_size[i] > 0){
+			scale = std::min(scale, box_size[i] / mesh_size[i]);
+		}
+	}
+	if (!std::isfinite(scale)){
+		scale = 1;
+	}
+	const auto mesh_center = mesh_box.centroid();
+	const auto box_center = box.centroid();
+	for (auto &v : vertices){
+		v = (v - mesh_center) * scale + box_center;
+	}
+}
+
+TriangleMesh::TriangleMesh(MeshData data, int material_id)
+	: material_id(material_id), vertex_store(std::move(data.vertices)), normal_store(std::move(data.normals)),
+	index_store(std::move(data.indices))
+{
+	// Compute area weighted smooth normals if the mesh doesn't have any
+	if (normal_store.size() != vertex_store.size()){
+		normal_store = std::vector<Vec3f>(vertex_store.size(), Vec3f{0, 0, 0});
+		for (size_t i = 0; i < index_store.size(); i += 3){
+			const auto &v0 = vertex_store[index_store[i]];
+			const auto n = (vertex_store[index_store[i + 1]] - v0).cross(vertex_store[index_store[i + 2]] - v0);
+			for (size_t j = 0; j < 3; ++j){
+				normal_store[index_store[i + j]] = normal_store[index_store[i + j]] + n;
+			}
+		}
+		for (auto &n : normal_store){
+			if (n.length_sqr() > 0){
+				n = n.normalized();
+			}
+		}
+	}
+	vertices = vertex_store;
+	normals = normal_store;
+	indices = index_store;
+	std::vector<BBox> tri_bounds(num_triangles());
+	for (uint32_t i = 0; i < num_triangles(); ++i){
+		for (uint32_t j = 0; j < 3; ++j){
+			tri_bounds[i].extend(vertices[indices[3 * i + j]]);
+		}
+	}
+	bvh = BVH{tri_bounds};
+}
+TriangleMesh::TriangleMesh(ArrayView<Vec3f> vertices, ArrayView<Vec3f> normals, ArrayView<uint32_t> indices,
+		int material_id, BVH bvh)
+	: vertices(vertices), normals(normals), indices(indices), material_id(material_id), bvh(std::move(bvh))
+{}
+__m256 TriangleMesh::intersect(Ray8 &ray, DiffGeom8 &dg) const {
+	// Track the closest triangle hit by each ray and the barycentric coordinates
+	// of the hit, the differential geometry is only computed once we've found the closest hits
+	auto tri_id = _mm256_set1_epi32(-1);
+	auto hit_u = _mm256_setzero_ps();
+	auto hit_v = _mm256_setzero_ps();
+	const auto hits = bvh.intersect(ray,
+		[&](uint32_t i, Ray8 &r){
+			__m256 u, v;
+			const auto h = intersect_triangle(i, r, u, v);
+			if (_mm256_movemask_ps(h) != 0){
+				tri_id = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(tri_id),
+						_mm256_castsi256_ps(_mm256_set1_epi32(i)), h));
+				hit_u = _mm256_blendv_ps(hit_u, u, h);
+				hit_v = _mm256_blendv_ps(hit_v, v, h);
+			}
+			return h;
+		});
+	if (_mm256_movemask_ps(hits) == 0){
+		return hits;
+	}
+	// Gather the vertex normals of the triangles hit and interpolate them
+	const auto gather_mask = _mm256_castps_si256(hits);
+	const auto tri_base = _mm256_mullo_epi32(tri_id, _mm256_set1_epi32(3));
+	const auto hit_w = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(1.f), hit_u), hit_v);
+	const __m256 weights[3] = {hit_w, hit_u, hit_v};
+	Vec3f_8 normal{0};
+	for (int j = 0; j < 3; ++j){
+		const auto vert = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)indices.data(),
+				_mm256_add_epi32(tri_base, _mm256_set1_epi32(j)), gather_mask, 4);
+		const auto base = _mm256_mullo_epi32(vert, _mm256_set1_epi32(3));
+		for (int k = 0; k < 3; ++k){
+			const auto n = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), &normals[0].x,
+					_mm256_add_epi32(base, _mm256_set1_epi32(k)), hits, 4);
+			normal[k] = _mm256_fmadd_ps(weights[j], n, normal[k]);
+		}
+	}
+	normal.normalize();
+
+	const auto point = ray.at(ray.t_max);
+	dg.point.x = _mm256_blendv_ps(dg.point.x, point.x, hits);
+	dg.point.y = _mm256_blendv_ps(dg.point.y, point.y, hits);
+	dg.point.z = _mm256_blendv_ps(dg.point.z, point.z, hits);
+	dg.normal.x = _mm256_blendv_ps(dg.normal.x, normal.x, hits);
+	dg.normal.y = _mm256_blendv_ps(dg.normal.y, normal.y, hits);
+	dg.normal.z = _mm256_blendv_ps(dg.normal.z, normal.z, hits);
+	dg.material_id = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(dg.material_id),
+			_mm256_castsi256_ps(_mm256_set1_epi32(material_id)), hits));
+	return hits;
+}
+__m256 TriangleMesh::occluded(Ray8 &ray) const {
+	return bvh.occluded(ray,
+		[&](uint32_t i, Ray8 &r){
+			// intersect_triangle shrinks t_max on a hit but we don't care
+			// about those rays anymore once they're blocked
+			__m256 u, v;
+			return intersect_triangle(i, r, u, v);
+		});
+}
+BBox TriangleMesh::bounds() const {
+	return bvh.bounds();
+}
+uint32_t TriangleMesh::num_triangles() const {
+	return indices.size() / 3;
+}
+__m256 TriangleMesh::intersect_triangle(uint32_t i, Ray8 &ray, __m256 &u, __m256 &v) const {
+	// Moller-Trumbore ray-triangle intersection, testing all 8 rays against the triangle
+	const auto &p0 = vertices[indices[3 * i]];
+	const auto e1 = Vec3f_8{vertices[indices[3 * i + 1]] - p0};
+	const auto e2 = Vec3f_8{vertices[indices[3 * i + 2]] - p0};
+	const auto p = ray.d.cross(e2);
+	const auto det = e1.dot(p);
+	// Rays parallel to the triangle plane can't hit it
+	auto hits = _mm256_cmp_ps(vabs(det), _mm256_set1_ps(1e-8f), _CMP_GT_OQ);
+	hits = _mm256_and_ps(hits, ray.active);
+	if (_mm256_movemask_ps(hits) == 0){
+		return hits;
+	}
+	const auto inv_det = _mm256_div_ps(_mm256_set1_ps(1.f), det);
+	const auto s = ray.o - Vec3f_8{p0};
+	u = _mm256_mul_ps(s.dot(p), inv_det);
+	const auto q = s.cross(e1);
+	v = _mm256_mul_ps(ray.d.dot(q), inv_det);
+	const auto zero = _mm256_setzero_ps();
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	hits = _mm256_and_ps(hits, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.f), _CMP_LE_OQ));
+	const auto t = _mm256_mul_ps(e2.dot(q), inv_det);
+	hits = _mm256_and_ps(hits, _mm256_and_ps(_mm256_cmp_ps(t, ray.t_min, _CMP_GT_OQ),
+			_mm256_cmp_ps(t, ray.t_max, _CMP_LT_OQ)));
+	ray.t_max = _mm256_blendv_ps(ray.t_max, t, hits);
+	return hits;
+}
+